@@ -55,7 +55,18 @@ enum img_opcode {
     IMG_SHARPEN,
     IMG_VERTEDGES,
     IMG_HORIZEDGES,
-    IMG_RETRIEVE
+    IMG_RETRIEVE,
+    IMG_BLUR5,
+    IMG_BLUR9,
+    IMG_BLUR15,
+    IMG_GAUSS5,
+    IMG_GAUSS7,
+    IMG_LAPLACIAN,
+    IMG_PIPELINE,
+    IMG_EDGEMAG,
+    IMG_CLONE,
+    IMG_DELETE,
+    IMG_REGISTER_PATH
 };
 
 /* String version of the opcodes */
@@ -67,7 +78,18 @@ const char * __opcode_strings [] = {
     "IMG_SHARPEN",
     "IMG_VERTEDGES",
     "IMG_HORIZEDGES",
-    "IMG_RETRIEVE"
+    "IMG_RETRIEVE",
+    "IMG_BLUR5",
+    "IMG_BLUR9",
+    "IMG_BLUR15",
+    "IMG_GAUSS5",
+    "IMG_GAUSS7",
+    "IMG_LAPLACIAN",
+    "IMG_PIPELINE",
+    "IMG_EDGEMAG",
+    "IMG_CLONE",
+    "IMG_DELETE",
+    "IMG_REGISTER_PATH"
 };
 
 /* Handy macro to render an opcode as a string */
@@ -89,6 +111,30 @@ struct request {
 	};
 };
 
+/* Payload that immediately follows an IMG_PIPELINE request. The
+ * first <length> entries of <ops> are image operation opcodes
+ * (excluding IMG_REGISTER, IMG_RETRIEVE, IMG_PIPELINE, IMG_CLONE,
+ * IMG_DELETE and IMG_REGISTER_PATH) applied in order to the image,
+ * with a single response once all are done. */
+struct pipeline {
+	uint8_t length;
+	uint8_t ops[IMG_PIPELINE_MAX];
+};
+
+/* Longest path an IMG_REGISTER_PATH request can carry */
+#define IMG_PATH_MAX 4096
+
+/* Payload that immediately follows an IMG_REGISTER_PATH request. It
+ * is followed in turn by the <length> bytes, without a terminating
+ * NUL, of the path of a 24-bit BMP file on the server's host. The
+ * server loads the file itself and registers it as if its pixels had
+ * come with an IMG_REGISTER request. Only clients on the server's
+ * host may send it, and only regular files inside the directory given
+ * to the server with -R are loaded. */
+struct image_path {
+	uint32_t length;
+};
+
 /* Response payload as sent by the server and received by the
  * client. */
 struct response {
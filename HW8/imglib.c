@@ -25,51 +25,598 @@
 *******************************************************************************/
 
 #include "imglib.h"
+#include <stddef.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IMGLIB_X86
+#endif
 
 #define pix(img, x, y)				\
-	img->pixels[((y) * img->width) + (x)]
+	img->pixels[((uint64_t)(y) * img->width) + (x)]
+
+/* Same as pix() for channel <c> of a planar image */
+#define plane_pix(img, c, x, y)				\
+	img->planes[c][((uint64_t)(y) * img->width) + (x)]
+
+/* Whether <img> holds pixel data in either layout */
+#define img_valid(img)						\
+	((img) && ((img)->layout == IMG_PLANAR ? (img)->planes[0] != NULL \
+		   : (img)->pixels != NULL))
+
+enum simd_level {
+	SIMD_SCALAR = 0,
+	SIMD_SSE2,
+	SIMD_AVX2,
+	SIMD_LEVELS
+};
+
+/* Best instruction set usable on this machine, set up by
+ * imglib_init(). It can be lowered with the IMGLIB_SIMD environment
+ * variable ("scalar", "sse2" or "avx2") to compare implementations. */
+static enum simd_level simd_level = SIMD_SCALAR;
+
+__attribute__((constructor))
+static void imglib_init(void)
+{
+	const char * force = getenv("IMGLIB_SIMD");
+	enum simd_level best = SIMD_SCALAR;
+
+#ifdef IMGLIB_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		best = SIMD_AVX2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		best = SIMD_SSE2;
+	}
+#endif
+
+	simd_level = best;
+	if (force) {
+		if (!strcmp(force, "scalar")) {
+			simd_level = SIMD_SCALAR;
+		} else if (!strcmp(force, "sse2") && best >= SIMD_SSE2) {
+			simd_level = SIMD_SSE2;
+		}
+	}
+}
+
+/* Pixel buffer pool.
+ *
+ * Pixel buffers are recycled instead of going back to malloc(): the
+ * server frees the old image right after a filter produces the new
+ * one, so the next request of the same size can reuse the same,
+ * already faulted-in memory. Buffers are grouped in size classes,
+ * four per power of two so that at most a quarter of a buffer is
+ * wasted. Freed buffers go to a small cache owned by the freeing
+ * thread, then to a global pool shared by all threads, and are only
+ * returned to malloc() once both are full. The caches and the pool
+ * together hold at most pixbuf_limit bytes, see imgSetPoolLimit().
+ * Buffers under
+ * PIXBUF_MIN_BYTES are not worth pooling and go straight to malloc().
+ *
+ * Every buffer is preceded by a header, and is aligned to a cache
+ * line for the benefit of the SIMD kernels.
+ *
+ * With imgSetHugePages(), buffers above a size threshold are mapped
+ * directly instead, 2MB-aligned and marked for transparent huge
+ * pages, and bound to the NUMA node of the thread allocating them.
+ * The pools then prefer handing out buffers from the caller's node. */
+#define PIXBUF_ALIGN       64
+#define PIXBUF_MIN_SHIFT   14    /* PIXBUF_MIN_BYTES = 16KB */
+#define PIXBUF_MIN_BYTES   (1ULL << PIXBUF_MIN_SHIFT)
+#define PIXBUF_CLASSES     ((40 - PIXBUF_MIN_SHIFT) * 4 + 1)    /* Up to 1TB */
+#define PIXBUF_UNPOOLED    PIXBUF_CLASSES
+#define PIXBUF_CACHE_DEPTH 4                    /* Buffers per class and thread */
+#define PIXBUF_CACHE_BYTES (64ULL << 20)       /* Bytes cached per thread */
+#define PIXBUF_POOL_BYTES  (256ULL << 20)      /* Default pixbuf_limit */
+#define PIXBUF_HUGE_PAGE   (2ULL << 20)
+
+struct pixbuf_hdr {
+	struct pixbuf_hdr * next;   /* Free list link while pooled */
+	uint32_t cls;               /* Size class, PIXBUF_UNPOOLED if not pooled */
+	uint32_t node;              /* NUMA node of mapped buffers */
+	uint64_t map_bytes;         /* Length of the mapping, 0 if from malloc() */
+} __attribute__((aligned(PIXBUF_ALIGN)));
+
+struct pixbuf_cache {
+	struct pixbuf_hdr * head[PIXBUF_CLASSES];
+	uint32_t count[PIXBUF_CLASSES];
+	uint64_t bytes;
+};
+
+static pthread_mutex_t pixbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pixbuf_hdr * pixbuf_pool[PIXBUF_CLASSES];
+static uint64_t pixbuf_limit = PIXBUF_POOL_BYTES;  /* Bytes kept for reuse at most */
+static uint64_t pixbuf_held = 0;                   /* Bytes in the caches and pool */
+
+static pthread_once_t pixbuf_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pixbuf_key;
+static __thread struct pixbuf_cache * pixbuf_local = NULL;
+static __thread uint8_t pixbuf_exited = 0;  /* Cache destroyed at thread exit */
+
+/* Buffers of at least this size are mapped on huge pages, 0 if off */
+static uint64_t pixbuf_huge_bytes = 0;
+
+/* NUMA node the calling thread is running on */
+static inline uint32_t pixbuf_node(void)
+{
+	unsigned cpu = 0, node = 0;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL)) {
+		return 0;
+	}
+
+	return node;
+}
+
+/* Map a 2MB-aligned region for <bytes> bytes of pixels plus header,
+ * asking for huge pages on the calling thread's node. */
+static struct pixbuf_hdr * pixbuf_map(uint64_t bytes)
+{
+	uint64_t len = (sizeof(struct pixbuf_hdr) + bytes + PIXBUF_HUGE_PAGE - 1)
+		& ~(PIXBUF_HUGE_PAGE - 1);
+	uint32_t node = pixbuf_node();
+	unsigned long nodemask = 1UL << node;
+	struct pixbuf_hdr * h;
+	uint8_t * raw, * start;
+
+	/* Over-allocate by one huge page and trim around the aligned part */
+	raw = (uint8_t *)mmap(NULL, len + PIXBUF_HUGE_PAGE, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED) {
+		return NULL;
+	}
+
+	start = (uint8_t *)(((uintptr_t)raw + PIXBUF_HUGE_PAGE - 1) & ~(PIXBUF_HUGE_PAGE - 1));
+	if (start > raw) {
+		munmap(raw, start - raw);
+	}
+	munmap(start + len, raw + PIXBUF_HUGE_PAGE - start);
+
+	/* Both are hints: without THP or NUMA support, we still have a
+	 * perfectly good buffer */
+	madvise(start, len, MADV_HUGEPAGE);
+	if (node < 8 * sizeof(nodemask)) {
+		syscall(SYS_mbind, start, len, MPOL_PREFERRED, &nodemask,
+			8 * sizeof(nodemask), 0);
+	}
+
+	h = (struct pixbuf_hdr *)start;
+	h->node = node;
+	h->map_bytes = len;
+	return h;
+}
+
+/* Give the memory of buffer <h> back to the system */
+static void pixbuf_destroy(struct pixbuf_hdr * h)
+{
+	if (h && h->map_bytes) {
+		munmap(h, h->map_bytes);
+	} else {
+		free(h);
+	}
+}
+
+/* Back pixel buffers of at least <min_bytes> bytes with huge pages
+ * on the NUMA node of the allocating thread. 0 turns this off. */
+void imgSetHugePages(uint64_t min_bytes)
+{
+	pixbuf_huge_bytes = min_bytes;
+}
+
+/* Size of the buffers in class <cls> */
+static inline uint64_t pixbuf_class_bytes(uint32_t cls)
+{
+	return (PIXBUF_MIN_BYTES << (cls / 4)) * (4 + cls % 4) / 4;
+}
+
+/* Smallest class holding <bytes>, see pixbuf_class_bytes() */
+static inline uint32_t pixbuf_class(uint64_t bytes)
+{
+	uint64_t b = bytes - 1;
+	uint32_t e;
+
+	if (bytes <= PIXBUF_MIN_BYTES) {
+		return 0;
+	}
+
+	e = 63 - __builtin_clzll(b);
+	if (e >= 40) {
+		return PIXBUF_UNPOOLED;
+	}
+
+	return (e - PIXBUF_MIN_SHIFT) * 4 + ((b >> (e - 2)) & 3) + 1;
+}
+
+/* Count <bytes> more bytes as kept for reuse. Returns 1 on success
+ * and 0 if that would go over pixbuf_limit. */
+static int pixbuf_hold(uint64_t bytes)
+{
+	uint64_t held = __atomic_add_fetch(&pixbuf_held, bytes, __ATOMIC_RELAXED);
+
+	if (held > __atomic_load_n(&pixbuf_limit, __ATOMIC_RELAXED)) {
+		__atomic_sub_fetch(&pixbuf_held, bytes, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Hand buffer <h> over to the global pool, or back to malloc() if
+ * the pool is full. */
+static void pixbuf_release(struct pixbuf_hdr * h)
+{
+	if (pixbuf_hold(pixbuf_class_bytes(h->cls))) {
+		pthread_mutex_lock(&pixbuf_lock);
+		h->next = pixbuf_pool[h->cls];
+		pixbuf_pool[h->cls] = h;
+		pthread_mutex_unlock(&pixbuf_lock);
+		return;
+	}
+
+	pixbuf_destroy(h);
+}
+
+/* Keep at most <bytes> bytes of freed pixel buffers for reuse, across
+ * the caches of all threads and the global pool. Buffers in the pool
+ * over the new limit are freed right away, those in the caches as
+ * they are handed out or their thread exits. */
+void imgSetPoolLimit(uint64_t bytes)
+{
+	struct pixbuf_hdr * freed = NULL;
+
+	__atomic_store_n(&pixbuf_limit, bytes, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&pixbuf_lock);
+	for (uint32_t cls = PIXBUF_CLASSES; cls-- > 0
+		     && __atomic_load_n(&pixbuf_held, __ATOMIC_RELAXED) > bytes; ) {
+		while (pixbuf_pool[cls] && __atomic_load_n(&pixbuf_held, __ATOMIC_RELAXED) > bytes) {
+			struct pixbuf_hdr * h = pixbuf_pool[cls];
+			pixbuf_pool[cls] = h->next;
+			__atomic_sub_fetch(&pixbuf_held, pixbuf_class_bytes(cls), __ATOMIC_RELAXED);
+			h->next = freed;
+			freed = h;
+		}
+	}
+	pthread_mutex_unlock(&pixbuf_lock);
+
+	while (freed) {
+		struct pixbuf_hdr * h = freed;
+		freed = h->next;
+		pixbuf_destroy(h);
+	}
+}
+
+/* Move the cache of an exiting thread to the global pool */
+static void pixbuf_cache_destroy(void * arg)
+{
+	struct pixbuf_cache * cache = (struct pixbuf_cache *)arg;
+
+	/* Buffers handled later in the thread's teardown, for instance
+	 * by other destructors, go straight to the global pool */
+	pixbuf_local = NULL;
+	pixbuf_exited = 1;
+
+	for (uint32_t cls = 0; cls < PIXBUF_CLASSES; cls++) {
+		while (cache->head[cls]) {
+			struct pixbuf_hdr * h = cache->head[cls];
+			cache->head[cls] = h->next;
+			__atomic_sub_fetch(&pixbuf_held, pixbuf_class_bytes(cls), __ATOMIC_RELAXED);
+			pixbuf_release(h);
+		}
+	}
+
+	free(cache);
+}
+
+static void pixbuf_key_init(void)
+{
+	pthread_key_create(&pixbuf_key, pixbuf_cache_destroy);
+}
+
+/* The calling thread's cache, NULL if it cannot be set up */
+static struct pixbuf_cache * pixbuf_cache(void)
+{
+	if (!pixbuf_local && !pixbuf_exited) {
+		pthread_once(&pixbuf_once, pixbuf_key_init);
+		pixbuf_local = (struct pixbuf_cache *)calloc(1, sizeof(struct pixbuf_cache));
+		if (pixbuf_local) {
+			pthread_setspecific(pixbuf_key, pixbuf_local);
+		}
+	}
+
+	return pixbuf_local;
+}
+
+/* Allocate a pixel buffer of at least <bytes> bytes. Its content is
+ * undefined. */
+static void * pixbuf_alloc(uint64_t bytes)
+{
+	uint32_t cls = (bytes >= PIXBUF_MIN_BYTES) ? pixbuf_class(bytes) : PIXBUF_UNPOOLED;
+	struct pixbuf_cache * cache;
+	struct pixbuf_hdr * h = NULL;
+	void * mem;
+
+	if (cls != PIXBUF_UNPOOLED) {
+		cache = pixbuf_cache();
+		if (cache && cache->head[cls]) {
+			h = cache->head[cls];
+			cache->head[cls] = h->next;
+			cache->count[cls]--;
+			cache->bytes -= pixbuf_class_bytes(cls);
+			__atomic_sub_fetch(&pixbuf_held, pixbuf_class_bytes(cls), __ATOMIC_RELAXED);
+			return h + 1;
+		}
+
+		pthread_mutex_lock(&pixbuf_lock);
+		if (pixbuf_pool[cls]) {
+			struct pixbuf_hdr ** link = &pixbuf_pool[cls];
+
+			/* Mapped buffers are bound to a node: prefer one
+			 * local to the caller, and settle for the first one
+			 * otherwise */
+			if (pixbuf_huge_bytes) {
+				uint32_t node = pixbuf_node();
+				for (struct pixbuf_hdr ** l = link; *l; l = &(*l)->next) {
+					if ((*l)->map_bytes && (*l)->node == node) {
+						link = l;
+						break;
+					}
+				}
+			}
+
+			h = *link;
+			*link = h->next;
+			__atomic_sub_fetch(&pixbuf_held, pixbuf_class_bytes(cls), __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&pixbuf_lock);
+
+		if (h) {
+			return h + 1;
+		}
+
+		bytes = pixbuf_class_bytes(cls);
+	}
+
+	if (pixbuf_huge_bytes && bytes >= pixbuf_huge_bytes) {
+		h = pixbuf_map(bytes);
+	} else if (!posix_memalign(&mem, PIXBUF_ALIGN, sizeof(struct pixbuf_hdr) + bytes)) {
+		h = (struct pixbuf_hdr *)mem;
+		h->map_bytes = 0;
+	}
+
+	if (!h) {
+		return NULL;
+	}
+
+	h->cls = cls;
+	return h + 1;
+}
+
+/* Return a buffer obtained from pixbuf_alloc() */
+static void pixbuf_free(void * buf)
+{
+	struct pixbuf_hdr * h = (struct pixbuf_hdr *)buf - 1;
+	struct pixbuf_cache * cache;
+	uint64_t bytes;
+
+	if (h->cls == PIXBUF_UNPOOLED) {
+		pixbuf_destroy(h);
+		return;
+	}
+
+	bytes = pixbuf_class_bytes(h->cls);
+	cache = pixbuf_cache();
+	if (cache && cache->count[h->cls] < PIXBUF_CACHE_DEPTH
+	    && cache->bytes + bytes <= PIXBUF_CACHE_BYTES && pixbuf_hold(bytes)) {
+		h->next = cache->head[h->cls];
+		cache->head[h->cls] = h;
+		cache->count[h->cls]++;
+		cache->bytes += bytes;
+		return;
+	}
+
+	pixbuf_release(h);
+}
+
+/* Allocate the memory and metadata for a new <width>x<height> image
+ * without initializing its pixels. */
+struct image * createImageUninit(uint32_t width, uint32_t height)
+{
+	uint64_t img_bytes = (uint64_t)height * width * sizeof(uint32_t);
+	struct image * img = (struct image*)malloc(sizeof(struct image));
+
+	if (!img) {
+		return NULL;
+	}
+	img->pixels = (uint32_t * )pixbuf_alloc(img_bytes);
+	if (!img->pixels) {
+		free(img);
+		return NULL;
+	}
+	img->width = width;
+	img->height = height;
+	img->layout = IMG_PACKED;
+	img->planes[IMG_PLANE_R] = img->planes[IMG_PLANE_G] = img->planes[IMG_PLANE_B] = NULL;
+	img->refs = 1;
+	img->mapped = 0;
+	img->orient = 0;
+	img->base = NULL;
+
+	return img;
+}
 
 /* Allocate and initialize the memory and metadata for a new
- * <width>x<height> pixels. */
+ * <width>x<height> pixels. Returns NULL if memory ran out. */
 struct image * createImage(uint32_t width, uint32_t height)
 {
-	uint64_t img_bytes = height * width * sizeof(uint32_t);
+	struct image * img = createImageUninit(width, height);
+
+	if (!img) {
+		return NULL;
+	}
+
+	/* Reset all the pixels to 0 for an all-black image */
+	memset(img->pixels, 0, (uint64_t)height * width * sizeof(uint32_t));
+
+	return img;
+}
+
+/* Same as createImageUninit() in the planar layout. The three planes
+ * share a single buffer. */
+struct image * createPlanarImageUninit(uint32_t width, uint32_t height)
+{
+	uint64_t plane_bytes = (uint64_t)height * width;
 	struct image * img = (struct image*)malloc(sizeof(struct image));
+
+	if (!img) {
+		return NULL;
+	}
+	img->planes[IMG_PLANE_R] = (uint8_t *)pixbuf_alloc(IMG_PLANES * plane_bytes);
+	if (!img->planes[IMG_PLANE_R]) {
+		free(img);
+		return NULL;
+	}
 	img->width = width;
 	img->height = height;
-	img->pixels = (uint32_t * )malloc(img_bytes);
+	img->layout = IMG_PLANAR;
+	img->pixels = NULL;
+	img->planes[IMG_PLANE_G] = img->planes[IMG_PLANE_R] + plane_bytes;
+	img->planes[IMG_PLANE_B] = img->planes[IMG_PLANE_G] + plane_bytes;
+	img->refs = 1;
+	img->mapped = 0;
+	img->orient = 0;
+	img->base = NULL;
 
-	/* Reset all the pixels to 0 for an all-black image */
-	memset(img->pixels, 0, img_bytes);
+	return img;
+}
+
+/* Allocate a new all-black <width>x<height> image in the planar
+ * layout. */
+struct image * createPlanarImage(uint32_t width, uint32_t height)
+{
+	struct image * img = createPlanarImageUninit(width, height);
+
+	if (!img) {
+		return NULL;
+	}
+
+	memset(img->planes[IMG_PLANE_R], 0, IMG_PLANES * (uint64_t)height * width);
 
 	return img;
 }
 
+/* Allocate a new <width>x<height> image with the same layout as
+ * <img>, for kernels that write every pixel of their output. */
+static struct image * createImageLike(const struct image * img, uint32_t width,
+				      uint32_t height)
+{
+	if (img->layout == IMG_PLANAR) {
+		return createPlanarImageUninit(width, height);
+	}
+
+	return createImageUninit(width, height);
+}
+
 /* Deallocate all the memory for a given image. */
 void deleteImage(struct image * img)
 {
+	/* Other references keep the image alive */
+	if (img && __atomic_sub_fetch(&img->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	/* Views only hold a reference to the image they show */
+	if (img && img->base) {
+		deleteImage(img->base);
+	}
+
+	/* File mappings are not part of the pool */
+	if (img && img->mapped) {
+		void * base = (img->layout == IMG_PLANAR) ? (void *)img->planes[IMG_PLANE_R]
+			: (void *)img->pixels;
+		munmap(base, imageBytes(img));
+		img->pixels = NULL;
+		img->planes[IMG_PLANE_R] = NULL;
+	}
+
 	/* Remove image payload, if any. */
 	if (img && img->pixels) {
-		free(img->pixels);
+		pixbuf_free(img->pixels);
 		img->pixels = NULL;
 	}
 
+	if (img && img->layout == IMG_PLANAR && img->planes[IMG_PLANE_R]) {
+		pixbuf_free(img->planes[IMG_PLANE_R]);
+		img->planes[IMG_PLANE_R] = NULL;
+	}
+
 	/* Deallocate image metadata */
 	if (img) {
 		free(img);
 	}
 }
 
+/* Take an extra reference to <img> and return it */
+struct image * shareImage(struct image * img)
+{
+	if (img) {
+		__atomic_add_fetch(&img->refs, 1, __ATOMIC_RELAXED);
+	}
+
+	return img;
+}
+
+/* Whether more than one reference to <img> is held */
+uint8_t isImageShared(const struct image * img)
+{
+	return img && __atomic_load_n(&img->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+/* Find the pixel of the image shown by the view <img> that appears
+ * at (<x>,<y>) in the view. See rotate_rows() for where one turn
+ * moves each pixel. */
+static inline void view_coords(const struct image * img, uint32_t * x, uint32_t * y)
+{
+	uint32_t vx = *x, vy = *y;
+
+	switch (img->orient) {
+	case 1:
+		*x = img->base->width - 1 - vy;
+		*y = vx;
+		break;
+	case 2:
+		*x = img->base->width - 1 - vx;
+		*y = img->base->height - 1 - vy;
+		break;
+	case 3:
+		*x = vy;
+		*y = img->base->height - 1 - vx;
+		break;
+	}
+}
+
 /* Set a specific pixel at position (<x>,<y>) in the image <img> to a
  * specific <value>. The function returns 0 if the operation is
  * successful and 1 in case of error. */
 uint8_t setPixel(struct image * img, uint32_t x, uint32_t y, uint32_t value) {
-	if (!img || !img->pixels) {
+	if (!img_valid(img)) {
 		return 1;
 	}
 
 	if (x < img->width && y < img->height) {
-		pix(img, x, y) = value;
+		if (img->layout == IMG_PLANAR) {
+			plane_pix(img, IMG_PLANE_R, x, y) = (value >> 16) & 0xFF;
+			plane_pix(img, IMG_PLANE_G, x, y) = (value >> 8) & 0xFF;
+			plane_pix(img, IMG_PLANE_B, x, y) = value & 0xFF;
+		} else {
+			pix(img, x, y) = value;
+		}
 		return 0;
 	}
 
@@ -85,7 +632,13 @@ uint8_t setPixel(struct image * img, uint32_t x, uint32_t y, uint32_t value) {
  * has occurred. In case of error, 0 is returned by the function.
 */
 uint32_t getPixel(const struct image * img, uint32_t x, uint32_t y, uint8_t * err) {
-	if (!img || !img->pixels) {
+	/* Views are read through their orientation */
+	if (img && img->base && x < img->width && y < img->height) {
+		view_coords(img, &x, &y);
+		return getPixel(img->base, x, y, err);
+	}
+
+	if (!img_valid(img)) {
 		if (err) {
 			*err = 1;
 		}
@@ -96,6 +649,11 @@ uint32_t getPixel(const struct image * img, uint32_t x, uint32_t y, uint8_t * er
 		if (err) {
 			*err = 0;
 		}
+		if (img->layout == IMG_PLANAR) {
+			return ((uint32_t)plane_pix(img, IMG_PLANE_R, x, y) << 16)
+				| ((uint32_t)plane_pix(img, IMG_PLANE_G, x, y) << 8)
+				| plane_pix(img, IMG_PLANE_B, x, y);
+		}
 		return pix(img, x, y);
 	}
 
@@ -117,7 +675,12 @@ uint32_t getPixel(const struct image * img, uint32_t x, uint32_t y, uint8_t * er
 */
 struct image * cloneImage(const struct image * src, uint8_t * err) {
 
-	if(!src || !src->pixels) {
+	/* The copy of a view holds its pixels in the canonical layout */
+	if (src && src->base) {
+		return resolveView(src, err);
+	}
+
+	if(!img_valid(src)) {
 		if (err) {
 			*err = 1;
 		}
@@ -125,10 +688,10 @@ struct image * cloneImage(const struct image * src, uint8_t * err) {
 	}
 
 	/* Create an empty destination image */
-	uint64_t img_bytes = src->height * src->width * sizeof(uint32_t);
-	struct image * dest = createImage(src->width, src->height);
+	uint64_t img_bytes = (uint64_t)src->height * src->width * sizeof(uint32_t);
+	struct image * dest = createImageLike(src, src->width, src->height);
 
-	if(!dest || !dest->pixels) {
+	if(!img_valid(dest)) {
 		if (err) {
 			*err = 1;
 		}
@@ -136,7 +699,12 @@ struct image * cloneImage(const struct image * src, uint8_t * err) {
 	}
 
 	/* Copy over all the content from the source image */
-	memcpy(dest->pixels, src->pixels, img_bytes);
+	if (src->layout == IMG_PLANAR) {
+		memcpy(dest->planes[IMG_PLANE_R], src->planes[IMG_PLANE_R],
+		       (uint64_t)src->height * src->width * IMG_PLANES);
+	} else {
+		memcpy(dest->pixels, src->pixels, img_bytes);
+	}
 
 	if(err) {
 		*err = 0;
@@ -145,107 +713,1936 @@ struct image * cloneImage(const struct image * src, uint8_t * err) {
 	return dest;
 }
 
-/* Creates a new image by rotating the input image by 90 degreees
- * clockwise. NOTE: the original image must be manually deallocated if
- * not needed. If successful, the function returns a pointer to the
- * new image.
- *
- * If <err> is not NULL, the function sets 0 in the err parameter if
- * retrieval of the selected pixel is successful, and 1 if an error
- * has occurred. In case of error, NULL is returned by the function.
-*/
-struct image * rotate90Clockwise(const struct image * img, uint8_t * err) {
-    struct image * rotated;
-    uint32_t y, x;
+/* Split <count> packed pixels into the three planes <r>, <g> and <b> */
+static void pack_to_planes(const uint32_t * in, uint8_t * r, uint8_t * g,
+			   uint8_t * b, uint64_t count)
+{
+	for (uint64_t i = 0; i < count; i++) {
+		uint32_t pixel = in[i];
+		r[i] = (pixel >> 16) & 0xFF;
+		g[i] = (pixel >> 8) & 0xFF;
+		b[i] = pixel & 0xFF;
+	}
+}
 
-    if (!img || !img->pixels) {
-	    if (err) {
-		    *err = 1;
-	    }
-	    return NULL;
-    }
+/* Merge <count> values of the planes <r>, <g> and <b> into packed pixels */
+static void planes_to_pack(const uint8_t * r, const uint8_t * g,
+			   const uint8_t * b, uint32_t * out, uint64_t count)
+{
+	for (uint64_t i = 0; i < count; i++) {
+		out[i] = ((uint32_t)r[i] << 16) | ((uint32_t)g[i] << 8) | b[i];
+	}
+}
 
-    rotated = createImage(img->height, img->width);
+struct image * toPlanarImage(const struct image * img, uint8_t * err) {
+	struct image * out;
 
-    for (y = 0; y < img->height; y++) {
-        for (x = 0; x < img->width; x++) {
-            uint32_t newX = y;
-            uint32_t newY = img->width - x - 1;
-            pix(rotated, newX, newY) = pix(img, x, y);
-        }
-    }
+	if (img && img->base && img->layout != IMG_PLANAR) {
+		struct image * canon = resolveView(img, NULL);
+		out = toPlanarImage(canon, err);
+		deleteImage(canon);
+		return out;
+	}
 
-    if (err) {
-	    *err = 0;
-    }
+	if (!img_valid(img) || img->layout == IMG_PLANAR) {
+		return cloneImage(img, err);
+	}
 
-    return rotated;
-}
+	out = createPlanarImageUninit(img->width, img->height);
+	if (!img_valid(out)) {
+		if (err) {
+			*err = 1;
+		}
+		return NULL;
+	}
 
-/**
- * @brief Blur an image using a 3x3 averaging kernel.
- *
- * This function applies a 3x3 averaging kernel to each pixel in the image, resulting in 
- * a blurred effect. Edge pixels are not blurred to keep the implementation simple.
- *
- * @param img The original image to be blurred.
- * @return A new image structure containing the blurred image. The original image remains 
- *         unchanged.
- *
- * If @err is not NULL, the function sets 0 in the err parameter if
- * retrieval of the selected pixel is successful, and 1 if an error
- * has occurred. In case of error, NULL is returned by the function.
- *
- * Note: The returned image structure should be freed using the deleteImage function 
- *       to avoid memory leaks.
- */
-struct image* blurImage(const struct image* img, uint8_t * err) {
-    struct image* blurredImg;
-    uint32_t x, y;
+	pack_to_planes(img->pixels, out->planes[IMG_PLANE_R], out->planes[IMG_PLANE_G],
+		       out->planes[IMG_PLANE_B], (uint64_t)img->width * img->height);
 
-    if (!img || !img->pixels) {
-	    if (err) {
-		    *err = 1;
-	    }
-	    return NULL;
-    }
+	if (err) {
+		*err = 0;
+	}
 
-    blurredImg = createImage(img->width, img->height);
-
-    for (y = 0; y < img->height; y++) {
-        for (x = 0; x < img->width; x++) {
-            // For simplicity, edge pixels are not blurred
-            if (y == 0 || x == 0 || y == img->height - 1 || x == img->width - 1) {
-		    pix(blurredImg, x, y) = pix(img, x, y);
-            } else {
-                uint32_t sumR = 0, sumG = 0, sumB = 0;
-
-                // Convolve with the kernel
-                for (int ky = -1; ky <= 1; ky++) {
-                    for (int kx = -1; kx <= 1; kx++) {
-			    uint32_t pixel = pix(img, x + kx, y + ky);
-			    sumR += (pixel >> 16) & 0xFF;
-			    sumG += (pixel >> 8) & 0xFF;
-			    sumB += pixel & 0xFF;
-                    }
-                }
-
-                // Average the sums to get the new pixel value
-                sumR /= 9;
-                sumG /= 9;
-                sumB /= 9;
-
-                pix(blurredImg, x, y) = (sumR << 16) | (sumG << 8) | sumB;
-            }
-        }
-    }
+	return out;
+}
 
-    if (err) {
-	    *err = 0;
-    }
+struct image * toPackedImage(const struct image * img, uint8_t * err) {
+	struct image * out;
 
-    return blurredImg;
-}
+	if (img && img->base && img->layout != IMG_PACKED) {
+		struct image * canon = resolveView(img, NULL);
+		out = toPackedImage(canon, err);
+		deleteImage(canon);
+		return out;
+	}
+
+	if (!img_valid(img) || img->layout == IMG_PACKED) {
+		return cloneImage(img, err);
+	}
+
+	out = createImageUninit(img->width, img->height);
+	planes_to_pack(img->planes[IMG_PLANE_R], img->planes[IMG_PLANE_G],
+		       img->planes[IMG_PLANE_B], out->pixels,
+		       (uint64_t)img->width * img->height);
+
+	if (err) {
+		*err = 0;
+	}
+
+	return out;
+}
+
+/* Number of bytes of pixel data held by <img> */
+uint64_t imageBytes(const struct image * img)
+{
+	uint64_t count = (uint64_t)img->width * img->height;
+
+	return (img->layout == IMG_PLANAR) ? count * IMG_PLANES : count * sizeof(uint32_t);
+}
+
+/* Write the pixel data of <img> at <offset> in <fd> */
+uint8_t storeImage(const struct image * img, int fd, uint64_t offset)
+{
+	const char * bufptr;
+	uint64_t to_write;
+
+	/* Views are stored in the canonical layout, so that mapImage()
+	 * gives back the same content */
+	if (img && img->base) {
+		struct image * canon = resolveView(img, NULL);
+		uint8_t ret = storeImage(canon, fd, offset);
+
+		deleteImage(canon);
+		return ret;
+	}
+
+	if (!img_valid(img)) {
+		return 1;
+	}
+
+	bufptr = (img->layout == IMG_PLANAR) ? (const char *)img->planes[IMG_PLANE_R]
+		: (const char *)img->pixels;
+	to_write = imageBytes(img);
+
+	while (to_write) {
+		ssize_t cur = pwrite(fd, bufptr, to_write, offset);
+		if (cur <= 0) {
+			return 1;
+		}
+		bufptr += cur;
+		offset += cur;
+		to_write -= cur;
+	}
+
+	return 0;
+}
+
+/* Map an image written by storeImage() at <offset> in <fd> */
+struct image * mapImage(int fd, uint64_t offset, uint32_t width, uint32_t height,
+			enum img_layout layout, uint8_t prefetch)
+{
+	struct image * img = (struct image *)malloc(sizeof(struct image));
+	uint64_t bytes;
+	void * base;
+
+	if (!img) {
+		return NULL;
+	}
+
+	img->width = width;
+	img->height = height;
+	img->layout = layout;
+	bytes = imageBytes(img);
+
+	/* Writes go to private copies of the pages */
+	base = bytes ? mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset)
+		: MAP_FAILED;
+	if (base == MAP_FAILED) {
+		free(img);
+		return NULL;
+	}
+
+	if (prefetch) {
+		madvise(base, bytes, MADV_WILLNEED);
+	}
+
+	if (layout == IMG_PLANAR) {
+		img->pixels = NULL;
+		img->planes[IMG_PLANE_R] = (uint8_t *)base;
+		img->planes[IMG_PLANE_G] = img->planes[IMG_PLANE_R] + bytes / IMG_PLANES;
+		img->planes[IMG_PLANE_B] = img->planes[IMG_PLANE_G] + bytes / IMG_PLANES;
+	} else {
+		img->pixels = (uint32_t *)base;
+		img->planes[IMG_PLANE_R] = img->planes[IMG_PLANE_G] = img->planes[IMG_PLANE_B] = NULL;
+	}
+	img->refs = 1;
+	img->mapped = 1;
+	img->orient = 0;
+	img->base = NULL;
+
+	return img;
+}
+
+/* Image compression.
+ *
+ * Each channel is coded separately: packed images as four channels
+ * (including the alpha byte), planar ones as three. Every value is
+ * predicted with the median edge detector of LOCO-I from its left,
+ * top and top-left neighbors, and the residuals are zigzag-mapped so
+ * that small ones in either direction get small codes. They are then
+ * stored in blocks of BLOB_BLOCK, each as a byte with the bit width
+ * of its largest residual followed by the residuals packed with that
+ * width. */
+
+#define BLOB_BLOCK 16
+
+/* Predict a value from its <left>, <up> and <upleft> neighbors */
+static inline uint8_t blob_predict(int left, int up, int upleft)
+{
+	int mx = (left > up) ? left : up;
+	int mn = (left < up) ? left : up;
+
+	if (upleft >= mx) {
+		return mn;
+	} else if (upleft <= mn) {
+		return mx;
+	}
+
+	return left + up - upleft;
+}
+
+/* Append a block of BLOB_BLOCK residuals <z> at <out> */
+static uint8_t * blob_pack(const uint8_t * z, uint8_t * out)
+{
+	uint8_t all = 0, w = 0;
+	uint64_t acc = 0;
+	uint32_t i, bits = 0;
+
+	for (i = 0; i < BLOB_BLOCK; i++) {
+		all |= z[i];
+	}
+	while (all >> w) {
+		w++;
+	}
+
+	*out++ = w;
+	for (i = 0; i < BLOB_BLOCK; i++) {
+		acc |= (uint64_t)z[i] << bits;
+		for (bits += w; bits >= 8; bits -= 8) {
+			*out++ = (uint8_t)acc;
+			acc >>= 8;
+		}
+	}
+
+	return out;
+}
+
+/* Read a block of BLOB_BLOCK residuals from <in> into <z> */
+static const uint8_t * blob_unpack(const uint8_t * in, uint8_t * z)
+{
+	uint8_t w = *in++;
+	uint64_t acc = 0;
+	uint32_t i, bits = 0;
+
+	for (i = 0; i < BLOB_BLOCK; i++) {
+		while (bits < w) {
+			acc |= (uint64_t)*in++ << bits;
+			bits += 8;
+		}
+		z[i] = acc & ((1U << w) - 1);
+		acc >>= w;
+		bits -= w;
+	}
+
+	return in;
+}
+
+/* Predicted value at (<x>, <y>) of a channel with rows <stride>
+ * bytes long, whose values are <step> bytes apart in <p> */
+#define BLOB_PREDICT(p, x, y, step, stride)				\
+	((y) == 0 ? ((x) ? (p)[-(ptrdiff_t)(step)] : 0)			\
+	 : (x) == 0 ? (p)[-(ptrdiff_t)(stride)]				\
+	 : blob_predict((p)[-(ptrdiff_t)(step)], (p)[-(ptrdiff_t)(stride)], \
+			(p)[-(ptrdiff_t)((stride) + (step))]))
+
+/* Append the values of a <width>x<height> channel, <step> bytes apart
+ * in <p>, at <out> */
+static uint8_t * blob_encode_channel(const uint8_t * p, uint32_t step, uint32_t width,
+				     uint32_t height, uint8_t * out)
+{
+	uint64_t stride = (uint64_t)width * step;
+	uint8_t z[BLOB_BLOCK];
+	uint32_t x, y, n = 0;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++, p += step) {
+			uint8_t r = *p - BLOB_PREDICT(p, x, y, step, stride);
+			z[n++] = (uint8_t)(r << 1) ^ (uint8_t)-(r >> 7);
+			if (n == BLOB_BLOCK) {
+				out = blob_pack(z, out);
+				n = 0;
+			}
+		}
+	}
+
+	if (n) {
+		memset(z + n, 0, BLOB_BLOCK - n);
+		out = blob_pack(z, out);
+	}
+
+	return out;
+}
+
+/* Decode the values of a <width>x<height> channel from <in> into <p>,
+ * <step> bytes apart */
+static const uint8_t * blob_decode_channel(const uint8_t * in, uint8_t * p, uint32_t step,
+					   uint32_t width, uint32_t height)
+{
+	uint64_t stride = (uint64_t)width * step;
+	uint8_t z[BLOB_BLOCK];
+	uint32_t x, y, n = BLOB_BLOCK;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++, p += step) {
+			uint8_t r;
+			if (n == BLOB_BLOCK) {
+				in = blob_unpack(in, z);
+				n = 0;
+			}
+			r = z[n++];
+			r = (r >> 1) ^ (uint8_t)-(r & 1);
+			*p = BLOB_PREDICT(p, x, y, step, stride) + r;
+		}
+	}
+
+	return in;
+}
+
+/* Compress <img> into a new blob */
+struct image_blob * compressImage(const struct image * img)
+{
+	struct image_blob * blob, * shrunk;
+	uint64_t count, blocks;
+	uint32_t c, nchannels;
+	uint8_t * out;
+
+	if (img && img->base) {
+		struct image * canon = resolveView(img, NULL);
+
+		blob = compressImage(canon);
+		deleteImage(canon);
+		return blob;
+	}
+
+	if (!img_valid(img)) {
+		return NULL;
+	}
+
+	count = (uint64_t)img->width * img->height;
+	nchannels = (img->layout == IMG_PLANAR) ? IMG_PLANES : sizeof(uint32_t);
+	blocks = (count + BLOB_BLOCK - 1) / BLOB_BLOCK;
+
+	/* Incompressible blocks take one extra byte each */
+	blob = (struct image_blob *)malloc(sizeof(struct image_blob)
+					   + nchannels * blocks * (BLOB_BLOCK + 1));
+	if (!blob) {
+		return NULL;
+	}
+
+	blob->width = img->width;
+	blob->height = img->height;
+	blob->layout = img->layout;
+	out = blob->data;
+
+	for (c = 0; c < nchannels; c++) {
+		if (img->layout == IMG_PLANAR) {
+			out = blob_encode_channel(img->planes[c], 1, img->width, img->height, out);
+		} else {
+			out = blob_encode_channel((const uint8_t *)img->pixels + c,
+						  sizeof(uint32_t), img->width, img->height, out);
+		}
+	}
+
+	blob->bytes = out - blob->data;
+	shrunk = (struct image_blob *)realloc(blob, sizeof(struct image_blob) + blob->bytes);
+
+	return shrunk ? shrunk : blob;
+}
+
+/* Create a new image from <blob> */
+struct image * decompressImage(const struct image_blob * blob)
+{
+	struct image * img;
+	const uint8_t * in;
+	uint32_t c;
+
+	if (!blob) {
+		return NULL;
+	}
+
+	in = blob->data;
+
+	if (blob->layout == IMG_PLANAR) {
+		img = createPlanarImageUninit(blob->width, blob->height);
+		for (c = 0; c < IMG_PLANES; c++) {
+			in = blob_decode_channel(in, img->planes[c], 1, blob->width, blob->height);
+		}
+	} else {
+		img = createImageUninit(blob->width, blob->height);
+		for (c = 0; c < sizeof(uint32_t); c++) {
+			in = blob_decode_channel(in, (uint8_t *)img->pixels + c,
+						 sizeof(uint32_t), blob->width, blob->height);
+		}
+	}
+
+	return img;
+}
+
+/* Whether <a> and <b> hold the same pixels. Packed and planar images
+ * are compared on their R, G and B channels. */
+uint8_t imagesEqual(const struct image * a, const struct image * b)
+{
+	uint64_t count, i;
+
+	if (a && b && (a->base || b->base)) {
+		struct image * ca = a->base ? resolveView(a, NULL) : NULL;
+		struct image * cb = b->base ? resolveView(b, NULL) : NULL;
+		uint8_t equal = imagesEqual(ca ? ca : a, cb ? cb : b);
+
+		deleteImage(ca);
+		deleteImage(cb);
+		return equal;
+	}
+
+	if (!img_valid(a) || !img_valid(b) || a->width != b->width
+	    || a->height != b->height) {
+		return 0;
+	}
+
+	count = (uint64_t)a->width * a->height;
+	if (a->layout == IMG_PACKED && b->layout == IMG_PACKED) {
+		return !memcmp(a->pixels, b->pixels, count * sizeof(uint32_t));
+	} else if (a->layout == IMG_PLANAR && b->layout == IMG_PLANAR) {
+		return !memcmp(a->planes[IMG_PLANE_R], b->planes[IMG_PLANE_R],
+			       count * IMG_PLANES);
+	}
+
+	if (a->layout == IMG_PLANAR) {
+		const struct image * tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	for (i = 0; i < count; i++) {
+		uint32_t pixel = a->pixels[i];
+		if (((pixel >> 16) & 0xFF) != b->planes[IMG_PLANE_R][i]
+		    || ((pixel >> 8) & 0xFF) != b->planes[IMG_PLANE_G][i]
+		    || (pixel & 0xFF) != b->planes[IMG_PLANE_B][i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Row-band parallel execution.
+ *
+ * A parallel operation is split into bands of rows that can be
+ * computed independently of each other. The calling thread always
+ * works through the bands of its own operation; helper threads from
+ * the persistent pool started with imgPoolInit() join in while bands
+ * are left, up to the number of threads the caller asked for. Several
+ * operations can be in flight at the same time, each caller waiting
+ * only for its own bands. */
+
+/* More bands than threads evens out bands that finish early */
+#define PAR_BANDS_PER_THREAD 4
+
+struct par_job {
+	void (*fn)(void * arg, uint32_t band, uint32_t nbands);
+	void * arg;
+	uint32_t nbands;
+	uint32_t next;          /* Next band to hand out */
+	uint32_t pending;       /* Bands handed out or not, but not done */
+	uint32_t helpers;       /* Helper threads currently on this job */
+	uint32_t max_helpers;
+	struct par_job * next_job;
+};
+
+static pthread_mutex_t par_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t par_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t par_done = PTHREAD_COND_INITIALIZER;
+/* Jobs that still have bands to hand out, protected by par_lock */
+static struct par_job * par_jobs = NULL;
+static pthread_t * par_threads = NULL;
+static uint32_t par_nthreads = 0;
+static int par_stop = 0;
+
+/* Hand out the next band of <job>, dropping the job from the list of
+ * open jobs once its last band is taken. Called with par_lock held. */
+static uint32_t par_claim(struct par_job * job)
+{
+	uint32_t band = job->next++;
+
+	if (job->next == job->nbands) {
+		struct par_job ** link = &par_jobs;
+		while (*link != job) {
+			link = &(*link)->next_job;
+		}
+		*link = job->next_job;
+	}
+
+	return band;
+}
+
+static void * par_helper(void * arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&par_lock);
+	while (!par_stop) {
+		struct par_job * job = par_jobs;
+		uint32_t band;
+
+		while (job && job->helpers >= job->max_helpers) {
+			job = job->next_job;
+		}
+
+		if (!job) {
+			pthread_cond_wait(&par_work, &par_lock);
+			continue;
+		}
+
+		job->helpers++;
+		band = par_claim(job);
+		pthread_mutex_unlock(&par_lock);
+
+		job->fn(job->arg, band, job->nbands);
+
+		pthread_mutex_lock(&par_lock);
+		/* The owner may return as soon as pending drops to 0, so
+		 * the job must not be touched after this point. */
+		job->helpers--;
+		if (--job->pending == 0) {
+			pthread_cond_broadcast(&par_done);
+		}
+	}
+	pthread_mutex_unlock(&par_lock);
+
+	return NULL;
+}
+
+/* Run <fn> on every band in [0, <nbands>) using up to <nthreads>
+ * threads including the caller, and return once all are done. */
+static void par_run(void (*fn)(void * arg, uint32_t band, uint32_t nbands),
+		    void * arg, uint32_t nbands, uint32_t nthreads)
+{
+	struct par_job job = { fn, arg, nbands, 0, nbands, 0,
+			       nthreads ? nthreads - 1 : 0, NULL };
+
+	if (nbands <= 1 || job.max_helpers == 0 || par_nthreads == 0) {
+		for (uint32_t band = 0; band < nbands; band++) {
+			fn(arg, band, nbands);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&par_lock);
+	job.next_job = par_jobs;
+	par_jobs = &job;
+	pthread_cond_broadcast(&par_work);
+
+	while (job.next < job.nbands) {
+		uint32_t band = par_claim(&job);
+		pthread_mutex_unlock(&par_lock);
+		fn(arg, band, nbands);
+		pthread_mutex_lock(&par_lock);
+		job.pending--;
+	}
+
+	while (job.pending) {
+		pthread_cond_wait(&par_done, &par_lock);
+	}
+	pthread_mutex_unlock(&par_lock);
+}
+
+/* Number of bands to split <total> rows into when using <nthreads>
+ * threads, keeping band boundaries on multiples of <align>. */
+static uint32_t par_nbands(uint32_t total, uint32_t align, uint32_t nthreads)
+{
+	uint32_t wanted = nthreads * PAR_BANDS_PER_THREAD;
+	uint32_t max = (total + align - 1) / align;
+
+	if (nthreads <= 1 || max <= 1) {
+		return 1;
+	}
+
+	return (wanted < max) ? wanted : max;
+}
+
+/* Rows [<first>, <last>) covered by <band> out of <nbands> when
+ * splitting <total> rows with boundaries on multiples of <align>.
+ * Trailing bands may be empty. */
+static void par_band_rows(uint32_t total, uint32_t align, uint32_t band,
+			  uint32_t nbands, uint32_t * first, uint32_t * last)
+{
+	uint64_t chunk = ((uint64_t)total + nbands - 1) / nbands;
+
+	chunk = (chunk + align - 1) / align * align;
+	*first = (band * chunk < total) ? band * chunk : total;
+	*last = (*first + chunk < total) ? *first + chunk : total;
+}
+
+/* Start <helpers> threads that lend a hand to the *_par() functions.
+ * The function returns 0 if the operation is successful and 1 in case
+ * of error. */
+uint8_t imgPoolInit(uint32_t helpers)
+{
+	if (par_threads || helpers == 0) {
+		return par_threads ? 1 : 0;
+	}
+
+	par_threads = (pthread_t *)malloc(helpers * sizeof(pthread_t));
+	if (!par_threads) {
+		return 1;
+	}
+
+	par_stop = 0;
+	for (par_nthreads = 0; par_nthreads < helpers; par_nthreads++) {
+		if (pthread_create(&par_threads[par_nthreads], NULL, par_helper, NULL)) {
+			imgPoolDestroy();
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Stop and join all the helper threads. Must not be called while
+ * *_par() functions are running. */
+void imgPoolDestroy(void)
+{
+	pthread_mutex_lock(&par_lock);
+	par_stop = 1;
+	pthread_cond_broadcast(&par_work);
+	pthread_mutex_unlock(&par_lock);
+
+	for (uint32_t i = 0; i < par_nthreads; i++) {
+		pthread_join(par_threads[i], NULL);
+	}
+
+	free(par_threads);
+	par_threads = NULL;
+	par_nthreads = 0;
+}
+
+/* Rotation and in-place transposition work on 8x8 tiles: a tile is
+ * loaded one source row per register, transposed in registers and
+ * stored one destination row per register. Tiles are visited in
+ * groups of 64x64 pixels to keep the destination lines they touch in
+ * cache until they are fully written. */
+#define ROT_TILE  8
+#define ROT_GROUP 64
+
+/* Transpose the 8x8 tile at <src> (row stride <ss>) so that source
+ * column j is stored as the row at <dst> + j * <ds>. A negative <ds>
+ * turns the transposition into a clockwise rotation. */
+typedef void (*rot_tile_fn)(const uint32_t * src, ptrdiff_t ss,
+			    uint32_t * dst, ptrdiff_t ds);
+
+static void rot_tile_scalar(const uint32_t * src, ptrdiff_t ss,
+			    uint32_t * dst, ptrdiff_t ds)
+{
+	for (int j = 0; j < ROT_TILE; j++) {
+		for (int i = 0; i < ROT_TILE; i++) {
+			dst[j * ds + i] = src[i * ss + j];
+		}
+	}
+}
+
+#ifdef IMGLIB_X86
+
+/* The 8x8 tile is handled as four 4x4 blocks, each transposed with
+ * the classic unpack sequence. */
+__attribute__((target("sse2")))
+static void rot_tile_sse2(const uint32_t * src, ptrdiff_t ss,
+			  uint32_t * dst, ptrdiff_t ds)
+{
+	for (int bi = 0; bi < ROT_TILE; bi += 4) {
+		for (int bj = 0; bj < ROT_TILE; bj += 4) {
+			const uint32_t * s = src + bi * ss + bj;
+			uint32_t * d = dst + bj * ds + bi;
+			__m128i r0 = _mm_loadu_si128((const __m128i *)(s));
+			__m128i r1 = _mm_loadu_si128((const __m128i *)(s + ss));
+			__m128i r2 = _mm_loadu_si128((const __m128i *)(s + 2 * ss));
+			__m128i r3 = _mm_loadu_si128((const __m128i *)(s + 3 * ss));
+			__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+			__m128i t1 = _mm_unpackhi_epi32(r0, r1);
+			__m128i t2 = _mm_unpacklo_epi32(r2, r3);
+			__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+			_mm_storeu_si128((__m128i *)(d), _mm_unpacklo_epi64(t0, t2));
+			_mm_storeu_si128((__m128i *)(d + ds), _mm_unpackhi_epi64(t0, t2));
+			_mm_storeu_si128((__m128i *)(d + 2 * ds), _mm_unpacklo_epi64(t1, t3));
+			_mm_storeu_si128((__m128i *)(d + 3 * ds), _mm_unpackhi_epi64(t1, t3));
+		}
+	}
+}
+
+/* Full 8x8 transpose in registers: 32-bit and 64-bit unpacks build
+ * 4x4 transposes within each 128-bit lane, then lane permutes stitch
+ * the halves of each column together. */
+__attribute__((target("avx2")))
+static void rot_tile_avx2(const uint32_t * src, ptrdiff_t ss,
+			  uint32_t * dst, ptrdiff_t ds)
+{
+	__m256i r[8], t[8], u[8];
+
+	for (int i = 0; i < 8; i++) {
+		r[i] = _mm256_loadu_si256((const __m256i *)(src + i * ss));
+	}
+
+	for (int i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+
+	for (int i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+
+	for (int j = 0; j < 4; j++) {
+		_mm256_storeu_si256((__m256i *)(dst + j * ds),
+				    _mm256_permute2x128_si256(u[j], u[j + 4], 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + (j + 4) * ds),
+				    _mm256_permute2x128_si256(u[j], u[j + 4], 0x31));
+	}
+}
+
+static const rot_tile_fn rot_tile[SIMD_LEVELS] = {
+	rot_tile_scalar, rot_tile_sse2, rot_tile_avx2
+};
+
+#endif
+
+/* Same as rot_tile_fn for an 8x8 tile of bytes from a planar image */
+typedef void (*rot_tile8_fn)(const uint8_t * src, ptrdiff_t ss,
+			     uint8_t * dst, ptrdiff_t ds);
+
+static void rot_tile8_scalar(const uint8_t * src, ptrdiff_t ss,
+			     uint8_t * dst, ptrdiff_t ds)
+{
+	for (int j = 0; j < ROT_TILE; j++) {
+		for (int i = 0; i < ROT_TILE; i++) {
+			dst[j * ds + i] = src[i * ss + j];
+		}
+	}
+}
+
+#ifdef IMGLIB_X86
+
+/* A whole byte tile fits in 4 registers, so three rounds of unpacks
+ * interleave the rows into columns, two per register. */
+__attribute__((target("sse2")))
+static void rot_tile8_sse2(const uint8_t * src, ptrdiff_t ss,
+			   uint8_t * dst, ptrdiff_t ds)
+{
+	__m128i r[8], a[4], b[4], c[4];
+
+	for (int i = 0; i < 8; i++) {
+		r[i] = _mm_loadl_epi64((const __m128i *)(src + i * ss));
+	}
+
+	for (int i = 0; i < 4; i++) {
+		a[i] = _mm_unpacklo_epi8(r[2 * i], r[2 * i + 1]);
+	}
+
+	b[0] = _mm_unpacklo_epi16(a[0], a[1]);
+	b[1] = _mm_unpackhi_epi16(a[0], a[1]);
+	b[2] = _mm_unpacklo_epi16(a[2], a[3]);
+	b[3] = _mm_unpackhi_epi16(a[2], a[3]);
+
+	c[0] = _mm_unpacklo_epi32(b[0], b[2]);
+	c[1] = _mm_unpackhi_epi32(b[0], b[2]);
+	c[2] = _mm_unpacklo_epi32(b[1], b[3]);
+	c[3] = _mm_unpackhi_epi32(b[1], b[3]);
+
+	for (int j = 0; j < 4; j++) {
+		_mm_storel_epi64((__m128i *)(dst + 2 * j * ds), c[j]);
+		_mm_storel_epi64((__m128i *)(dst + (2 * j + 1) * ds),
+				 _mm_unpackhi_epi64(c[j], c[j]));
+	}
+}
+
+static const rot_tile8_fn rot_tile8[SIMD_LEVELS] = {
+	rot_tile8_scalar, rot_tile8_sse2, rot_tile8_sse2
+};
+
+#else
+
+static const rot_tile_fn rot_tile[SIMD_LEVELS] = {
+	rot_tile_scalar, rot_tile_scalar, rot_tile_scalar
+};
+
+static const rot_tile8_fn rot_tile8[SIMD_LEVELS] = {
+	rot_tile8_scalar, rot_tile8_scalar, rot_tile8_scalar
+};
+
+#endif
+
+static inline void rot_reverse_row(uint32_t * row, uint32_t len)
+{
+	uint32_t * l = row, * r = row + len;
+
+	while (l + 1 < r) {
+		uint32_t t = *l;
+		*l++ = *--r;
+		*r = t;
+	}
+}
+
+/* Rotate rows [<y0>, <y1>) of a <width>x<height> plane <src> into
+ * <dst> by <turns>, the same way rotate_rows() does for packed
+ * images. */
+static void rotate_plane_rows(const uint8_t * src, uint8_t * dst, uint32_t width,
+			      uint32_t height, uint32_t turns, uint32_t y0, uint32_t y1)
+{
+	uint32_t full_w = width & ~(ROT_TILE - 1);
+	uint32_t full_h = height & ~(ROT_TILE - 1);
+	uint32_t tile_end = (y1 < full_h) ? y1 : full_h;
+	rot_tile8_fn tile = rot_tile8[simd_level];
+	uint32_t y, x;
+
+	if (turns == 2) {
+		for (y = y0; y < y1; y++) {
+			const uint8_t * in = src + (uint64_t)y * width;
+			uint8_t * out = dst + (uint64_t)(height - y - 1) * width;
+			for (x = 0; x < width; x++) {
+				out[width - x - 1] = in[x];
+			}
+		}
+		return;
+	}
+
+	for (uint32_t gy = y0; gy < tile_end; gy += ROT_GROUP) {
+		uint32_t gy_end = (gy + ROT_GROUP < tile_end) ? gy + ROT_GROUP : tile_end;
+
+		for (uint32_t gx = 0; gx < full_w; gx += ROT_GROUP) {
+			uint32_t gx_end = (gx + ROT_GROUP < full_w) ? gx + ROT_GROUP : full_w;
+
+			for (y = gy; y < gy_end; y += ROT_TILE) {
+				for (x = gx; x < gx_end; x += ROT_TILE) {
+					if (turns == 1) {
+						tile(src + (uint64_t)y * width + x, width,
+						     dst + (uint64_t)(width - x - 1) * height + y,
+						     -(ptrdiff_t)height);
+					} else {
+						tile(src + (uint64_t)(y + ROT_TILE - 1) * width + x,
+						     -(ptrdiff_t)width,
+						     dst + (uint64_t)x * height + height - y - ROT_TILE,
+						     height);
+					}
+				}
+			}
+		}
+	}
+
+	for (y = y0; y < y1; y++) {
+		for (x = (y < full_h) ? full_w : 0; x < width; x++) {
+			if (turns == 1) {
+				dst[(uint64_t)(width - x - 1) * height + y] = src[(uint64_t)y * width + x];
+			} else {
+				dst[(uint64_t)x * height + height - y - 1] = src[(uint64_t)y * width + x];
+			}
+		}
+	}
+}
+
+/* Rotate rows [<y0>, <y1>) of <img> into <rotated> by <turns> times
+ * 90 degrees clockwise, from 1 to 3. <y0> must be a multiple of
+ * ROT_TILE.
+ *
+ * With one turn, source pixel (x, y) lands at column y of row
+ * width - x - 1 of the rotated image, and with three turns at column
+ * height - y - 1 of row x. Full 8x8 tiles go through the tile
+ * function, reading the source rows bottom up for three turns, and
+ * the partial ones around the edges are moved one at a time. Two
+ * turns reverse the order of the pixels. */
+static void rotate_rows(const struct image * img, struct image * rotated,
+			uint32_t turns, uint32_t y0, uint32_t y1)
+{
+	uint32_t width = img->width, height = img->height;
+
+	if (img->layout == IMG_PLANAR) {
+		for (int c = 0; c < IMG_PLANES; c++) {
+			rotate_plane_rows(img->planes[c], rotated->planes[c],
+					  width, height, turns, y0, y1);
+		}
+		return;
+	}
+
+	if (turns == 2) {
+		for (uint32_t y = y0; y < y1; y++) {
+			const uint32_t * in = &pix(img, 0, y);
+			uint32_t * out = &pix(rotated, 0, height - y - 1);
+			for (uint32_t x = 0; x < width; x++) {
+				out[width - x - 1] = in[x];
+			}
+		}
+		return;
+	}
+
+	uint32_t full_w = width & ~(ROT_TILE - 1);
+	uint32_t full_h = height & ~(ROT_TILE - 1);
+	uint32_t tile_end = (y1 < full_h) ? y1 : full_h;
+	rot_tile_fn tile = rot_tile[simd_level];
+	uint32_t y, x;
+
+	for (uint32_t gy = y0; gy < tile_end; gy += ROT_GROUP) {
+		uint32_t gy_end = (gy + ROT_GROUP < tile_end) ? gy + ROT_GROUP : tile_end;
+
+		for (uint32_t gx = 0; gx < full_w; gx += ROT_GROUP) {
+			uint32_t gx_end = (gx + ROT_GROUP < full_w) ? gx + ROT_GROUP : full_w;
+
+			for (y = gy; y < gy_end; y += ROT_TILE) {
+				for (x = gx; x < gx_end; x += ROT_TILE) {
+					if (turns == 1) {
+						tile(&pix(img, x, y), width,
+						     &pix(rotated, y, width - x - 1),
+						     -(ptrdiff_t)height);
+					} else {
+						tile(&pix(img, x, y + ROT_TILE - 1), -(ptrdiff_t)width,
+						     &pix(rotated, height - y - ROT_TILE, x), height);
+					}
+				}
+			}
+		}
+	}
+
+	/* Leftover columns on the right and rows at the bottom */
+	for (y = y0; y < y1; y++) {
+		for (x = (y < full_h) ? full_w : 0; x < width; x++) {
+			if (turns == 1) {
+				pix(rotated, y, width - x - 1) = pix(img, x, y);
+			} else {
+				pix(rotated, height - y - 1, x) = pix(img, x, y);
+			}
+		}
+	}
+}
+
+struct rotate_job {
+	const struct image * img;
+	struct image * rotated;
+	uint32_t turns;
+};
+
+static void rotate_band(void * arg, uint32_t band, uint32_t nbands)
+{
+	struct rotate_job * job = (struct rotate_job *)arg;
+	uint32_t y0, y1;
+
+	par_band_rows(job->img->height, ROT_GROUP, band, nbands, &y0, &y1);
+	rotate_rows(job->img, job->rotated, job->turns, y0, y1);
+}
+
+/* Create a new image with the pixels of <img>, which is not a view,
+ * rotated by <turns> times 90 degrees clockwise, using up to
+ * <nthreads> threads */
+static struct image * rotate_turns(const struct image * img, uint32_t turns,
+				   uint32_t nthreads, uint8_t * err)
+{
+	struct rotate_job job;
+
+	if (!img_valid(img)) {
+		if (err) {
+			*err = 1;
+		}
+		return NULL;
+	}
+
+	turns &= 3;
+	if (!turns) {
+		return cloneImage(img, err);
+	}
+
+	job.img = img;
+	job.turns = turns;
+	job.rotated = (turns == 2) ? createImageLike(img, img->width, img->height)
+		: createImageLike(img, img->height, img->width);
+	par_run(rotate_band, &job, par_nbands(img->height, ROT_GROUP, nthreads), nthreads);
+
+	if (err) {
+		*err = 0;
+	}
+
+	return job.rotated;
+}
+
+/* Same as rotate90Clockwise(), split into bands of source rows across
+ * up to <nthreads> threads. */
+struct image * rotate90Clockwise_par(const struct image * img, uint32_t nthreads,
+				     uint8_t * err) {
+    /* Rotating a view materializes it with one more turn */
+    if (img && img->base) {
+	    return rotate_turns(img->base, img->orient + 1, nthreads, err);
+    }
+
+    return rotate_turns(img, 1, nthreads, err);
+}
+
+/* Create a view of <img> rotated by <turns> more turns */
+struct image * rotateView(struct image * img, uint32_t turns)
+{
+	struct image * base, * view;
+	uint32_t orient;
+
+	if (!img) {
+		return NULL;
+	}
+
+	base = img->base ? img->base : img;
+	orient = (img->orient + turns) & 3;
+
+	/* Full turns give back the image itself */
+	if (!orient) {
+		return shareImage(base);
+	}
+
+	view = (struct image *)malloc(sizeof(struct image));
+	if (!view) {
+		return NULL;
+	}
+
+	view->width = (orient == 2) ? base->width : base->height;
+	view->height = (orient == 2) ? base->height : base->width;
+	view->layout = base->layout;
+	view->pixels = NULL;
+	view->planes[IMG_PLANE_R] = view->planes[IMG_PLANE_G] = view->planes[IMG_PLANE_B] = NULL;
+	view->refs = 1;
+	view->mapped = 0;
+	view->orient = orient;
+	view->base = shareImage(base);
+
+	return view;
+}
+
+/* Same as resolveView(), split into bands of source rows across up to
+ * <nthreads> threads. */
+struct image * resolveView_par(const struct image * img, uint32_t nthreads, uint8_t * err)
+{
+	if (img && img->base) {
+		return rotate_turns(img->base, img->orient, nthreads, err);
+	}
+
+	return cloneImage(img, err);
+}
+
+/* Materialize the view <img> in a new image */
+struct image * resolveView(const struct image * img, uint8_t * err)
+{
+	return resolveView_par(img, 1, err);
+}
+
+/* Creates a new image by rotating the input image by 90 degreees
+ * clockwise. NOTE: the original image must be manually deallocated if
+ * not needed. If successful, the function returns a pointer to the
+ * new image.
+ *
+ * If <err> is not NULL, the function sets 0 in the err parameter if
+ * retrieval of the selected pixel is successful, and 1 if an error
+ * has occurred. In case of error, NULL is returned by the function.
+*/
+struct image * rotate90Clockwise(const struct image * img, uint8_t * err) {
+    return rotate90Clockwise_par(img, 1, err);
+}
+
+/* Rotates a square image by 90 degrees clockwise without allocating
+ * a second image: each row is reversed first, then the pixels are
+ * transposed in place one pair of 8x8 tiles at a time. This yields
+ * the same result as rotate90Clockwise().
+ *
+ * The function returns 0 if the operation is successful and 1 in case
+ * of error, including when the image is not square.
+*/
+uint8_t rotate90ClockwiseInPlace(struct image * img) {
+    uint32_t tmp[ROT_TILE * ROT_TILE];
+    uint32_t n, full, by, bx, y, x;
+    rot_tile_fn tile = rot_tile[simd_level];
+
+    if (!img || !img->pixels || img->width != img->height || isImageShared(img)) {
+	    return 1;
+    }
+
+    n = img->width;
+    full = n & ~(ROT_TILE - 1);
+
+    for (y = 0; y < n; y++) {
+	    rot_reverse_row(&pix(img, 0, y), n);
+    }
+
+    for (by = 0; by < full; by += ROT_TILE) {
+	    /* Transpose the tile on the diagonal */
+	    for (y = 0; y < ROT_TILE; y++) {
+		    memcpy(&tmp[y * ROT_TILE], &pix(img, by, by + y), ROT_TILE * sizeof(uint32_t));
+	    }
+	    tile(tmp, ROT_TILE, &pix(img, by, by), n);
+
+	    /* Swap and transpose the tiles mirrored across it */
+	    for (bx = by + ROT_TILE; bx < full; bx += ROT_TILE) {
+		    for (y = 0; y < ROT_TILE; y++) {
+			    memcpy(&tmp[y * ROT_TILE], &pix(img, bx, by + y),
+				   ROT_TILE * sizeof(uint32_t));
+		    }
+		    tile(&pix(img, by, bx), n, &pix(img, bx, by), n);
+		    tile(tmp, ROT_TILE, &pix(img, by, bx), n);
+	    }
+
+	    /* Columns right of the last full tile */
+	    for (y = by; y < by + ROT_TILE; y++) {
+		    for (x = full; x < n; x++) {
+			    uint32_t t = pix(img, x, y);
+			    pix(img, x, y) = pix(img, y, x);
+			    pix(img, y, x) = t;
+		    }
+	    }
+    }
+
+    /* Bottom-right corner left over by the full tiles */
+    for (y = full; y < n; y++) {
+	    for (x = y + 1; x < n; x++) {
+		    uint32_t t = pix(img, x, y);
+		    pix(img, x, y) = pix(img, y, x);
+		    pix(img, y, x) = t;
+	    }
+    }
+
+    return 0;
+}
+
+/* Convolution engine shared by the blur, sharpen and edge filters.
+ *
+ * Every filter is generated by DEFINE_CONV_FILTER() from a list of
+ * kernel taps, a fixed-point normalization (multiply, then shift
+ * right) and what happens to the frame of <radius> pixels around the
+ * image. The taps are expanded at compile time into straight-line
+ * code, so zero coefficients cost nothing and unit coefficients skip
+ * the multiply. Each filter gets a scalar row function plus SSE2 and
+ * AVX2 ones that unpack packed XRGB pixels into 16-bit lanes and
+ * process 8 and 16 pixels per iteration respectively, finishing the
+ * row tail with the scalar version. Filters whose weighted sums do not
+ * fit in 16 bits are declared with DEFINE_CONV_FILTER_WIDE() instead
+ * and accumulate in 32-bit lanes on AVX2. All versions of a filter
+ * produce bit-identical output. */
+
+#define CONV_MAX_RADIUS 3
+
+/* Compute output pixels [<x0>, <x1>) of one row given pointers to the
+ * 2*radius+1 input rows centered on it. */
+typedef void (*conv_row_fn)(const uint32_t * const * rows, uint32_t * out,
+			    uint32_t x0, uint32_t x1);
+
+/* Same as conv_row_fn for one 8-bit plane of a planar image */
+typedef void (*conv_plane_row_fn)(const uint8_t * const * rows, uint8_t * out,
+				  uint32_t x0, uint32_t x1);
+
+struct conv_filter {
+	uint32_t radius;
+	/* Border pixels are black if set, copied from input otherwise. */
+	uint8_t zero_border;
+	conv_row_fn row[SIMD_LEVELS];
+	conv_plane_row_fn plane_row[SIMD_LEVELS];
+};
+
+/* Kernel rows: expand one row of coefficients at row offset <dy>
+ * into calls to the tap macro <T>. */
+#define CONV_ROW3(T, dy, k0, k1, k2)					\
+	T(dy, -1, k0) T(dy, 0, k1) T(dy, 1, k2)
+#define CONV_ROW5(T, dy, k0, k1, k2, k3, k4)				\
+	T(dy, -2, k0) CONV_ROW3(T, dy, k1, k2, k3) T(dy, 2, k4)
+#define CONV_ROW7(T, dy, k0, k1, k2, k3, k4, k5, k6)			\
+	T(dy, -3, k0) CONV_ROW5(T, dy, k1, k2, k3, k4, k5) T(dy, 3, k6)
+
+/* Scalar tap: <rows>, <radius>, <x> and the three sums are provided by
+ * the row function the tap is expanded into. */
+#define CONV_TAP_SCALAR(dy, dx, k)					\
+	if ((k) != 0) {							\
+		uint32_t pixel = rows[radius + (dy)][x + (dx)];		\
+		sumR += (int)((pixel >> 16) & 0xFF) * (k);		\
+		sumG += (int)((pixel >> 8) & 0xFF) * (k);		\
+		sumB += (int)(pixel & 0xFF) * (k);			\
+	}
+
+#define DEFINE_CONV_ROW_SCALAR(name, R, TAPS, MUL, SHIFT)		\
+static void name##_row_scalar(const uint32_t * const * rows,		\
+			      uint32_t * out, uint32_t x0, uint32_t x1) \
+{									\
+	const uint32_t radius = (R);					\
+	uint32_t x;							\
+									\
+	for (x = x0; x < x1; x++) {					\
+		int sumR = 0, sumG = 0, sumB = 0;			\
+									\
+		TAPS(CONV_TAP_SCALAR)					\
+									\
+		if ((SHIFT) != 0) {					\
+			sumR = (sumR * (MUL)) >> (SHIFT);		\
+			sumG = (sumG * (MUL)) >> (SHIFT);		\
+			sumB = (sumB * (MUL)) >> (SHIFT);		\
+		}							\
+									\
+		/* Clip the values to [0, 255] */			\
+		sumR = (sumR > 255) ? 255 : (sumR < 0) ? 0 : sumR;	\
+		sumG = (sumG > 255) ? 255 : (sumG < 0) ? 0 : sumG;	\
+		sumB = (sumB > 255) ? 255 : (sumB < 0) ? 0 : sumB;	\
+									\
+		out[x] = (sumR << 16) | (sumG << 8) | sumB;		\
+	}								\
+}
+
+/* Scalar tap on a single plane */
+#define CONV_PLANE_TAP_SCALAR(dy, dx, k)				\
+	if ((k) != 0) {							\
+		sum += (int)rows[radius + (dy)][x + (dx)] * (k);	\
+	}
+
+#define DEFINE_CONV_PLANE_ROW_SCALAR(name, R, TAPS, MUL, SHIFT)	\
+static void name##_plane_row_scalar(const uint8_t * const * rows,	\
+				    uint8_t * out, uint32_t x0, uint32_t x1) \
+{									\
+	const uint32_t radius = (R);					\
+	uint32_t x;							\
+									\
+	for (x = x0; x < x1; x++) {					\
+		int sum = 0;						\
+									\
+		TAPS(CONV_PLANE_TAP_SCALAR)				\
+									\
+		if ((SHIFT) != 0) {					\
+			sum = (sum * (MUL)) >> (SHIFT);			\
+		}							\
+									\
+		out[x] = (sum > 255) ? 255 : (sum < 0) ? 0 : sum;	\
+	}								\
+}
+
+#ifdef IMGLIB_X86
+
+/* SIMD taps work on 16-bit lanes holding one channel each, for two
+ * registers' worth of pixels at a time. The final saturating pack
+ * performs the [0, 255] clipping, and for packed pixels the mask
+ * drops the unused top byte exactly like the scalar code does. The
+ * same row functions serve planar images, where a register holds
+ * four times as many values of a single channel. Normalized
+ * kernels must be non-negative: the sum is then treated as unsigned,
+ * and the normalization is either a high multiply (SHIFT == 16) or a
+ * plain shift (MUL == 1). */
+#define CONV_TAP_SSE2(dy, dx, k)					\
+	if ((k) != 0) {							\
+		for (int v = 0; v < 2; v++) {				\
+			__m128i p = _mm_loadu_si128((const __m128i *)	\
+				(rows[radius + (dy)] + x + (dx) + v * vstep)); \
+			__m128i lo = _mm_unpacklo_epi8(p, zero);		\
+			__m128i hi = _mm_unpackhi_epi8(p, zero);		\
+			if ((k) == -1) {				\
+				acc_lo[v] = _mm_sub_epi16(acc_lo[v], lo); \
+				acc_hi[v] = _mm_sub_epi16(acc_hi[v], hi); \
+				continue;				\
+			}						\
+			if ((k) != 1) {					\
+				lo = _mm_mullo_epi16(lo, _mm_set1_epi16(k)); \
+				hi = _mm_mullo_epi16(hi, _mm_set1_epi16(k)); \
+			}						\
+			acc_lo[v] = _mm_add_epi16(acc_lo[v], lo);	\
+			acc_hi[v] = _mm_add_epi16(acc_hi[v], hi);	\
+		}							\
+	}
+
+#define CONV_NORM16(V, acc, MUL, SHIFT)					\
+	do {								\
+		if ((SHIFT) == 16) {					\
+			acc = V##_mulhi_epu16(acc, V##_set1_epi16(MUL)); \
+		} else if ((SHIFT) != 0) {				\
+			acc = V##_srli_epi16(acc, (SHIFT));		\
+		}							\
+	} while (0)
+
+/* Row function <fn> over elements of type <T>, <STEP> of which fit
+ * in a register; <fallback> handles the leftover elements. */
+#define CONV_ROW_SSE2(fn, fallback, T, STEP, MASK, R, TAPS, MUL, SHIFT) \
+__attribute__((target("sse2")))					\
+static void fn(const T * const * rows, T * out, uint32_t x0, uint32_t x1) \
+{									\
+	const uint32_t radius = (R), vstep = (STEP);			\
+	const __m128i zero = _mm_setzero_si128();			\
+	const __m128i rgb_mask = _mm_set1_epi32(MASK);			\
+	uint32_t x = x0, end;						\
+									\
+	for (end = x0 + ((x1 - x0) & ~(2 * vstep - 1)); x < end; x += 2 * vstep) { \
+		__m128i acc_lo[2] = { zero, zero };			\
+		__m128i acc_hi[2] = { zero, zero };			\
+									\
+		TAPS(CONV_TAP_SSE2)					\
+									\
+		for (int v = 0; v < 2; v++) {				\
+			CONV_NORM16(_mm, acc_lo[v], MUL, SHIFT);	\
+			CONV_NORM16(_mm, acc_hi[v], MUL, SHIFT);	\
+			_mm_storeu_si128((__m128i *)(out + x + v * vstep), \
+					 _mm_and_si128(_mm_packus_epi16(acc_lo[v], acc_hi[v]), \
+						       rgb_mask));	\
+		}							\
+	}								\
+									\
+	fallback(rows, out, x, x1);					\
+}
+
+#define DEFINE_CONV_ROW_SSE2(name, R, TAPS, MUL, SHIFT)		\
+	CONV_ROW_SSE2(name##_row_sse2, name##_row_scalar, uint32_t, 4,	\
+		      0x00FFFFFF, R, TAPS, MUL, SHIFT)			\
+	CONV_ROW_SSE2(name##_plane_row_sse2, name##_plane_row_scalar,	\
+		      uint8_t, 16, -1, R, TAPS, MUL, SHIFT)
+
+/* Unpack and pack work within each 128-bit lane, so they undo each
+ * other and pixels come out in the order they went in. */
+#define CONV_TAP_AVX2(dy, dx, k)					\
+	if ((k) != 0) {							\
+		for (int v = 0; v < 2; v++) {				\
+			__m256i p = _mm256_loadu_si256((const __m256i *)	\
+				(rows[radius + (dy)] + x + (dx) + v * vstep)); \
+			__m256i lo = _mm256_unpacklo_epi8(p, zero);		\
+			__m256i hi = _mm256_unpackhi_epi8(p, zero);		\
+			if ((k) == -1) {				\
+				acc_lo[v] = _mm256_sub_epi16(acc_lo[v], lo); \
+				acc_hi[v] = _mm256_sub_epi16(acc_hi[v], hi); \
+				continue;				\
+			}						\
+			if ((k) != 1) {					\
+				lo = _mm256_mullo_epi16(lo, _mm256_set1_epi16(k)); \
+				hi = _mm256_mullo_epi16(hi, _mm256_set1_epi16(k)); \
+			}						\
+			acc_lo[v] = _mm256_add_epi16(acc_lo[v], lo);	\
+			acc_hi[v] = _mm256_add_epi16(acc_hi[v], hi);	\
+		}							\
+	}
+
+#define CONV_ROW_AVX2(fn, fallback, T, STEP, MASK, R, TAPS, MUL, SHIFT) \
+__attribute__((target("avx2")))					\
+static void fn(const T * const * rows, T * out, uint32_t x0, uint32_t x1) \
+{									\
+	const uint32_t radius = (R), vstep = (STEP);			\
+	const __m256i zero = _mm256_setzero_si256();			\
+	const __m256i rgb_mask = _mm256_set1_epi32(MASK);		\
+	uint32_t x = x0, end;						\
+									\
+	for (end = x0 + ((x1 - x0) & ~(2 * vstep - 1)); x < end; x += 2 * vstep) { \
+		__m256i acc_lo[2] = { zero, zero };			\
+		__m256i acc_hi[2] = { zero, zero };			\
+									\
+		TAPS(CONV_TAP_AVX2)					\
+									\
+		for (int v = 0; v < 2; v++) {				\
+			CONV_NORM16(_mm256, acc_lo[v], MUL, SHIFT);	\
+			CONV_NORM16(_mm256, acc_hi[v], MUL, SHIFT);	\
+			_mm256_storeu_si256((__m256i *)(out + x + v * vstep), \
+					    _mm256_and_si256(_mm256_packus_epi16(acc_lo[v], acc_hi[v]), \
+							     rgb_mask)); \
+		}							\
+	}								\
+									\
+	fallback(rows, out, x, x1);					\
+}
+
+#define DEFINE_CONV_ROW_AVX2(name, R, TAPS, MUL, SHIFT)		\
+	CONV_ROW_AVX2(name##_row_avx2, name##_row_scalar, uint32_t, 8,	\
+		      0x00FFFFFF, R, TAPS, MUL, SHIFT)			\
+	CONV_ROW_AVX2(name##_plane_row_avx2, name##_plane_row_scalar,	\
+		      uint8_t, 32, -1, R, TAPS, MUL, SHIFT)
+
+/* Wide taps widen channels all the way to 32-bit lanes, so each
+ * AVX2 register holds two pixels and one 8-pixel step needs four
+ * accumulators. */
+#define CONV_TAP_AVX2_WIDE(dy, dx, k)					\
+	if ((k) != 0) {							\
+		__m256i p = _mm256_loadu_si256((const __m256i *)	\
+					       (rows[radius + (dy)] + x + (dx))); \
+		__m256i lo = _mm256_unpacklo_epi8(p, zero);		\
+		__m256i hi = _mm256_unpackhi_epi8(p, zero);		\
+		__m256i w[4] = { _mm256_unpacklo_epi16(lo, zero),	\
+				 _mm256_unpackhi_epi16(lo, zero),	\
+				 _mm256_unpacklo_epi16(hi, zero),	\
+				 _mm256_unpackhi_epi16(hi, zero) };	\
+		for (int i = 0; i < 4; i++) {				\
+			/* Each 32-bit lane is (value, 0) in 16-bit	\
+			 * halves: madd with (k, 0) yields value * k */	\
+			if ((k) != 1) {					\
+				w[i] = _mm256_madd_epi16(w[i], _mm256_set1_epi32(k)); \
+			}						\
+			acc[i] = _mm256_add_epi32(acc[i], w[i]);	\
+		}							\
+	}
+
+#define CONV_ROW_AVX2_WIDE(fn, fallback, T, STEP, MASK, R, TAPS, MUL, SHIFT) \
+__attribute__((target("avx2")))					\
+static void fn(const T * const * rows, T * out, uint32_t x0, uint32_t x1) \
+{									\
+	const uint32_t radius = (R), vstep = (STEP);			\
+	const __m256i zero = _mm256_setzero_si256();			\
+	const __m256i rgb_mask = _mm256_set1_epi32(MASK);		\
+	uint32_t x = x0, end;						\
+									\
+	for (end = x0 + ((x1 - x0) & ~(vstep - 1)); x < end; x += vstep) { \
+		__m256i acc[4] = { zero, zero, zero, zero };		\
+									\
+		TAPS(CONV_TAP_AVX2_WIDE)				\
+									\
+		for (int i = 0; i < 4; i++) {				\
+			if ((MUL) != 1) {				\
+				acc[i] = _mm256_mullo_epi32(acc[i], _mm256_set1_epi32(MUL)); \
+			}						\
+			if ((SHIFT) != 0) {				\
+				acc[i] = _mm256_srai_epi32(acc[i], (SHIFT)); \
+			}						\
+		}							\
+		_mm256_storeu_si256((__m256i *)(out + x),		\
+				    _mm256_and_si256(_mm256_packus_epi16( \
+					    _mm256_packs_epi32(acc[0], acc[1]), \
+					    _mm256_packs_epi32(acc[2], acc[3])), \
+						     rgb_mask));	\
+	}								\
+									\
+	fallback(rows, out, x, x1);					\
+}
+
+#define DEFINE_CONV_ROW_AVX2_WIDE(name, R, TAPS, MUL, SHIFT)		\
+	CONV_ROW_AVX2_WIDE(name##_row_avx2, name##_row_scalar, uint32_t, 8, \
+			   0x00FFFFFF, R, TAPS, MUL, SHIFT)		\
+	CONV_ROW_AVX2_WIDE(name##_plane_row_avx2, name##_plane_row_scalar, \
+			   uint8_t, 32, -1, R, TAPS, MUL, SHIFT)
+
+#define CONV_ROWS(name, kind) { name##_##kind##_scalar, name##_##kind##_sse2, name##_##kind##_avx2 }
+#define CONV_ROWS_WIDE(name, kind) { name##_##kind##_scalar, name##_##kind##_scalar, name##_##kind##_avx2 }
+
+#else
+
+#define DEFINE_CONV_ROW_SSE2(name, R, TAPS, MUL, SHIFT)
+#define DEFINE_CONV_ROW_AVX2(name, R, TAPS, MUL, SHIFT)
+#define DEFINE_CONV_ROW_AVX2_WIDE(name, R, TAPS, MUL, SHIFT)
+#define CONV_ROWS(name, kind) { name##_##kind##_scalar, name##_##kind##_scalar, name##_##kind##_scalar }
+#define CONV_ROWS_WIDE(name, kind) CONV_ROWS(name, kind)
+
+#endif
+
+/* Define <name>_filter from the kernel taps in <TAPS>. The weighted
+ * sum is multiplied by <MUL> and shifted right by <SHIFT> (no
+ * normalization if <SHIFT> is 0), then clipped to [0, 255]. The
+ * intermediate sums must fit in 16 bits, signed or, for normalized
+ * kernels, unsigned. */
+#define DEFINE_CONV_FILTER(name, R, TAPS, MUL, SHIFT, ZERO_BORDER)	\
+	DEFINE_CONV_ROW_SCALAR(name, R, TAPS, MUL, SHIFT)		\
+	DEFINE_CONV_PLANE_ROW_SCALAR(name, R, TAPS, MUL, SHIFT)		\
+	DEFINE_CONV_ROW_SSE2(name, R, TAPS, MUL, SHIFT)			\
+	DEFINE_CONV_ROW_AVX2(name, R, TAPS, MUL, SHIFT)			\
+	static const struct conv_filter name##_filter = {		\
+		.radius = (R),						\
+		.zero_border = (ZERO_BORDER),				\
+		.row = CONV_ROWS(name, row),				\
+		.plane_row = CONV_ROWS(name, plane_row)			\
+	};
+
+/* Same as DEFINE_CONV_FILTER() for kernels whose sums need up to 32
+ * bits. These have no SSE2 version. */
+#define DEFINE_CONV_FILTER_WIDE(name, R, TAPS, MUL, SHIFT, ZERO_BORDER) \
+	DEFINE_CONV_ROW_SCALAR(name, R, TAPS, MUL, SHIFT)		\
+	DEFINE_CONV_PLANE_ROW_SCALAR(name, R, TAPS, MUL, SHIFT)		\
+	DEFINE_CONV_ROW_AVX2_WIDE(name, R, TAPS, MUL, SHIFT)		\
+	static const struct conv_filter name##_filter = {		\
+		.radius = (R),						\
+		.zero_border = (ZERO_BORDER),				\
+		.row = CONV_ROWS_WIDE(name, row),			\
+		.plane_row = CONV_ROWS_WIDE(name, plane_row)		\
+	};
+
+/* 3x3 average. 7282 / 2^16 rounds 1/9 up and is exact for every
+ * possible sum (at most 9 * 255). */
+#define BLUR_TAPS(T)							\
+	CONV_ROW3(T, -1,  1,  1,  1)					\
+	CONV_ROW3(T,  0,  1,  1,  1)					\
+	CONV_ROW3(T,  1,  1,  1,  1)
+DEFINE_CONV_FILTER(blur, 1, BLUR_TAPS, 7282, 16, 0)
+
+/* Kernel that emphasizes center pixel */
+#define SHARPEN_TAPS(T)							\
+	CONV_ROW3(T, -1, -1, -1, -1)					\
+	CONV_ROW3(T,  0, -1,  9, -1)					\
+	CONV_ROW3(T,  1, -1, -1, -1)
+DEFINE_CONV_FILTER(sharpen, 1, SHARPEN_TAPS, 1, 0, 0)
+
+#define VERTEDGES_TAPS(T)						\
+	CONV_ROW3(T, -1, -1,  0,  1)					\
+	CONV_ROW3(T,  0, -2,  0,  2)					\
+	CONV_ROW3(T,  1, -1,  0,  1)
+DEFINE_CONV_FILTER(vertedges, 1, VERTEDGES_TAPS, 1, 0, 1)
+
+#define HORIZEDGES_TAPS(T)						\
+	CONV_ROW3(T, -1, -1, -2, -1)					\
+	CONV_ROW3(T,  0,  0,  0,  0)					\
+	CONV_ROW3(T,  1,  1,  2,  1)
+DEFINE_CONV_FILTER(horizedges, 1, HORIZEDGES_TAPS, 1, 0, 1)
+
+#define LAPLACIAN_TAPS(T)						\
+	CONV_ROW3(T, -1,  0, -1,  0)					\
+	CONV_ROW3(T,  0, -1,  4, -1)					\
+	CONV_ROW3(T,  1,  0, -1,  0)
+DEFINE_CONV_FILTER(laplacian, 1, LAPLACIAN_TAPS, 1, 0, 1)
+
+/* Binomial approximations of a Gaussian. The coefficients add up to
+ * a power of two, so normalizing is a plain shift. */
+#define GAUSS5_TAPS(T)							\
+	CONV_ROW5(T, -2,  1,  4,  6,  4,  1)				\
+	CONV_ROW5(T, -1,  4, 16, 24, 16,  4)				\
+	CONV_ROW5(T,  0,  6, 24, 36, 24,  6)				\
+	CONV_ROW5(T,  1,  4, 16, 24, 16,  4)				\
+	CONV_ROW5(T,  2,  1,  4,  6,  4,  1)
+DEFINE_CONV_FILTER(gauss5, 2, GAUSS5_TAPS, 1, 8, 0)
+
+#define GAUSS7_TAPS(T)							\
+	CONV_ROW7(T, -3,   1,   6,  15,  20,  15,   6,   1)		\
+	CONV_ROW7(T, -2,   6,  36,  90, 120,  90,  36,   6)		\
+	CONV_ROW7(T, -1,  15,  90, 225, 300, 225,  90,  15)		\
+	CONV_ROW7(T,  0,  20, 120, 300, 400, 300, 120,  20)		\
+	CONV_ROW7(T,  1,  15,  90, 225, 300, 225,  90,  15)		\
+	CONV_ROW7(T,  2,   6,  36,  90, 120,  90,  36,   6)		\
+	CONV_ROW7(T,  3,   1,   6,  15,  20,  15,   6,   1)
+DEFINE_CONV_FILTER_WIDE(gauss7, 3, GAUSS7_TAPS, 1, 12, 0)
+
+/* Fill output pixels [<x0>, <x1>) of a border row/column. */
+static inline void conv_border(const struct conv_filter * f,
+			       const uint32_t * in, uint32_t * out,
+			       uint32_t x0, uint32_t x1)
+{
+	if (f->zero_border) {
+		memset(out + x0, 0, (x1 - x0) * sizeof(uint32_t));
+	} else {
+		memcpy(out + x0, in + x0, (x1 - x0) * sizeof(uint32_t));
+	}
+}
+
+/* Same as conv_border() on a single plane */
+static inline void conv_plane_border(const struct conv_filter * f,
+				     const uint8_t * in, uint8_t * out,
+				     uint32_t x0, uint32_t x1)
+{
+	if (f->zero_border) {
+		memset(out + x0, 0, x1 - x0);
+	} else {
+		memcpy(out + x0, in + x0, x1 - x0);
+	}
+}
+
+/* Same as convolve_rows() on a single <width>x<height> plane */
+static void convolve_plane_rows(const uint8_t * in, uint8_t * out, uint32_t width,
+				uint32_t height, const struct conv_filter * f,
+				uint32_t y0, uint32_t y1)
+{
+	const uint8_t * rows[2 * CONV_MAX_RADIUS + 1];
+	uint32_t y, r = f->radius;
+
+	for (y = y0; y < y1; y++) {
+		const uint8_t * in_row = in + (uint64_t)y * width;
+		uint8_t * out_row = out + (uint64_t)y * width;
+
+		if (y < r || y + r >= height || width <= 2 * r) {
+			conv_plane_border(f, in_row, out_row, 0, width);
+			continue;
+		}
+
+		for (uint32_t i = 0; i <= 2 * r; i++) {
+			rows[i] = in_row + ((int64_t)i - r) * width;
+		}
+
+		f->plane_row[simd_level](rows, out_row, r, width - r);
+		conv_plane_border(f, in_row, out_row, 0, r);
+		conv_plane_border(f, in_row, out_row, width - r, width);
+	}
+}
+
+/* Apply the filter <f> to rows [<y0>, <y1>) of <img>, writing the
+ * result into <out>. Pixels closer than the kernel radius to the edge
+ * are not convolved to keep the implementation simple: they are
+ * either copied over or set to black. */
+static void convolve_rows(const struct image * img, struct image * out,
+			  const struct conv_filter * f, uint32_t y0, uint32_t y1)
+{
+	if (img->layout == IMG_PLANAR) {
+		for (int c = 0; c < IMG_PLANES; c++) {
+			convolve_plane_rows(img->planes[c], out->planes[c], img->width,
+					    img->height, f, y0, y1);
+		}
+		return;
+	}
+
+
+	const uint32_t * rows[2 * CONV_MAX_RADIUS + 1];
+	uint32_t y, width = img->width, height = img->height, r = f->radius;
+
+	for (y = y0; y < y1; y++) {
+		const uint32_t * in_row = &pix(img, 0, y);
+		uint32_t * out_row = &pix(out, 0, y);
+
+		if (y < r || y + r >= height || width <= 2 * r) {
+			conv_border(f, in_row, out_row, 0, width);
+			continue;
+		}
+
+		for (uint32_t i = 0; i <= 2 * r; i++) {
+			rows[i] = in_row + ((int64_t)i - r) * width;
+		}
+
+		f->row[simd_level](rows, out_row, r, width - r);
+		conv_border(f, in_row, out_row, 0, r);
+		conv_border(f, in_row, out_row, width - r, width);
+	}
+}
+
+struct conv_job {
+	const struct image * img;
+	struct image * out;
+	const struct conv_filter * f;
+};
+
+static void convolve_band(void * arg, uint32_t band, uint32_t nbands)
+{
+	struct conv_job * job = (struct conv_job *)arg;
+	uint32_t y0, y1;
+
+	par_band_rows(job->img->height, 1, band, nbands, &y0, &y1);
+	convolve_rows(job->img, job->out, job->f, y0, y1);
+}
+
+/* Apply the filter <f> to <img> using up to <nthreads> threads and
+ * return the result as a new image. */
+static struct image * convolve(const struct image * img, const struct conv_filter * f,
+			       uint32_t nthreads, uint8_t * err)
+{
+	struct conv_job job;
+
+	/* Filters read views in the canonical layout */
+	if (img && img->base) {
+		struct image * canon = resolveView_par(img, nthreads, NULL);
+
+		job.out = convolve(canon, f, nthreads, err);
+		deleteImage(canon);
+		return job.out;
+	}
+
+	if (!img_valid(img)) {
+		if (err) {
+			*err = 1;
+		}
+		return NULL;
+	}
+
+	job.img = img;
+	job.out = createImageLike(img, img->width, img->height);
+	job.f = f;
+	par_run(convolve_band, &job, par_nbands(img->height, 1, nthreads), nthreads);
+
+	if (err) {
+		*err = 0;
+	}
+
+	return job.out;
+}
+
+/**
+ * @brief Blur an image using a 3x3 averaging kernel.
+ *
+ * This function applies a 3x3 averaging kernel to each pixel in the image, resulting in 
+ * a blurred effect. Edge pixels are not blurred to keep the implementation simple.
+ *
+ * @param img The original image to be blurred.
+ * @return A new image structure containing the blurred image. The original image remains 
+ *         unchanged.
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * retrieval of the selected pixel is successful, and 1 if an error
+ * has occurred. In case of error, NULL is returned by the function.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function 
+ *       to avoid memory leaks.
+ */
+struct image* blurImage(const struct image* img, uint8_t * err) {
+    return convolve(img, &blur_filter, 1, err);
+}
+
+struct image* blurImage_par(const struct image* img, uint32_t nthreads, uint8_t * err) {
+    return convolve(img, &blur_filter, nthreads, err);
+}
+
+/* Box blur running sums. <colsum> holds 3 sums per column, one per
+ * channel, covering the current band of 2*radius+1 rows.
+ *
+ * Instead of re-reading the whole window for each pixel, the blur
+ * keeps one running sum per column and channel, plus a running sum
+ * across those column sums that slides along the row. Each output
+ * pixel therefore costs the same handful of additions regardless of
+ * the radius. */
+static inline void box_add_row(uint32_t * colsum, const uint32_t * row, uint32_t width)
+{
+	for (uint32_t x = 0; x < width; x++) {
+		uint32_t pixel = row[x];
+		colsum[3 * x] += (pixel >> 16) & 0xFF;
+		colsum[3 * x + 1] += (pixel >> 8) & 0xFF;
+		colsum[3 * x + 2] += pixel & 0xFF;
+	}
+}
+
+/* Slide the band of rows covered by <colsum> down by one row */
+static inline void box_slide_row(uint32_t * colsum, const uint32_t * old_row,
+				 const uint32_t * new_row, uint32_t width)
+{
+	for (uint32_t x = 0; x < width; x++) {
+		uint32_t o = old_row[x], n = new_row[x];
+		colsum[3 * x] += ((n >> 16) & 0xFF) - ((o >> 16) & 0xFF);
+		colsum[3 * x + 1] += ((n >> 8) & 0xFF) - ((o >> 8) & 0xFF);
+		colsum[3 * x + 2] += (n & 0xFF) - (o & 0xFF);
+	}
+}
+
+/* Produce one output row from the column sums. <in_row> is the
+ * center row of the band, used for the unblurred left/right edges. */
+static void box_blur_row(const uint32_t * colsum, const uint32_t * in_row,
+			 uint32_t * out_row, uint32_t width, uint32_t radius)
+{
+	uint32_t x, span = 2 * radius + 1;
+	uint32_t sumR = 0, sumG = 0, sumB = 0;
+
+	/* Divide by the window area with a 32.32 fixed-point reciprocal,
+	 * rounded up. This is exact as long as sum * error < 2^32, which
+	 * holds with a wide margin for 8-bit channels. */
+	uint64_t recip = ((1ULL << 32) / (span * span)) + 1;
+
+	for (x = 0; x < span; x++) {
+		sumR += colsum[3 * x];
+		sumG += colsum[3 * x + 1];
+		sumB += colsum[3 * x + 2];
+	}
+
+	for (x = 0; x < width; x++) {
+		if (x < radius || x + radius >= width) {
+			out_row[x] = in_row[x];
+			continue;
+		}
+
+		if (x > radius) {
+			uint32_t in = 3 * (x + radius), old = 3 * (x - radius - 1);
+			sumR += colsum[in] - colsum[old];
+			sumG += colsum[in + 1] - colsum[old + 1];
+			sumB += colsum[in + 2] - colsum[old + 2];
+		}
+
+		out_row[x] = ((uint32_t)((sumR * recip) >> 32) << 16)
+			| ((uint32_t)((sumG * recip) >> 32) << 8)
+			| (uint32_t)((sumB * recip) >> 32);
+	}
+}
+
+/* Box blur rows [<y0>, <y1>) of <img> into <out>. The image must be
+ * at least 2*radius+1 pixels wide and tall. */
+static void box_blur_rows(const struct image * img, struct image * out,
+			  uint32_t radius, uint32_t * colsum,
+			  uint32_t y0, uint32_t y1)
+{
+	uint32_t y, width = img->width, height = img->height;
+	uint8_t primed = 0;
+
+	for (y = y0; y < y1; y++) {
+		const uint32_t * in_row = &pix(img, 0, y);
+		uint32_t * out_row = &pix(out, 0, y);
+
+		/* For simplicity, pixels within <radius> of the edge are not blurred */
+		if (y < radius || y + radius >= height) {
+			memcpy(out_row, in_row, width * sizeof(uint32_t));
+			continue;
+		}
+
+		if (!primed) {
+			/* Prime the column sums with the first band of rows */
+			memset(colsum, 0, 3 * (uint64_t)width * sizeof(uint32_t));
+			for (uint32_t yy = y - radius; yy <= y + radius; yy++) {
+				box_add_row(colsum, &pix(img, 0, yy), width);
+			}
+			primed = 1;
+		} else {
+			box_slide_row(colsum, &pix(img, 0, y - radius - 1),
+				      &pix(img, 0, y + radius), width);
+		}
+
+		box_blur_row(colsum, in_row, out_row, width, radius);
+	}
+}
+
+/* Same as box_blur_rows() on a single <width>x<height> plane, with
+ * one running sum per column in <colsum>. */
+static void box_blur_plane_rows(const uint8_t * in, uint8_t * out, uint32_t width,
+				uint32_t height, uint32_t radius, uint32_t * colsum,
+				uint32_t y0, uint32_t y1)
+{
+	uint32_t x, y, span = 2 * radius + 1;
+	uint64_t recip = ((1ULL << 32) / (span * span)) + 1;
+	uint8_t primed = 0;
+
+	for (y = y0; y < y1; y++) {
+		const uint8_t * in_row = in + (uint64_t)y * width;
+		uint8_t * out_row = out + (uint64_t)y * width;
+		uint32_t sum = 0;
+
+		if (y < radius || y + radius >= height) {
+			memcpy(out_row, in_row, width);
+			continue;
+		}
+
+		if (!primed) {
+			memset(colsum, 0, (uint64_t)width * sizeof(uint32_t));
+			for (uint32_t yy = y - radius; yy <= y + radius; yy++) {
+				const uint8_t * row = in + (uint64_t)yy * width;
+				for (x = 0; x < width; x++) {
+					colsum[x] += row[x];
+				}
+			}
+			primed = 1;
+		} else {
+			const uint8_t * old_row = in_row - (uint64_t)(radius + 1) * width;
+			const uint8_t * new_row = in_row + (uint64_t)radius * width;
+			for (x = 0; x < width; x++) {
+				colsum[x] += new_row[x] - old_row[x];
+			}
+		}
+
+		for (x = 0; x < span; x++) {
+			sum += colsum[x];
+		}
+
+		for (x = 0; x < width; x++) {
+			if (x < radius || x + radius >= width) {
+				out_row[x] = in_row[x];
+				continue;
+			}
+
+			if (x > radius) {
+				sum += colsum[x + radius] - colsum[x - radius - 1];
+			}
+
+			out_row[x] = (sum * recip) >> 32;
+		}
+	}
+}
+
+struct box_job {
+	const struct image * img;
+	struct image * out;
+	uint32_t radius;
+	uint8_t failed;
+};
+
+static void box_blur_band(void * arg, uint32_t band, uint32_t nbands)
+{
+	struct box_job * job = (struct box_job *)arg;
+	uint32_t * colsum;
+	uint32_t y0, y1;
+
+	par_band_rows(job->img->height, 1, band, nbands, &y0, &y1);
+	if (y0 == y1) {
+		return;
+	}
+
+	colsum = (uint32_t *)malloc(3 * (uint64_t)job->img->width * sizeof(uint32_t));
+	if (!colsum) {
+		__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (job->img->layout == IMG_PLANAR) {
+		for (int c = 0; c < IMG_PLANES; c++) {
+			box_blur_plane_rows(job->img->planes[c], job->out->planes[c],
+					    job->img->width, job->img->height,
+					    job->radius, colsum, y0, y1);
+		}
+	} else {
+		box_blur_rows(job->img, job->out, job->radius, colsum, y0, y1);
+	}
+	free(colsum);
+}
+
+/* Same as boxBlurImage(), split into bands of rows across up to
+ * <nthreads> threads. Each band primes its own column sums. */
+struct image* boxBlurImage_par(const struct image* img, uint32_t radius,
+			       uint32_t nthreads, uint8_t * err) {
+	struct box_job job;
+	uint32_t span = 2 * radius + 1;
+
+	if (img && img->base) {
+		struct image * canon = resolveView_par(img, nthreads, NULL);
+
+		job.out = boxBlurImage_par(canon, radius, nthreads, err);
+		deleteImage(canon);
+		return job.out;
+	}
+
+	if (!img_valid(img) || radius == 0) {
+		if (err) {
+			*err = 1;
+		}
+		return NULL;
+	}
+
+	/* For simplicity, pixels within <radius> of the edge are not blurred */
+	if (img->width < span || img->height < span) {
+		return cloneImage(img, err);
+	}
+
+	job.img = img;
+	job.out = createImageLike(img, img->width, img->height);
+	job.radius = radius;
+	job.failed = 0;
+
+	/* Bands much shorter than the window would spend most of their
+	 * time priming the column sums */
+	par_run(box_blur_band, &job, par_nbands(img->height, span, nthreads), nthreads);
+
+	if (job.failed) {
+		deleteImage(job.out);
+		if (err) {
+			*err = 1;
+		}
+		return NULL;
+	}
+
+	if (err) {
+		*err = 0;
+	}
+
+	return job.out;
+}
+
+/**
+ * @brief Blur an image using a (2*radius+1)x(2*radius+1) box kernel.
+ *
+ * Each output pixel costs the same handful of additions regardless of
+ * <radius>, see box_blur_rows(). Pixels closer than <radius> to the
+ * edge are copied over, like blurImage() does for the one-pixel frame,
+ * and a radius of 1 gives the same result as blurImage().
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
+ */
+struct image* boxBlurImage(const struct image* img, uint32_t radius, uint8_t * err) {
+	return boxBlurImage_par(img, radius, 1, err);
+}
 
 /**
  * @brief Sharpen an image using a 3x3 sharpening kernel.
@@ -253,210 +2650,930 @@ struct image* blurImage(const struct image* img, uint8_t * err) {
  * This function applies a 3x3 sharpening kernel to each pixel in the image to enhance its
  * details. Edge pixels are not sharpened to keep the implementation simple.
  *
- * @param img The original image to be sharpened.
- * @return A new image structure containing the sharpened image. The original image remains 
- *         unchanged.
+ * @param img The original image to be sharpened.
+ * @return A new image structure containing the sharpened image. The original image remains 
+ *         unchanged.
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * retrieval of the selected pixel is successful, and 1 if an error
+ * has occurred. In case of error, NULL is returned by the function.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function 
+ *       to avoid memory leaks.
+ */
+struct image* sharpenImage(const struct image* img, uint8_t * err) {
+    return convolve(img, &sharpen_filter, 1, err);
+}
+
+struct image* sharpenImage_par(const struct image* img, uint32_t nthreads, uint8_t * err) {
+    return convolve(img, &sharpen_filter, nthreads, err);
+}
+
+/**
+ * @brief Detect vertical edges in an image using the Sobel operator.
+ *
+ * This function applies the Sobel vertical operator to each pixel in the image to detect
+ * vertical edges. Edge pixels are not processed to keep the implementation simple.
+ *
+ * @param img The original image.
+ * @return A new image structure containing the edge detected image. The original image remains 
+ *         unchanged.
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * retrieval of the selected pixel is successful, and 1 if an error
+ * has occurred. In case of error, NULL is returned by the function.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function 
+ *       to avoid memory leaks.
+ */
+struct image* detectVerticalEdges(const struct image* img, uint8_t * err) {
+    return convolve(img, &vertedges_filter, 1, err);
+}
+
+struct image* detectVerticalEdges_par(const struct image* img, uint32_t nthreads, uint8_t * err) {
+    return convolve(img, &vertedges_filter, nthreads, err);
+}
+
+/**
+ * @brief Detect horizontal edges in an image using the Sobel operator.
+ *
+ * This function applies the Sobel horizontal operator to each pixel in the image to detect
+ * horizontal edges. Edge pixels are not processed to keep the implementation simple.
+ *
+ * @param img The original image.
+ * @return A new image structure containing the edge detected image. The original image remains 
+ *         unchanged.
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * retrieval of the selected pixel is successful, and 1 if an error
+ * has occurred. In case of error, NULL is returned by the function.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function 
+ *       to avoid memory leaks.
+ */
+struct image* detectHorizontalEdges(const struct image* img, uint8_t * err) {
+    return convolve(img, &horizedges_filter, 1, err);
+}
+
+struct image* detectHorizontalEdges_par(const struct image* img, uint32_t nthreads, uint8_t * err) {
+    return convolve(img, &horizedges_filter, nthreads, err);
+}
+
+/**
+ * @brief Blur an image using a 5x5 Gaussian kernel.
+ *
+ * The kernel is the binomial approximation built from (1 4 6 4 1), whose
+ * coefficients add up to 256. Pixels within 2 of the edge are not blurred.
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
+ */
+struct image* gaussianBlur5Image(const struct image* img, uint8_t * err) {
+    return convolve(img, &gauss5_filter, 1, err);
+}
+
+struct image* gaussianBlur5Image_par(const struct image* img, uint32_t nthreads, uint8_t * err) {
+    return convolve(img, &gauss5_filter, nthreads, err);
+}
+
+/**
+ * @brief Blur an image using a 7x7 Gaussian kernel.
+ *
+ * The kernel is the binomial approximation built from (1 6 15 20 15 6 1),
+ * whose coefficients add up to 4096. Pixels within 3 of the edge are not
+ * blurred.
  *
  * If @err is not NULL, the function sets 0 in the err parameter if
- * retrieval of the selected pixel is successful, and 1 if an error
- * has occurred. In case of error, NULL is returned by the function.
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
+ */
+struct image* gaussianBlur7Image(const struct image* img, uint8_t * err) {
+    return convolve(img, &gauss7_filter, 1, err);
+}
+
+struct image* gaussianBlur7Image_par(const struct image* img, uint32_t nthreads, uint8_t * err) {
+    return convolve(img, &gauss7_filter, nthreads, err);
+}
+
+/**
+ * @brief Detect edges in all directions using a 3x3 Laplacian kernel.
  *
- * Note: The returned image structure should be freed using the deleteImage function 
- *       to avoid memory leaks.
+ * Edge pixels are not processed and are set to black, like the Sobel filters.
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
  */
-struct image* sharpenImage(const struct image* img, uint8_t * err) {
-    struct image* sharpenedImg;
-    uint32_t x, y;
+struct image* detectLaplacianEdges(const struct image* img, uint8_t * err) {
+    return convolve(img, &laplacian_filter, 1, err);
+}
 
-    if (!img || !img->pixels) {
-	    if (err) {
-		    *err = 1;
-	    }
-	    return NULL;
-    }
+struct image* detectLaplacianEdges_par(const struct image* img, uint32_t nthreads, uint8_t * err) {
+    return convolve(img, &laplacian_filter, nthreads, err);
+}
 
-    sharpenedImg = createImage(img->width, img->height);
-
-    for (y = 0; y < img->height; y++) {
-        for (x = 0; x < img->width; x++) {
-            // For simplicity, edge pixels are not sharpened
-            if (y == 0 || x == 0 || y == img->height - 1 || x == img->width - 1) {
-		    pix(sharpenedImg, x, y) = pix(img, x, y);
-            } else {
-                int sumR = 0, sumG = 0, sumB = 0;
-
-                /* Convolve with the kernel that emphasizes center pixel */
-                int kernel[3][3] = { {-1, -1, -1},
-                                     {-1,  9, -1},
-                                     {-1, -1, -1} };
-
-                for (int ky = -1; ky <= 1; ky++) {
-                    for (int kx = -1; kx <= 1; kx++) {
-			    uint32_t pixel = pix(img, x + kx, y + ky);
-			    sumR += ((pixel >> 16) & 0xFF) * kernel[ky + 1][kx + 1];
-			    sumG += ((pixel >> 8) & 0xFF) * kernel[ky + 1][kx + 1];
-			    sumB += (pixel & 0xFF) * kernel[ky + 1][kx + 1];
-                    }
-                }
-
-                /* Clip the values to [0, 255] */
-                sumR = (sumR > 255) ? 255 : (sumR < 0) ? 0 : sumR;
-                sumG = (sumG > 255) ? 255 : (sumG < 0) ? 0 : sumG;
-                sumB = (sumB > 255) ? 255 : (sumB < 0) ? 0 : sumB;
-
-                pix(sharpenedImg, x, y) = (sumR << 16) | (sumG << 8) | sumB;
-            }
-        }
-    }
+/* Sobel gradient magnitude.
+ *
+ * Both Sobel responses are computed from the same 3x3 neighborhood,
+ * and each channel of the output is sqrt(gx^2 + gy^2), rounded down
+ * and clipped to 255. The clipped responses themselves, identical to
+ * the output of detectVerticalEdges() and detectHorizontalEdges(),
+ * can optionally be written out in the same pass. */
 
-    if (err) {
-	    *err = 0;
-    }
+/* Compute pixels [<x0>, <x1>) of one row of magnitudes into <mag>,
+ * and of the vertical and horizontal responses into <vert> and
+ * <horiz> unless NULL, from the 3 rows around it. */
+typedef void (*edgemag_row_fn)(const uint32_t * const * rows, uint32_t * mag,
+			       uint32_t * vert, uint32_t * horiz,
+			       uint32_t x0, uint32_t x1);
+typedef void (*edgemag_plane_row_fn)(const uint8_t * const * rows, uint8_t * mag,
+				     uint8_t * vert, uint8_t * horiz,
+				     uint32_t x0, uint32_t x1);
+
+static inline int edgemag_clip(int v)
+{
+	return (v > 255) ? 255 : (v < 0) ? 0 : v;
+}
+
+/* Magnitude, vertical and horizontal response of one channel, where
+ * <p>(r, d) is the channel value at row r and column offset d */
+#define EDGEMAG_CHANNEL(p, m, v, h)					\
+	do {								\
+		int gx = (p(0, 1) - p(0, -1)) + 2 * (p(1, 1) - p(1, -1)) \
+			+ (p(2, 1) - p(2, -1));				\
+		int gy = (p(2, -1) + 2 * p(2, 0) + p(2, 1))		\
+			- (p(0, -1) + 2 * p(0, 0) + p(0, 1));		\
+		m = edgemag_clip((int)sqrtf((float)(gx * gx + gy * gy))); \
+		v = edgemag_clip(gx);					\
+		h = edgemag_clip(gy);					\
+	} while (0)
+
+static void edgemag_row_scalar(const uint32_t * const * rows, uint32_t * mag,
+			       uint32_t * vert, uint32_t * horiz,
+			       uint32_t x0, uint32_t x1)
+{
+	for (uint32_t x = x0; x < x1; x++) {
+		uint32_t m = 0, v = 0, h = 0;
+
+		for (int shift = 0; shift <= 16; shift += 8) {
+			int cm, cv, ch;
+#define EDGEMAG_PACKED(r, d) ((int)((rows[r][x + (d)] >> shift) & 0xFF))
+			EDGEMAG_CHANNEL(EDGEMAG_PACKED, cm, cv, ch);
+#undef EDGEMAG_PACKED
+			m |= (uint32_t)cm << shift;
+			v |= (uint32_t)cv << shift;
+			h |= (uint32_t)ch << shift;
+		}
+
+		mag[x] = m;
+		if (vert) {
+			vert[x] = v;
+		}
+		if (horiz) {
+			horiz[x] = h;
+		}
+	}
+}
+
+static void edgemag_plane_row_scalar(const uint8_t * const * rows, uint8_t * mag,
+				     uint8_t * vert, uint8_t * horiz,
+				     uint32_t x0, uint32_t x1)
+{
+	for (uint32_t x = x0; x < x1; x++) {
+		int m, v, h;
+#define EDGEMAG_PLANE(r, d) ((int)rows[r][x + (d)])
+		EDGEMAG_CHANNEL(EDGEMAG_PLANE, m, v, h);
+#undef EDGEMAG_PLANE
+		mag[x] = m;
+		if (vert) {
+			vert[x] = v;
+		}
+		if (horiz) {
+			horiz[x] = h;
+		}
+	}
+}
+
+#ifdef IMGLIB_X86
+
+/* The responses fit in 16-bit lanes, and interleaving gx with gy lets
+ * a single multiply-add produce gx^2 + gy^2 in 32-bit lanes. Single
+ * precision represents those sums exactly, and its square root is
+ * never rounded up to the next integer, so truncating it matches the
+ * scalar code. As for the convolution rows, <V> and <SI> select the
+ * register width and <STEP> elements of type <T> fit in a register. */
+#define DEFINE_EDGEMAG_ROW(fn, fallback, TARGET, VEC, V, SI, T, STEP, MASK) \
+__attribute__((target(TARGET)))					\
+static void fn(const T * const * rows, T * mag, T * vert, T * horiz,	\
+	       uint32_t x0, uint32_t x1)				\
+{									\
+	const VEC zero = V##_setzero_##SI();				\
+	const VEC rgb_mask = V##_set1_epi32(MASK);			\
+	uint32_t x = x0;						\
+									\
+	for (; x + (STEP) <= x1; x += (STEP)) {			\
+		VEC a[3][3], m[2], gx[2], gy[2];			\
+									\
+		for (int r = 0; r < 3; r++) {				\
+			for (int d = 0; d < 3; d++) {			\
+				a[r][d] = V##_loadu_##SI((const VEC *)	\
+					(rows[r] + x + d - 1));		\
+			}						\
+		}							\
+									\
+		for (int half = 0; half < 2; half++) {			\
+			VEC w[3][3], lo, hi;				\
+			for (int r = 0; r < 3; r++) {			\
+				for (int d = 0; d < 3; d++) {		\
+					w[r][d] = half ? V##_unpackhi_epi8(a[r][d], zero) \
+						: V##_unpacklo_epi8(a[r][d], zero); \
+				}					\
+			}						\
+			gx[half] = V##_add_epi16(			\
+				V##_add_epi16(V##_sub_epi16(w[0][2], w[0][0]), \
+					      V##_sub_epi16(w[2][2], w[2][0])), \
+				V##_slli_epi16(V##_sub_epi16(w[1][2], w[1][0]), 1)); \
+			gy[half] = V##_sub_epi16(			\
+				V##_add_epi16(V##_add_epi16(w[2][0], w[2][2]), \
+					      V##_slli_epi16(w[2][1], 1)), \
+				V##_add_epi16(V##_add_epi16(w[0][0], w[0][2]), \
+					      V##_slli_epi16(w[0][1], 1))); \
+			lo = V##_unpacklo_epi16(gx[half], gy[half]);	\
+			hi = V##_unpackhi_epi16(gx[half], gy[half]);	\
+			lo = V##_cvttps_epi32(V##_sqrt_ps(V##_cvtepi32_ps( \
+				V##_madd_epi16(lo, lo))));		\
+			hi = V##_cvttps_epi32(V##_sqrt_ps(V##_cvtepi32_ps( \
+				V##_madd_epi16(hi, hi))));		\
+			m[half] = V##_packs_epi32(lo, hi);		\
+		}							\
+									\
+		V##_storeu_##SI((VEC *)(mag + x), V##_and_##SI(	\
+			V##_packus_epi16(m[0], m[1]), rgb_mask));	\
+		if (vert) {						\
+			V##_storeu_##SI((VEC *)(vert + x), V##_and_##SI( \
+				V##_packus_epi16(gx[0], gx[1]), rgb_mask)); \
+		}							\
+		if (horiz) {						\
+			V##_storeu_##SI((VEC *)(horiz + x), V##_and_##SI( \
+				V##_packus_epi16(gy[0], gy[1]), rgb_mask)); \
+		}							\
+	}								\
+									\
+	fallback(rows, mag, vert, horiz, x, x1);			\
+}
+
+DEFINE_EDGEMAG_ROW(edgemag_row_sse2, edgemag_row_scalar, "sse2",
+		   __m128i, _mm, si128, uint32_t, 4, 0x00FFFFFF)
+DEFINE_EDGEMAG_ROW(edgemag_plane_row_sse2, edgemag_plane_row_scalar, "sse2",
+		   __m128i, _mm, si128, uint8_t, 16, -1)
+DEFINE_EDGEMAG_ROW(edgemag_row_avx2, edgemag_row_scalar, "avx2",
+		   __m256i, _mm256, si256, uint32_t, 8, 0x00FFFFFF)
+DEFINE_EDGEMAG_ROW(edgemag_plane_row_avx2, edgemag_plane_row_scalar, "avx2",
+		   __m256i, _mm256, si256, uint8_t, 32, -1)
+
+static const edgemag_row_fn edgemag_row[SIMD_LEVELS] = {
+	edgemag_row_scalar, edgemag_row_sse2, edgemag_row_avx2
+};
+
+static const edgemag_plane_row_fn edgemag_plane_row[SIMD_LEVELS] = {
+	edgemag_plane_row_scalar, edgemag_plane_row_sse2, edgemag_plane_row_avx2
+};
+
+#else
+
+static const edgemag_row_fn edgemag_row[SIMD_LEVELS] = {
+	edgemag_row_scalar, edgemag_row_scalar, edgemag_row_scalar
+};
+
+static const edgemag_plane_row_fn edgemag_plane_row[SIMD_LEVELS] = {
+	edgemag_plane_row_scalar, edgemag_plane_row_scalar, edgemag_plane_row_scalar
+};
+
+#endif
+
+/* Compute row <y> of a <width>x<height> image or plane: <in> points
+ * to the input row and <out> to the 3 output rows (magnitude, then
+ * the optional vertical and horizontal responses). Like the Sobel
+ * filters, the one-pixel frame is black in every output. */
+#define EDGEMAG_ROW(T, row_fns, in, out, width, height, y)		\
+	do {								\
+		const T * rows[3];					\
+									\
+		if ((y) == 0 || (y) + 1 >= (height) || (width) <= 2) {	\
+			for (int o = 0; o < 3; o++) {			\
+				if (out[o]) {				\
+					memset(out[o], 0, (width) * sizeof(T)); \
+				}					\
+			}						\
+			break;						\
+		}							\
+									\
+		rows[0] = (in) - (width);				\
+		rows[1] = (in);						\
+		rows[2] = (in) + (width);				\
+		row_fns[simd_level](rows, out[0], out[1], out[2], 1, (width) - 1); \
+		for (int o = 0; o < 3; o++) {				\
+			if (out[o]) {					\
+				out[o][0] = out[o][(width) - 1] = 0;	\
+			}						\
+		}							\
+	} while (0)
+
+struct edgemag_job {
+	const struct image * img;
+	struct image * out[3];      /* Magnitude, vertical and horizontal */
+};
+
+static void edgemag_band(void * arg, uint32_t band, uint32_t nbands)
+{
+	struct edgemag_job * job = (struct edgemag_job *)arg;
+	const struct image * img = job->img;
+	uint32_t width = img->width, height = img->height;
+	uint32_t y, y0, y1;
+
+	par_band_rows(height, 1, band, nbands, &y0, &y1);
+
+	for (y = y0; y < y1; y++) {
+		uint64_t off = (uint64_t)y * width;
+
+		if (img->layout == IMG_PLANAR) {
+			for (int c = 0; c < IMG_PLANES; c++) {
+				uint8_t * out[3];
+				for (int o = 0; o < 3; o++) {
+					out[o] = job->out[o] ? job->out[o]->planes[c] + off : NULL;
+				}
+				EDGEMAG_ROW(uint8_t, edgemag_plane_row, img->planes[c] + off,
+					    out, width, height, y);
+			}
+		} else {
+			uint32_t * out[3];
+			for (int o = 0; o < 3; o++) {
+				out[o] = job->out[o] ? job->out[o]->pixels + off : NULL;
+			}
+			EDGEMAG_ROW(uint32_t, edgemag_row, img->pixels + off,
+				    out, width, height, y);
+		}
+	}
+}
 
-    return sharpenedImg;
+/* Same as detectEdgeMagnitude(), split into bands of rows across up
+ * to <nthreads> threads. */
+struct image* detectEdgeMagnitude_par(const struct image* img, struct image ** vert,
+				      struct image ** horiz, uint32_t nthreads,
+				      uint8_t * err) {
+	struct edgemag_job job;
+
+	if (img && img->base) {
+		struct image * canon = resolveView_par(img, nthreads, NULL);
+
+		job.out[0] = detectEdgeMagnitude_par(canon, vert, horiz, nthreads, err);
+		deleteImage(canon);
+		return job.out[0];
+	}
+
+	if (!img_valid(img)) {
+		if (err) {
+			*err = 1;
+		}
+		return NULL;
+	}
+
+	job.img = img;
+	job.out[0] = createImageLike(img, img->width, img->height);
+	job.out[1] = vert ? createImageLike(img, img->width, img->height) : NULL;
+	job.out[2] = horiz ? createImageLike(img, img->width, img->height) : NULL;
+	par_run(edgemag_band, &job, par_nbands(img->height, 1, nthreads), nthreads);
+
+	if (vert) {
+		*vert = job.out[1];
+	}
+	if (horiz) {
+		*horiz = job.out[2];
+	}
+	if (err) {
+		*err = 0;
+	}
+
+	return job.out[0];
 }
 
 /**
- * @brief Detect vertical edges in an image using the Sobel operator.
- *
- * This function applies the Sobel vertical operator to each pixel in the image to detect
- * vertical edges. Edge pixels are not processed to keep the implementation simple.
+ * @brief Detect edges in all directions as the Sobel gradient magnitude.
  *
- * @param img The original image.
- * @return A new image structure containing the edge detected image. The original image remains 
- *         unchanged.
+ * Each channel of the result is sqrt(gx^2 + gy^2), rounded down and
+ * clipped to 255, where gx and gy are the vertical and horizontal
+ * Sobel responses. If @vert and/or @horiz are not NULL, they receive
+ * new images with the same content detectVerticalEdges() and
+ * detectHorizontalEdges() would produce, computed in the same pass.
+ * Edge pixels are set to black.
  *
  * If @err is not NULL, the function sets 0 in the err parameter if
- * retrieval of the selected pixel is successful, and 1 if an error
- * has occurred. In case of error, NULL is returned by the function.
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
+ */
+struct image* detectEdgeMagnitude(const struct image* img, struct image ** vert,
+				  struct image ** horiz, uint8_t * err) {
+	return detectEdgeMagnitude_par(img, vert, horiz, 1, err);
+}
+
+/* Fused pipelines.
  *
- * Note: The returned image structure should be freed using the deleteImage function 
- *       to avoid memory leaks.
+ * The filters in a pipeline are streamed one row at a time: each
+ * stage keeps a small ring of the rows it produced, just deep enough
+ * for the next stage's kernel, and only the last stage writes to a
+ * full-size image. Rows are pulled on demand from the last stage
+ * back to the source, so a pixel goes through the whole chain while
+ * it is still in cache.
+ *
+ * A rotation needs all of its input rows before it can produce its
+ * first one, so it ends the run of fused filters before it. The last
+ * filter of that run writes 8 rows at a time into a staging buffer
+ * that is rotated straight into the destination with the tile
+ * functions, and the next run reads from there.
+ *
+ * Images are split into bands of rows for *_par() execution. Each
+ * band recomputes the rows of every intermediate stage it needs from
+ * the bands above and below.
+ *
+ * pipelineBMP() runs the same stages on images that never fully sit
+ * in memory: the source is then a ring of rows refilled from the
+ * input file as the first stage pulls them. */
+
+struct pipe_stage {
+	const struct conv_filter * f;   /* NULL for box blur and edge magnitude stages */
+	uint8_t edgemag;                /* Sobel gradient magnitude */
+	uint32_t radius;
+	uint32_t * ring;                /* Last <cap> output rows, NULL for the last stage */
+	uint32_t cap;
+	uint32_t next;                  /* Next row to produce */
+	uint32_t * colsum;              /* Box blur only */
+	uint8_t primed;
+};
+
+struct pipe_job {
+	const struct image * src;
+	struct image * out;
+	const enum img_stage * stages;
+	uint32_t count;
+	uint8_t rotate;                 /* Rotate the output of the last stage */
+	uint8_t failed;
+	uint32_t src_cap;               /* Rows in the source ring, 0 for a whole image */
+	void (*feed)(const struct pipe_job * job, uint32_t upto);  /* Fills the source ring */
+	void * feed_arg;
+};
+
+static const struct conv_filter * pipe_filter(enum img_stage stage)
+{
+	switch (stage) {
+	case IMG_STAGE_BLUR:       return &blur_filter;
+	case IMG_STAGE_SHARPEN:    return &sharpen_filter;
+	case IMG_STAGE_VERTEDGES:  return &vertedges_filter;
+	case IMG_STAGE_HORIZEDGES: return &horizedges_filter;
+	case IMG_STAGE_GAUSS5:     return &gauss5_filter;
+	case IMG_STAGE_GAUSS7:     return &gauss7_filter;
+	case IMG_STAGE_LAPLACIAN:  return &laplacian_filter;
+	default:                   return NULL;
+	}
+}
+
+static uint32_t pipe_box_radius(enum img_stage stage)
+{
+	switch (stage) {
+	case IMG_STAGE_BLUR5:  return 2;
+	case IMG_STAGE_BLUR9:  return 4;
+	case IMG_STAGE_BLUR15: return 7;
+	default:               return 0;
+	}
+}
+
+/* Whether row <y> of a stage is computed from the rows around it,
+ * rather than copied or blacked out from the same row of its input. */
+static inline int pipe_interior(const struct pipe_stage * st, uint32_t y,
+				uint32_t width, uint32_t height)
+{
+	uint32_t r = st->radius;
+
+	if (st->f || st->edgemag) {
+		return y >= r && y + r < height && width > 2 * r;
+	}
+
+	return y >= r && y + r < height && width > 2 * r && height > 2 * r;
+}
+
+/* Row <y> of the output of stage <k>, where stage -1 is the source */
+static inline const uint32_t * pipe_row(const struct pipe_job * job,
+					const struct pipe_stage * st, int k, uint32_t y)
+{
+	if (k < 0 && job->src_cap) {
+		return job->src->pixels + (uint64_t)(y % job->src_cap) * job->src->width;
+	} else if (k < 0) {
+		return &pix(job->src, 0, y);
+	}
+
+	return st[k].ring + (uint64_t)(y % st[k].cap) * job->src->width;
+}
+
+static void pipe_ensure(const struct pipe_job * job, struct pipe_stage * st,
+			int k, uint32_t upto, uint32_t * out_row);
+
+/* Compute row st[k].next of stage <k> into <out_row> */
+static void pipe_produce(const struct pipe_job * job, struct pipe_stage * st,
+			 int k, uint32_t * out_row)
+{
+	const uint32_t * rows[2 * CONV_MAX_RADIUS + 1];
+	struct pipe_stage * s = &st[k];
+	uint32_t width = job->src->width, height = job->src->height;
+	uint32_t y = s->next, r = s->radius;
+	const uint32_t * in_row;
+
+	if (!pipe_interior(s, y, width, height)) {
+		pipe_ensure(job, st, k - 1, y, NULL);
+		in_row = pipe_row(job, st, k - 1, y);
+		if (s->f) {
+			conv_border(s->f, in_row, out_row, 0, width);
+		} else if (s->edgemag) {
+			memset(out_row, 0, width * sizeof(uint32_t));
+		} else {
+			memcpy(out_row, in_row, width * sizeof(uint32_t));
+		}
+		return;
+	}
+
+	pipe_ensure(job, st, k - 1, y + r, NULL);
+	in_row = pipe_row(job, st, k - 1, y);
+
+	if (s->f) {
+		for (uint32_t i = 0; i <= 2 * r; i++) {
+			rows[i] = pipe_row(job, st, k - 1, y - r + i);
+		}
+		s->f->row[simd_level](rows, out_row, r, width - r);
+		conv_border(s->f, in_row, out_row, 0, r);
+		conv_border(s->f, in_row, out_row, width - r, width);
+		return;
+	}
+
+	if (s->edgemag) {
+		for (uint32_t i = 0; i < 3; i++) {
+			rows[i] = pipe_row(job, st, k - 1, y - 1 + i);
+		}
+		edgemag_row[simd_level](rows, out_row, NULL, NULL, 1, width - 1);
+		out_row[0] = out_row[width - 1] = 0;
+		return;
+	}
+
+	if (!s->primed) {
+		memset(s->colsum, 0, 3 * (uint64_t)width * sizeof(uint32_t));
+		for (uint32_t yy = y - r; yy <= y + r; yy++) {
+			box_add_row(s->colsum, pipe_row(job, st, k - 1, yy), width);
+		}
+		s->primed = 1;
+	} else {
+		box_slide_row(s->colsum, pipe_row(job, st, k - 1, y - r - 1),
+			      pipe_row(job, st, k - 1, y + r), width);
+	}
+	box_blur_row(s->colsum, in_row, out_row, width, r);
+}
+
+/* Make sure stage <k> has produced all its rows up to <upto>. Only
+ * the last stage is given an <out_row>, as it produces one row per
+ * call; the others write into their ring. */
+static void pipe_ensure(const struct pipe_job * job, struct pipe_stage * st,
+			int k, uint32_t upto, uint32_t * out_row)
+{
+	if (k < 0) {
+		if (job->feed) {
+			job->feed(job, upto);
+		}
+		return;
+	}
+
+	while (st[k].next <= upto) {
+		uint32_t * dst = out_row ? out_row
+			: st[k].ring + (uint64_t)(st[k].next % st[k].cap) * job->src->width;
+		pipe_produce(job, st, k, dst);
+		st[k].next++;
+	}
+}
+
+/* Rotate rows [<y>, <y> + <n>) of the pipeline output, held in
+ * <staging>, into their place in the rotated output image. */
+static void pipe_flush_rotated(const struct pipe_job * job, const uint32_t * staging,
+			       uint32_t y, uint32_t n)
+{
+	uint32_t width = job->src->width, height = job->src->height;
+	uint32_t full_w = (n == ROT_TILE) ? (width & ~(ROT_TILE - 1)) : 0;
+	rot_tile_fn tile = rot_tile[simd_level];
+	uint32_t i, x;
+
+	for (x = 0; x < full_w; x += ROT_TILE) {
+		tile(staging + x, width, &pix(job->out, y, width - x - 1),
+		     -(ptrdiff_t)height);
+	}
+
+	for (i = 0; i < n; i++) {
+		for (x = full_w; x < width; x++) {
+			pix(job->out, y + i, width - x - 1) = staging[(uint64_t)i * width + x];
+		}
+	}
+}
+
+/* Set up the stages of <job> in <st> to produce rows from <y0> on.
+ * Returns 0 on success, 1 if memory ran out; pipe_release() frees
+ * what was set up either way. */
+static uint8_t pipe_setup(const struct pipe_job * job, struct pipe_stage * st, uint32_t y0)
+{
+	uint32_t width = job->src->width, start = y0;
+	int k, last = job->count - 1;
+
+	memset(st, 0, IMG_PIPELINE_MAX * sizeof(*st));
+	for (k = last; k >= 0; k--) {
+		struct pipe_stage * s = &st[k];
+
+		s->f = pipe_filter(job->stages[k]);
+		s->edgemag = (job->stages[k] == IMG_STAGE_EDGEMAG);
+		s->radius = s->f ? s->f->radius
+			: s->edgemag ? 1 : pipe_box_radius(job->stages[k]);
+		s->next = start;
+
+		/* Box blur also needs the row leaving its window */
+		if (k < last) {
+			s->cap = 2 * st[k + 1].radius + 2;
+			s->ring = (uint32_t *)malloc((uint64_t)s->cap * width * sizeof(uint32_t));
+			if (!s->ring) {
+				return 1;
+			}
+		}
+
+		if (!s->f && !s->edgemag) {
+			s->colsum = (uint32_t *)malloc(3 * (uint64_t)width * sizeof(uint32_t));
+			if (!s->colsum) {
+				return 1;
+			}
+		}
+
+		start = (start > s->radius) ? start - s->radius : 0;
+	}
+
+	return 0;
+}
+
+static void pipe_release(const struct pipe_job * job, struct pipe_stage * st)
+{
+	for (uint32_t k = 0; k < job->count; k++) {
+		free(st[k].ring);
+		free(st[k].colsum);
+	}
+}
+
+static void pipe_band(void * arg, uint32_t band, uint32_t nbands)
+{
+	struct pipe_job * job = (struct pipe_job *)arg;
+	struct pipe_stage st[IMG_PIPELINE_MAX];
+	uint32_t width = job->src->width, height = job->src->height;
+	uint32_t * staging = NULL;
+	uint32_t y, y0, y1;
+	int last = job->count - 1;
+
+	par_band_rows(height, ROT_TILE, band, nbands, &y0, &y1);
+	if (y0 == y1) {
+		return;
+	}
+
+	if (pipe_setup(job, st, y0)) {
+		goto fail;
+	}
+
+	if (job->rotate) {
+		staging = (uint32_t *)malloc((uint64_t)ROT_TILE * width * sizeof(uint32_t));
+		if (!staging) {
+			goto fail;
+		}
+	}
+
+	for (y = y0; y < y1; y++) {
+		if (staging) {
+			pipe_ensure(job, st, last, y, staging + (uint64_t)(y % ROT_TILE) * width);
+			if ((y + 1) % ROT_TILE == 0 || y + 1 == y1) {
+				uint32_t first = y - y % ROT_TILE;
+				pipe_flush_rotated(job, staging, first, y + 1 - first);
+			}
+		} else {
+			pipe_ensure(job, st, last, y, &pix(job->out, 0, y));
+		}
+	}
+
+	goto out;
+
+fail:
+	__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+out:
+	pipe_release(job, st);
+	free(staging);
+}
+
+/* Run the filters in <stages> on <img> as a single fused pass, and
+ * rotate the result if <rotate> is set. */
+static struct image * pipe_segment(const struct image * img, const enum img_stage * stages,
+				   uint32_t count, uint8_t rotate, uint32_t nthreads)
+{
+	struct pipe_job job = { img, NULL, stages, count, rotate, 0, 0, NULL, NULL };
+
+	job.out = rotate ? createImageUninit(img->height, img->width)
+		: createImageUninit(img->width, img->height);
+	if (!job.out) {
+		return NULL;
+	}
+
+	par_run(pipe_band, &job, par_nbands(img->height, ROT_TILE, nthreads), nthreads);
+
+	if (job.failed) {
+		deleteImage(job.out);
+		return NULL;
+	}
+
+	return job.out;
+}
+
+/* Apply the single operation <stage> to <img> */
+static struct image * pipe_apply(const struct image * img, enum img_stage stage,
+				 uint32_t nthreads)
+{
+	const struct conv_filter * f = pipe_filter(stage);
+
+	if (stage == IMG_STAGE_ROT90CLKW) {
+		return rotate90Clockwise_par(img, nthreads, NULL);
+	} else if (f) {
+		return convolve(img, f, nthreads, NULL);
+	} else if (stage == IMG_STAGE_EDGEMAG) {
+		return detectEdgeMagnitude_par(img, NULL, NULL, nthreads, NULL);
+	}
+
+	return boxBlurImage_par(img, pipe_box_radius(stage), nthreads, NULL);
+}
+
+/* Same as pipelineImage(), split into bands of rows across up to
+ * <nthreads> threads. */
+struct image * pipelineImage_par(const struct image * img, const enum img_stage * stages,
+				 uint32_t count, uint32_t nthreads, uint8_t * err)
+{
+	struct image * cur = NULL;
+	uint32_t i, j, lead, trail, end;
+
+	if (!img || !stages || count == 0 || count > IMG_PIPELINE_MAX) {
+		goto fail;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (stages[i] >= IMG_STAGES) {
+			goto fail;
+		}
+	}
+
+	/* Rotations at the start of the pipeline are folded into the
+	 * materialization of the input, and those at the end only turn
+	 * the output into a view */
+	for (lead = 0; lead < count && stages[lead] == IMG_STAGE_ROT90CLKW; lead++);
+	for (trail = 0; lead + trail < count
+		     && stages[count - trail - 1] == IMG_STAGE_ROT90CLKW; trail++);
+	end = count - trail;
+
+	if (lead || img->base) {
+		cur = img->base ? rotate_turns(img->base, img->orient + lead, nthreads, NULL)
+			: rotate_turns(img, lead, nthreads, NULL);
+		if (!cur) {
+			goto fail;
+		}
+	} else if (!img_valid(img)) {
+		goto fail;
+	}
+
+	/* Split the rest into runs of filters ending at a rotation or at
+	 * the end of the pipeline. Only the output of each run is
+	 * materialized. */
+	for (i = lead; i < end; i = j + 1) {
+		const struct image * in = cur ? cur : img;
+		struct image * next;
+		uint8_t rotate;
+
+		for (j = i; j < end && stages[j] != IMG_STAGE_ROT90CLKW; j++);
+		rotate = (j < end);
+
+		if (in->layout == IMG_PLANAR) {
+			/* The fused pass streams packed rows: planar images
+			 * go through the planar filters one at a time */
+			j = i;
+			next = pipe_apply(in, stages[i], nthreads);
+		} else if (j == i) {
+			next = rotate90Clockwise_par(in, nthreads, NULL);
+		} else {
+			next = pipe_segment(in, stages + i, j - i, rotate, nthreads);
+		}
+
+		if (cur) {
+			deleteImage(cur);
+		}
+		cur = next;
+
+		if (!cur) {
+			goto fail;
+		}
+	}
+
+	if (trail) {
+		struct image * view = rotateView(cur, trail);
+
+		deleteImage(cur);
+		cur = view;
+		if (!cur) {
+			goto fail;
+		}
+	}
+
+	if (err) {
+		*err = 0;
+	}
+
+	return cur;
+
+fail:
+	if (err) {
+		*err = 1;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Apply a sequence of operations to an image in a single fused pass.
+ *
+ * The result is the same as applying each of the <count> operations
+ * in <stages> in turn, but intermediate images are never
+ * materialized, except for the input of a rotation that follows
+ * other filters. At most IMG_PIPELINE_MAX operations are allowed.
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
  */
-struct image* detectVerticalEdges(const struct image* img, uint8_t * err) {
-    struct image* edgeImg;
-    uint32_t x, y;
-
-    int kernel[3][3] = {
-        {-1, 0, 1},
-        {-2, 0, 2},
-        {-1, 0, 1}
-    };
-
-    if (!img || !img->pixels) {
-	    if (err) {
-		    *err = 1;
-	    }
-	    return NULL;
-    }
+struct image * pipelineImage(const struct image * img, const enum img_stage * stages,
+			     uint32_t count, uint8_t * err)
+{
+	return pipelineImage_par(img, stages, count, 1, err);
+}
 
-    edgeImg = createImage(img->width, img->height);
-
-    for (y = 0; y < img->height; y++) {
-        for (x = 0; x < img->width; x++) {
-            // For simplicity, edge pixels are not processed
-            if (y == 0 || x == 0 || y == img->height - 1 || x == img->width - 1) {
-		    pix(edgeImg, x, y) = 0; // Set to black for edge pixels
-            } else {
-                int sumR = 0, sumG = 0, sumB = 0;
-
-                // Convolve with the kernel
-                for (int ky = -1; ky <= 1; ky++) {
-                    for (int kx = -1; kx <= 1; kx++) {
-			    uint32_t pixel = pix(img, x + kx, y + ky);
-			    sumR += ((pixel >> 16) & 0xFF) * kernel[ky + 1][kx + 1];
-			    sumG += ((pixel >> 8) & 0xFF) * kernel[ky + 1][kx + 1];
-			    sumB += (pixel & 0xFF) * kernel[ky + 1][kx + 1];
-                    }
-                }
-
-                // Clip the values to [0, 255]
-                sumR = (sumR > 255) ? 255 : (sumR < 0) ? 0 : sumR;
-                sumG = (sumG > 255) ? 255 : (sumG < 0) ? 0 : sumG;
-                sumB = (sumB > 255) ? 255 : (sumB < 0) ? 0 : sumB;
-
-                pix(edgeImg, x, y) = (sumR << 16) | (sumG << 8) | sumB;
-            }
-        }
-    }
+/* BMP decoding.
+ *
+ * The file is mapped and converted a whole row at a time, from the
+ * 24-bit BGR triplets of the file to packed 0x00RRGGBB pixels. */
 
-    if (err) {
-	    *err = 0;
-    }
+/* Convert the <count> BGR triplets at <in> to packed pixels at <out> */
+typedef void (*bgr_row_fn)(const uint8_t * in, uint32_t * out, uint32_t count);
+
+static void bgr_row_scalar(const uint8_t * in, uint32_t * out, uint32_t count)
+{
+	for (uint32_t x = 0; x < count; x++, in += 3) {
+		out[x] = ((uint32_t)in[2] << 16) | ((uint32_t)in[1] << 8) | in[0];
+	}
+}
+
+#ifdef IMGLIB_X86
+
+/* Each 128-bit lane loads 16 bytes, of which the first 12 are four
+ * pixels, and spreads them out with a byte shuffle that also clears
+ * the top byte. The last load of a row must not read past it, so the
+ * final pixels go through the scalar version. */
+__attribute__((target("avx2")))
+static void bgr_row_avx2(const uint8_t * in, uint32_t * out, uint32_t count)
+{
+	const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+						6, 7, 8, -1, 9, 10, 11, -1,
+						0, 1, 2, -1, 3, 4, 5, -1,
+						6, 7, 8, -1, 9, 10, 11, -1);
+	uint32_t x = 0;
+
+	for (; (uint64_t)(x + 8) * 3 + 4 <= (uint64_t)count * 3; x += 8, in += 24) {
+		__m256i v = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)in)),
+			_mm_loadu_si128((const __m128i *)(in + 12)), 1);
+
+		_mm256_storeu_si256((__m256i *)(out + x), _mm256_shuffle_epi8(v, spread));
+	}
 
-    return edgeImg;
+	bgr_row_scalar(in, out + x, count - x);
 }
 
-/**
- * @brief Detect horizontal edges in an image using the Sobel operator.
- *
- * This function applies the Sobel horizontal operator to each pixel in the image to detect
- * horizontal edges. Edge pixels are not processed to keep the implementation simple.
- *
- * @param img The original image.
- * @return A new image structure containing the edge detected image. The original image remains 
- *         unchanged.
- *
- * If @err is not NULL, the function sets 0 in the err parameter if
- * retrieval of the selected pixel is successful, and 1 if an error
- * has occurred. In case of error, NULL is returned by the function.
- *
- * Note: The returned image structure should be freed using the deleteImage function 
- *       to avoid memory leaks.
- */
-struct image* detectHorizontalEdges(const struct image* img, uint8_t * err) {
-    struct image* edgeImg;
-    uint32_t x, y;
-
-    int kernel[3][3] = {
-        {-1, -2, -1},
-        { 0,  0,  0},
-        { 1,  2,  1}
-    };
-
-    if (!img || !img->pixels) {
-	    if (err) {
-		    *err = 1;
-	    }
-	    return NULL;
-    }
+/* The byte shuffle needs SSSE3, which SSE2 alone does not offer */
+static const bgr_row_fn bgr_row[SIMD_LEVELS] = {
+	bgr_row_scalar, bgr_row_scalar, bgr_row_avx2
+};
 
-    edgeImg = createImage(img->width, img->height);
-
-    for (y = 0; y < img->height; y++) {
-        for (x = 0; x < img->width; x++) {
-            // For simplicity, edge pixels are not processed
-            if (y == 0 || x == 0 || y == img->height - 1 || x == img->width - 1) {
-		    pix(edgeImg, x, y) = 0; // Set to black for edge pixels
-            } else {
-                int sumR = 0, sumG = 0, sumB = 0;
-
-                // Convolve with the kernel
-                for (int ky = -1; ky <= 1; ky++) {
-                    for (int kx = -1; kx <= 1; kx++) {
-			    uint32_t pixel = pix(img, x + kx, y + ky);
-			    sumR += ((pixel >> 16) & 0xFF) * kernel[ky + 1][kx + 1];
-			    sumG += ((pixel >> 8) & 0xFF) * kernel[ky + 1][kx + 1];
-			    sumB += (pixel & 0xFF) * kernel[ky + 1][kx + 1];
-                    }
-                }
-
-                // Clip the values to [0, 255]
-                sumR = (sumR > 255) ? 255 : (sumR < 0) ? 0 : sumR;
-                sumG = (sumG > 255) ? 255 : (sumG < 0) ? 0 : sumG;
-                sumB = (sumB > 255) ? 255 : (sumB < 0) ? 0 : sumB;
-
-                pix(edgeImg, x, y) = (sumR << 16) | (sumG << 8) | sumB;
-            }
-        }
-    }
+#else
 
-    if (err) {
-	    *err = 0;
-    }
+static const bgr_row_fn bgr_row[SIMD_LEVELS] = {
+	bgr_row_scalar, bgr_row_scalar, bgr_row_scalar
+};
 
-    return edgeImg;
-}
+#endif
 
 /**
  * @brief Load a BMP image from a file.
@@ -465,6 +3582,10 @@ struct image* detectHorizontalEdges(const struct image* img, uint8_t * err) {
  * an image structure. The image is represented as a 2D array of uint32_t values where 
  * each entry corresponds to an RGB pixel.
  *
+ * The file is mapped rather than read, and each row is converted in
+ * one go, bottom row first as BMP files store them. Pixels missing
+ * from a truncated file are left black.
+ *
  * @param filename The path to the BMP file to be loaded.
  * @return A pointer to a struct image containing the image data. Returns NULL if the 
  *         file couldn't be opened or if the file is not a valid 24-bit BMP image.
@@ -473,52 +3594,192 @@ struct image* detectHorizontalEdges(const struct image* img, uint8_t * err) {
  *       to avoid memory leaks.
  */
 struct image* loadBMP(const char* filename) {
-	int fd = open(filename, O_RDONLY);
-	uint32_t x, y;
-	BMPHeader header;
-	BMPInfoHeader infoHeader;
+	/* Don't wait on FIFOs and the like: only regular files are
+	 * accepted below */
+	int fd = open(filename, O_RDONLY | O_NONBLOCK);
+	bgr_row_fn row = bgr_row[simd_level];
+	const BMPHeader * header;
+	const BMPInfoHeader * infoHeader;
+	const uint8_t * data;
+	struct image * img = NULL;
+	struct stat st;
+	uint64_t size, stride;
+	uint32_t y;
 
 	if (fd == -1) return NULL;
 
-	header.type = 0;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)
+	    || (uint64_t)st.st_size < sizeof(BMPHeader) + sizeof(BMPInfoHeader)) {
+		close(fd);
+		return NULL;
+	}
+
+	size = st.st_size;
+	data = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return NULL;
+	}
+	madvise((void *)data, size, MADV_SEQUENTIAL);
 
-	read(fd, &header, sizeof(BMPHeader));
-	read(fd, &infoHeader, sizeof(BMPInfoHeader));
+	header = (const BMPHeader *)data;
+	infoHeader = (const BMPInfoHeader *)(data + sizeof(BMPHeader));
 
-	if (header.type != 0x4D42 || infoHeader.bits != 24) {
-		close(fd);
+	if (header->type != 0x4D42 || infoHeader->bits != 24) {
+		munmap((void *)data, size);
 		return NULL;
 	}
 
-	//printf("IMG: %d x %d x %d\n", infoHeader.width, infoHeader.height, infoHeader.bits);
-	struct image* img = createImage(infoHeader.width, infoHeader.height);
-	int padding = (4 - (infoHeader.width * 3) % 4) % 4;
+	//printf("IMG: %d x %d x %d\n", infoHeader->width, infoHeader->height, infoHeader->bits);
+	img = createImageUninit(infoHeader->width, infoHeader->height);
 
-	lseek(fd, header.offset, SEEK_SET);
+	/* Rows are padded to a multiple of 4 bytes */
+	stride = ((uint64_t)infoHeader->width * 3 + 3) & ~3ULL;
 
-	/* Start from the last row */
-	y = infoHeader.height - 1;
+	for (y = 0; y < img->height; y++) {
+		uint64_t start = header->offset + (uint64_t)(img->height - y - 1) * stride;
+		uint64_t avail = (start < size) ? (size - start) / 3 : 0;
+		uint32_t count = (avail < img->width) ? avail : img->width;
+		uint32_t * out = img->pixels + (uint64_t)y * img->width;
 
-	do {
-		for (x = 0; x < infoHeader.width; x++) {
-			unsigned char color[3];
-			read(fd, color, sizeof(unsigned char) * 3);
-			pix(img, x, y) = (color[2] << 16) | (color[1] << 8) | color[0];
-		}
-		lseek(fd, padding, SEEK_CUR);
-	} while (y-- > 0); /* The post-increment here is important not
-			    * to miss the last row. */
+		row(data + start, out, count);
+		memset(out + count, 0, (uint64_t)(img->width - count) * sizeof(uint32_t));
+	}
 
-	close(fd);
+	munmap((void *)data, size);
 	return img;
 }
 
+/* BMP encoding.
+ *
+ * Rows are converted from packed pixels to BGR triplets in a staging
+ * buffer holding a block of rows, which is then written out in one
+ * go. saveBMPMapped() converts them straight into a mapping of the
+ * file instead. */
+
+/* Rows converted between two writes, within this many bytes */
+#define BMP_BLOCK_BYTES (1ULL << 20)
+
+/* Bytes a row conversion may write past the end of the row */
+#define BMP_ROW_SLACK 4
+
+/* Convert the <count> packed pixels at <in> to BGR triplets at <out> */
+typedef void (*xrgb_row_fn)(const uint32_t * in, uint8_t * out, uint32_t count);
+
+static void xrgb_row_scalar(const uint32_t * in, uint8_t * out, uint32_t count)
+{
+	for (uint32_t x = 0; x < count; x++, out += 3) {
+		uint32_t pixel = in[x];
+		out[0] = pixel & 0xFF;
+		out[1] = (pixel >> 8) & 0xFF;
+		out[2] = (pixel >> 16) & 0xFF;
+	}
+}
+
+#ifdef IMGLIB_X86
+
+/* The reverse of bgr_row_avx2(): each lane packs four pixels into its
+ * low 12 bytes, and both lanes are stored 12 bytes apart. The upper
+ * 4 bytes of each store are overwritten by the next one, and those of
+ * the last store land in the BMP_ROW_SLACK bytes past the row. */
+__attribute__((target("avx2")))
+static void xrgb_row_avx2(const uint32_t * in, uint8_t * out, uint32_t count)
+{
+	const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+					      10, 12, 13, 14, -1, -1, -1, -1,
+					      0, 1, 2, 4, 5, 6, 8, 9,
+					      10, 12, 13, 14, -1, -1, -1, -1);
+	uint32_t x = 0;
+
+	for (; x + 8 <= count; x += 8, out += 24) {
+		__m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(in + x)), pack);
+
+		_mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(v));
+		_mm_storeu_si128((__m128i *)(out + 12), _mm256_extracti128_si256(v, 1));
+	}
+
+	xrgb_row_scalar(in + x, out, count - x);
+}
+
+/* The byte shuffle needs SSSE3, which SSE2 alone does not offer */
+static const xrgb_row_fn xrgb_row[SIMD_LEVELS] = {
+	xrgb_row_scalar, xrgb_row_scalar, xrgb_row_avx2
+};
+
+#else
+
+static const xrgb_row_fn xrgb_row[SIMD_LEVELS] = {
+	xrgb_row_scalar, xrgb_row_scalar, xrgb_row_scalar
+};
+
+#endif
+
+/* Fill in the BMP headers for <img>, and return the size of a row in
+ * the file, padding included */
+static uint64_t bmp_headers(const struct image * img, BMPHeader * header,
+			    BMPInfoHeader * infoHeader)
+{
+	BMPHeader h = { 0x4D42, 54 + img->width * img->height * 3, 0, 0, 54 };
+	BMPInfoHeader ih = { 40, img->width, img->height, 1, 24, 0,
+			     img->width * img->height * 3, 0, 0, 0, 0 };
+
+	*header = h;
+	*infoHeader = ih;
+
+	/* Rows are padded to a multiple of 4 bytes */
+	return ((uint64_t)img->width * 3 + 3) & ~3ULL;
+}
+
+/* Convert row <y> of <img>, which is not a view, into the <stride>
+ * bytes at <out>, padding included. Up to BMP_ROW_SLACK bytes past
+ * them may be overwritten. */
+static void bmp_encode_row(const struct image * img, uint32_t y, uint8_t * out,
+			   uint64_t stride)
+{
+	uint64_t off = (uint64_t)y * img->width;
+	uint64_t used = (uint64_t)img->width * 3;
+
+	if (img->layout == IMG_PLANAR) {
+		const uint8_t * r = img->planes[IMG_PLANE_R] + off;
+		const uint8_t * g = img->planes[IMG_PLANE_G] + off;
+		const uint8_t * b = img->planes[IMG_PLANE_B] + off;
+		for (uint32_t x = 0; x < img->width; x++) {
+			out[3 * x] = b[x];
+			out[3 * x + 1] = g[x];
+			out[3 * x + 2] = r[x];
+		}
+	} else {
+		xrgb_row[simd_level](img->pixels + off, out, img->width);
+	}
+
+	memset(out + used, 0, stride - used);
+}
+
+/* Write the <bytes> bytes at <buf> to <fd>. Returns 0 on success, 1
+ * on error. */
+static uint8_t write_all(int fd, const uint8_t * buf, uint64_t bytes)
+{
+	while (bytes) {
+		ssize_t cur = write(fd, buf, bytes);
+		if (cur <= 0) {
+			return 1;
+		}
+		buf += cur;
+		bytes -= cur;
+	}
+
+	return 0;
+}
+
 /**
  * @brief Save an image to a BMP file.
  *
  * This function saves the provided image to a 24-bit BMP file. The image is represented 
  * as a 2D array of uint32_t values where each entry corresponds to an RGB pixel.
  *
+ * Rows are converted in blocks of about BMP_BLOCK_BYTES, each written
+ * out with a single call, last row first as BMP files store them.
+ *
  * @param filename The path where the BMP file should be saved.
  * @param img A pointer to the struct image containing the image data.
  * @return 0 if the image was saved successfully, 1 otherwise.
@@ -527,44 +3788,467 @@ struct image* loadBMP(const char* filename) {
  *       backup or checks in place if overwriting is not desired.
  */
 uint8_t saveBMP(const char* filename, const struct image* img) {
+	BMPHeader header;
+	BMPInfoHeader infoHeader;
+	uint64_t stride, rows;
+	uint8_t * block;
+	uint8_t ret = 0;
+	uint32_t y, i;
+	int fd;
+
+	/* Views are encoded from their canonical layout */
+	if (img && img->base) {
+		struct image * canon = resolveView(img, NULL);
+
+		ret = saveBMP(filename, canon);
+		deleteImage(canon);
+		return ret;
+	}
+
+	if (!img_valid(img)) {
+		return 1;
+	}
+
+	stride = bmp_headers(img, &header, &infoHeader);
+	rows = stride ? BMP_BLOCK_BYTES / stride : img->height;
+	rows = rows ? rows : 1;
+	if (rows > img->height) {
+		rows = img->height;
+	}
+
+	block = (uint8_t *)malloc(sizeof(header) + sizeof(infoHeader)
+				  + rows * stride + BMP_ROW_SLACK);
+	if (!block) {
+		return 1;
+	}
+
 	/* Create if the file does not exist, overwrite otherwise. Set
 	 * file permissions: 0644 */
-	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC,
-		      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	uint32_t x, y;
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC,
+		  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1) {
+		free(block);
+		return 1;
+	}
 
-	if (fd == -1) return 1;
+	/* The headers go out with the first block */
+	memcpy(block, &header, sizeof(header));
+	memcpy(block + sizeof(header), &infoHeader, sizeof(infoHeader));
+	i = sizeof(header) + sizeof(infoHeader);
 
-	BMPHeader header = { 0x4D42, 54 + img->width * img->height * 3, 0, 0, 54 };
-	BMPInfoHeader infoHeader = { 40, img->width, img->height, 1, 24, 0,
-				     img->width * img->height * 3, 0, 0, 0, 0 };
+	/* Start by serializing the last row. */
+	for (y = img->height; y > 0 && !ret; ) {
+		uint8_t * out = block + i;
+		uint32_t n = (y < rows) ? y : rows;
 
-	write(fd, &header, sizeof(BMPHeader));
-	write(fd, &infoHeader, sizeof(BMPInfoHeader));
+		for (uint32_t r = 0; r < n; r++, out += stride) {
+			bmp_encode_row(img, --y, out, stride);
+		}
+		ret = write_all(fd, block, out - block);
+		i = 0;
+	}
 
-	int padding = (4 - (img->width * 3) % 4) % 4;
+	/* Nothing but the headers for empty images */
+	if (i && !ret) {
+		ret = write_all(fd, block, i);
+	}
 
-	/* Start by serializing the last row. */
-	y = img->height - 1;
-	do {
-		for (x = 0; x < img->width; x++) {
-			uint32_t pixel = pix(img, x, y);
-			unsigned char color[3] = { pixel & 0xFF,
-						   (pixel >> 8) & 0xFF,
-						   (pixel >> 16) & 0xFF };
-			write(fd, color, sizeof(unsigned char) * 3);
-		}
-		for (int i = 0; i < padding; i++) {
-			unsigned char pad = 0;
-			write(fd, &pad, 1);
-		}
-	} while ( y-- > 0); /* The post-increment here is important
-			    * not to miss the last row. */
+	free(block);
+	if (close(fd) == -1) {
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/* Same as saveBMP(), but the file is sized upfront and mapped, and
+ * the rows are converted in place */
+uint8_t saveBMPMapped(const char* filename, const struct image* img) {
+	BMPHeader header;
+	BMPInfoHeader infoHeader;
+	uint64_t stride, size;
+	uint8_t * data, * tail;
+	uint8_t ret = 0;
+	uint32_t y;
+	int fd;
+
+	if (img && img->base) {
+		struct image * canon = resolveView(img, NULL);
+
+		ret = saveBMPMapped(filename, canon);
+		deleteImage(canon);
+		return ret;
+	}
 
+	if (!img_valid(img)) {
+		return 1;
+	}
+
+	stride = bmp_headers(img, &header, &infoHeader);
+	size = sizeof(header) + sizeof(infoHeader) + stride * img->height;
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC,
+		  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1) {
+		return 1;
+	}
+
+	if (ftruncate(fd, size) == -1) {
+		close(fd);
+		return 1;
+	}
+
+	data = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	close(fd);
+	if (data == MAP_FAILED) {
+		return 1;
+	}
+
+	memcpy(data, &header, sizeof(header));
+	memcpy(data + sizeof(header), &infoHeader, sizeof(infoHeader));
+
+	/* Rows are converted in file order, so that the slack of each
+	 * conversion lands on the next row before it is written. The
+	 * last row has no room past it and goes through a small buffer. */
+	tail = (uint8_t *)malloc(stride + BMP_ROW_SLACK);
+	if (!tail) {
+		munmap(data, size);
+		return 1;
+	}
+
+	for (y = img->height; y-- > 0; ) {
+		uint8_t * out = data + sizeof(header) + sizeof(infoHeader)
+			+ (uint64_t)(img->height - y - 1) * stride;
+
+		if (y == 0) {
+			bmp_encode_row(img, y, tail, stride);
+			memcpy(out, tail, stride);
+		} else {
+			bmp_encode_row(img, y, out, stride);
+		}
+	}
+
+	free(tail);
+	if (munmap(data, size) == -1) {
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/* Read up to <bytes> bytes at <offset> in <fd> into <buf>, and return
+ * how many were read before the end of the file or an error */
+static uint64_t read_at(int fd, uint8_t * buf, uint64_t bytes, uint64_t offset)
+{
+	uint64_t done = 0;
+
+	while (done < bytes) {
+		ssize_t cur = pread(fd, buf + done, bytes - done, offset + done);
+		if (cur <= 0) {
+			break;
+		}
+		done += cur;
+	}
+
+	return done;
+}
+
+/* State of pipelineBMP(). Input and output rows have the same size in
+ * their files, and share the <bytes> buffer of one strip. */
+struct bmp_stream {
+	int in_fd;
+	uint64_t in_offset;     /* Offset of the pixel rows in the input */
+	uint64_t stride;        /* Bytes per row in the files */
+	uint32_t strip;         /* Rows read or written at a time */
+	uint32_t loaded;        /* Source rows loaded so far */
+	uint8_t * bytes;        /* One strip as stored in the files */
+};
+
+/* Load source rows into the ring of the streamed pipeline until row
+ * <upto> is there, a strip at a time. Image rows [y, y + n) are the
+ * file rows [height - y - n, height - y), bottom row first. */
+static void stream_feed(const struct pipe_job * job, uint32_t upto)
+{
+	struct bmp_stream * s = (struct bmp_stream *)job->feed_arg;
+	uint32_t width = job->src->width, height = job->src->height;
+
+	while (s->loaded <= upto && s->loaded < height) {
+		uint32_t n = (height - s->loaded < s->strip) ? height - s->loaded : s->strip;
+		uint64_t bytes = (uint64_t)n * s->stride;
+		uint64_t got = read_at(s->in_fd, s->bytes, bytes, s->in_offset
+				       + (uint64_t)(height - s->loaded - n) * s->stride);
+
+		/* Pixels missing from a truncated file are black */
+		memset(s->bytes + got, 0, bytes - got);
+
+		for (uint32_t i = 0; i < n; i++) {
+			uint32_t y = s->loaded + i;
+			bgr_row[simd_level](s->bytes + (uint64_t)(n - i - 1) * s->stride,
+					    job->src->pixels + (uint64_t)(y % job->src_cap) * width,
+					    width);
+		}
+		s->loaded += n;
+	}
+}
+
+/* Stream the BMP file <in_path> through <stages> into <out_path>, a
+ * strip of rows at a time */
+uint8_t pipelineBMP(const char * in_path, const char * out_path,
+		    const enum img_stage * stages, uint32_t count, uint64_t strip_bytes)
+{
+	struct pipe_stage st[IMG_PIPELINE_MAX];
+	struct pipe_job job = { NULL, NULL, stages, count, 0, 0, 0, stream_feed, NULL };
+	struct image src, strip;
+	struct bmp_stream s;
+	BMPHeader header;
+	BMPInfoHeader infoHeader;
+	uint64_t row_bytes;
+	uint32_t i, y0;
+	uint8_t ret = 1;
+	int out_fd = -1;
+
+	if (!stages || count == 0 || count > IMG_PIPELINE_MAX) {
+		return 1;
+	}
+
+	/* A rotation needs the whole image at once */
+	for (i = 0; i < count; i++) {
+		if (stages[i] >= IMG_STAGES || stages[i] == IMG_STAGE_ROT90CLKW) {
+			return 1;
+		}
+	}
+
+	memset(&s, 0, sizeof(s));
+	memset(&src, 0, sizeof(src));
+	memset(&strip, 0, sizeof(strip));
+	memset(st, 0, sizeof(st));
+
+	s.in_fd = open(in_path, O_RDONLY);
+	if (s.in_fd == -1) {
+		return 1;
+	}
+
+	if (read_at(s.in_fd, (uint8_t *)&header, sizeof(header), 0) != sizeof(header)
+	    || read_at(s.in_fd, (uint8_t *)&infoHeader, sizeof(infoHeader), sizeof(header))
+	    != sizeof(infoHeader)
+	    || header.type != 0x4D42 || infoHeader.bits != 24) {
+		goto out;
+	}
+
+	src.width = strip.width = infoHeader.width;
+	src.height = infoHeader.height;
+	src.layout = strip.layout = IMG_PACKED;
+	row_bytes = (uint64_t)src.width * sizeof(uint32_t);
+	s.strip = (row_bytes && strip_bytes / row_bytes) ? strip_bytes / row_bytes : 1;
+	if (s.strip > src.height) {
+		s.strip = src.height ? src.height : 1;
+	}
+	strip.height = s.strip;
+	s.in_offset = header.offset;
+
+	job.src = &src;
+	job.feed_arg = &s;
+	if (pipe_setup(&job, st, 0)) {
+		goto out;
+	}
+
+	/* The source ring holds a strip plus the rows the first stage
+	 * still needs around the one it works on */
+	job.src_cap = s.strip + 2 * st[0].radius + 2;
+	s.stride = bmp_headers(&src, &header, &infoHeader);
+	src.pixels = (uint32_t *)malloc(job.src_cap * row_bytes);
+	strip.pixels = (uint32_t *)malloc(s.strip * row_bytes);
+	s.bytes = (uint8_t *)malloc(s.strip * s.stride + BMP_ROW_SLACK);
+	if (!src.pixels || !strip.pixels || !s.bytes) {
+		goto out;
+	}
+
+	/* Create if the file does not exist, overwrite otherwise. Set
+	 * file permissions: 0644 */
+	out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC,
+		      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (out_fd == -1 || write_all(out_fd, (const uint8_t *)&header, sizeof(header))
+	    || write_all(out_fd, (const uint8_t *)&infoHeader, sizeof(infoHeader))) {
+		goto out;
+	}
+
+	/* Output rows [y0, y0 + n) go to the file rows [height - y0 - n,
+	 * height - y0). They are converted in file order, so that the
+	 * slack of each conversion lands on a row not converted yet. */
+	for (y0 = 0; y0 < src.height; y0 += strip.height) {
+		uint32_t n = (src.height - y0 < s.strip) ? src.height - y0 : s.strip;
+		uint64_t offset = sizeof(header) + sizeof(infoHeader)
+			+ (uint64_t)(src.height - y0 - n) * s.stride;
+
+		for (i = 0; i < n; i++) {
+			pipe_ensure(&job, st, count - 1, y0 + i, strip.pixels + (uint64_t)i * src.width);
+		}
+
+		for (i = n; i-- > 0; ) {
+			bmp_encode_row(&strip, i, s.bytes + (uint64_t)(n - i - 1) * s.stride, s.stride);
+		}
+
+		if ((uint64_t)pwrite(out_fd, s.bytes, (uint64_t)n * s.stride, offset)
+		    != (uint64_t)n * s.stride) {
+			goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	pipe_release(&job, st);
+	free(src.pixels);
+	free(strip.pixels);
+	free(s.bytes);
+	close(s.in_fd);
+	if (out_fd != -1 && close(out_fd) == -1) {
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/* Send the <bytes> bytes at <buf> on <sockfd>. Returns 0 on success,
+ * 1 on error. */
+static uint8_t send_buffer(int sockfd, const char * buf, uint64_t bytes)
+{
+	while (bytes) {
+		ssize_t cur = send(sockfd, buf, bytes, 0);
+		if (cur <= 0) {
+			perror("Unable to send image on socket");
+			return 1;
+		}
+		buf += cur;
+		bytes -= cur;
+	}
+
 	return 0;
 }
 
+/* Gather rows [<v0>, <v0> + <rows>) of the view <img> into <band> as
+ * packed pixels. <bytes> has room for ROT_TILE rows of each plane if
+ * the image shown is planar.
+ *
+ * With two turns each row is a row of the image reversed. With odd
+ * turns the rows are columns of the image, and a full band of
+ * ROT_TILE rows goes through the same tile functions as rotate_rows(),
+ * one ROT_TILE x ROT_TILE block of the image at a time. The pixels
+ * left over past the last full block are read one at a time. */
+static void view_band(const struct image * img, uint32_t v0, uint32_t rows,
+		      uint32_t * band, uint8_t * bytes)
+{
+	const struct image * base = img->base;
+	uint32_t width = img->width, bw = base->width, bh = base->height;
+	uint32_t full = (rows == ROT_TILE) ? bh & ~(ROT_TILE - 1) : 0;
+	uint32_t x0, x1, x, y, by;
+
+	if (img->orient == 2) {
+		for (y = 0; y < rows; y++) {
+			uint64_t row = (uint64_t)(bh - 1 - v0 - y) * bw;
+			uint32_t * out = band + (uint64_t)y * width;
+
+			if (base->layout == IMG_PLANAR) {
+				planes_to_pack(base->planes[IMG_PLANE_R] + row,
+					       base->planes[IMG_PLANE_G] + row,
+					       base->planes[IMG_PLANE_B] + row, out, bw);
+			} else {
+				memcpy(out, base->pixels + row, (uint64_t)bw * sizeof(uint32_t));
+			}
+			rot_reverse_row(out, width);
+		}
+		return;
+	}
+
+	/* View row v0 + j is column bw - v0 - 1 - j of the image with one
+	 * turn, read top down, and column v0 + j with three, read bottom
+	 * up */
+	for (by = 0; by < full; by += ROT_TILE) {
+		if (base->layout == IMG_PLANAR) {
+			for (int c = 0; c < IMG_PLANES; c++) {
+				uint8_t * out = bytes + (uint64_t)c * ROT_TILE * width;
+
+				if (img->orient == 1) {
+					rot_tile8[simd_level](base->planes[c] + (uint64_t)by * bw
+							      + bw - v0 - ROT_TILE, bw,
+							      out + (uint64_t)(ROT_TILE - 1) * width + by,
+							      -(ptrdiff_t)width);
+				} else {
+					rot_tile8[simd_level](base->planes[c]
+							      + (uint64_t)(by + ROT_TILE - 1) * bw + v0,
+							      -(ptrdiff_t)bw, out + bh - by - ROT_TILE,
+							      width);
+				}
+			}
+		} else if (img->orient == 1) {
+			rot_tile[simd_level](&pix(base, bw - v0 - ROT_TILE, by), bw,
+					     band + (uint64_t)(ROT_TILE - 1) * width + by,
+					     -(ptrdiff_t)width);
+		} else {
+			rot_tile[simd_level](&pix(base, v0, by + ROT_TILE - 1), -(ptrdiff_t)bw,
+					     band + bh - by - ROT_TILE, width);
+		}
+	}
+
+	/* Pixels not covered by a full block */
+	x0 = (img->orient == 1) ? full : 0;
+	x1 = (img->orient == 1) ? width : width - full;
+	for (y = 0; y < rows; y++) {
+		for (x = x0; x < x1; x++) {
+			uint32_t sx = x, sy = v0 + y;
+
+			view_coords(img, &sx, &sy);
+			if (base->layout == IMG_PLANAR) {
+				for (int c = 0; c < IMG_PLANES; c++) {
+					bytes[((uint64_t)c * ROT_TILE + y) * width + x]
+						= plane_pix(base, c, sx, sy);
+				}
+			} else {
+				band[(uint64_t)y * width + x] = pix(base, sx, sy);
+			}
+		}
+	}
+
+	if (base->layout == IMG_PLANAR) {
+		for (y = 0; y < rows; y++) {
+			planes_to_pack(bytes + ((uint64_t)IMG_PLANE_R * ROT_TILE + y) * width,
+				       bytes + ((uint64_t)IMG_PLANE_G * ROT_TILE + y) * width,
+				       bytes + ((uint64_t)IMG_PLANE_B * ROT_TILE + y) * width,
+				       band + (uint64_t)y * width, width);
+		}
+	}
+}
+
+/* Send the pixels of the view <img> in packed format, ROT_TILE rows
+ * at a time */
+static uint8_t send_view(struct image * img, int sockfd)
+{
+	uint32_t * band = (uint32_t *)malloc((uint64_t)img->width * ROT_TILE * sizeof(uint32_t));
+	uint8_t * bytes = NULL;
+	uint32_t y0, rows;
+	uint8_t ret = 0;
+
+	if (img->layout == IMG_PLANAR) {
+		bytes = (uint8_t *)malloc((uint64_t)img->width * ROT_TILE * IMG_PLANES);
+	}
+	if (!band || (img->layout == IMG_PLANAR && !bytes)) {
+		free(band);
+		free(bytes);
+		return 1;
+	}
+
+	for (y0 = 0; y0 < img->height && !ret; y0 += rows) {
+		rows = (img->height - y0 < ROT_TILE) ? img->height - y0 : ROT_TILE;
+		view_band(img, y0, rows, band, bytes);
+		ret = send_buffer(sockfd, (const char *)band,
+				  (uint64_t)rows * img->width * sizeof(uint32_t));
+	}
+
+	free(band);
+	free(bytes);
+	return ret;
+}
+
 /**
  * sendImage - Serialize and send an image structure over a given socket.
  *
@@ -581,7 +4265,7 @@ uint8_t saveBMP(const char* filename, const struct image* img) {
  */
 uint8_t sendImage(struct image* img, int sockfd) {
     char magic[3] = {'I', 'M', 'G'};
-    size_t to_send = img->width * img->height * sizeof(uint32_t);
+    size_t to_send = (uint64_t)img->width * img->height * sizeof(uint32_t);
     char * bufptr = (char *)(img->pixels);
 
     /* Send the magic bytes */
@@ -595,6 +4279,36 @@ uint8_t sendImage(struct image* img, int sockfd) {
         return 1;
     }
 
+    if (img->base) {
+	    return send_view(img, sockfd);
+    }
+
+    /* Planar images are sent in the packed format, one chunk of
+     * pixels at a time */
+    if (img->layout == IMG_PLANAR) {
+	    uint64_t count = (uint64_t)img->width * img->height;
+	    uint32_t chunk[4096];
+
+	    for (uint64_t i = 0; i < count; i += 4096) {
+		    uint64_t n = (count - i < 4096) ? count - i : 4096;
+		    planes_to_pack(img->planes[IMG_PLANE_R] + i, img->planes[IMG_PLANE_G] + i,
+				   img->planes[IMG_PLANE_B] + i, chunk, n);
+		    bufptr = (char *)chunk;
+		    to_send = n * sizeof(uint32_t);
+		    while (to_send) {
+			    ssize_t cur = send(sockfd, bufptr, to_send, 0);
+			    if (cur <= 0) {
+				    perror("Unable to send image on socket");
+				    return 1;
+			    }
+			    bufptr += cur;
+			    to_send -= cur;
+		    }
+	    }
+
+	    return 0;
+    }
+
     /* Send all the pixel data on the socket */
     while (to_send) {
 	    size_t cur = send(sockfd, bufptr, to_send, 0);
@@ -623,11 +4337,60 @@ uint8_t sendImage(struct image* img, int sockfd) {
  * @return a valid image pointer on success, NULL on error.
  */
 struct image * recvImage(int sockfd) {
+	return recvImageHashed(sockfd, NULL);
+}
+
+/* Fold the 64-bit words in [<p>, <end>) into <hash> */
+static uint64_t img_hash_words(uint64_t hash, const char * p, const char * end)
+{
+	for (; p < end; p += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		hash ^= word * 0x87C37B91114253D5ULL;
+		hash = ((hash << 31) | (hash >> 33)) * 0x4CF5AD432745937FULL;
+	}
+
+	return hash;
+}
+
+/* Finish the hash <h> of <img>, whose first <hashed> of <total> pixel
+ * bytes went through img_hash_words() */
+static uint64_t img_hash_finish(uint64_t h, const struct image * img, uint64_t hashed,
+				uint64_t total)
+{
+	/* Pixels are 4 bytes, so at most one is left over */
+	if (hashed < total) {
+		h ^= img->pixels[hashed / sizeof(uint32_t)] * 0x87C37B91114253D5ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+/* Same hash as recvImageHashed() gives, for an image already in
+ * memory */
+uint64_t imageHash(const struct image * img)
+{
+	uint64_t total = (uint64_t)img->width * img->height * sizeof(uint32_t);
+	uint64_t h = ((uint64_t)img->width << 32 | img->height) * 0x9E3779B97F4A7C15ULL;
+
+	h = img_hash_words(h, (const char *)img->pixels,
+			   (const char *)img->pixels + (total & ~(uint64_t)7));
+	return img_hash_finish(h, img, total & ~(uint64_t)7, total);
+}
+
+/* Same as recvImage(). If <hash> is not NULL, it also receives a
+ * 64-bit hash of the image size and pixels, computed on each chunk
+ * while it is still in cache. */
+struct image * recvImageHashed(int sockfd, uint64_t * hash) {
 	char magic[3];
 	size_t to_recv;
 	char * bufptr;
 	uint32_t width, height;
 	struct image * img = NULL;
+	uint64_t h, hashed = 0, total;
 
 	/* Receive the magic bytes */
 	if (recv(sockfd, magic, 3, 0) != 3 || strncmp(magic, "IMG", 3) != 0) {
@@ -641,19 +4404,32 @@ struct image * recvImage(int sockfd) {
 	}
 
 	/* Create a new image to fill up */
-	img = createImage(width, height);
-	to_recv = img->width * img->height * sizeof(uint32_t);
+	img = createImageUninit(width, height);
+	total = to_recv = (uint64_t)img->width * img->height * sizeof(uint32_t);
 	bufptr = (char *)(img->pixels);
+	h = ((uint64_t)width << 32 | height) * 0x9E3779B97F4A7C15ULL;
 
 	/* Receive all the pixel bytes on the socket */
 	while(to_recv) {
-		size_t cur = recv(sockfd, bufptr, to_recv, 0);
+		ssize_t cur = recv(sockfd, bufptr, to_recv, 0);
 		if (cur <= 0) {
 			deleteImage(img);
 			return NULL;
 		}
 		bufptr += cur;
 		to_recv -= cur;
+
+		/* Hash the whole words received so far */
+		if (hash) {
+			uint64_t upto = (total - to_recv) & ~(uint64_t)7;
+			h = img_hash_words(h, (const char *)img->pixels + hashed,
+					   (const char *)img->pixels + upto);
+			hashed = upto;
+		}
+	}
+
+	if (hash) {
+		*hash = img_hash_finish(h, img, hashed, total);
 	}
 
 	return img;
@@ -38,11 +38,32 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+
+/* How the pixels of an image are laid out in memory */
+enum img_layout {
+	IMG_PACKED = 0, /* One uint32_t per pixel in 0x00RRGGBB format */
+	IMG_PLANAR, /* One uint8_t plane per channel, no padding byte */
+};
+
+/* Planes of a planar image */
+enum img_plane {
+	IMG_PLANE_R = 0,
+	IMG_PLANE_G,
+	IMG_PLANE_B,
+	IMG_PLANES
+};
 
 struct image {
 	uint32_t width; /* The width of the image */
 	uint32_t height; /* The height of the image */
-	uint32_t * pixels; /* Array of pixel values in x-y order */
+	uint32_t * pixels; /* Array of pixel values in x-y order, packed images only */
+	enum img_layout layout; /* Layout of the pixel data */
+	uint8_t * planes[IMG_PLANES]; /* Channel values in x-y order, planar images only */
+	uint32_t refs; /* Number of references held, see shareImage() */
+	uint8_t mapped; /* Pixel data is mapped from a file, see mapImage() */
+	uint8_t orient; /* Quarter turns clockwise applied to base, views only */
+	struct image * base; /* Image shown by a view, see rotateView() */
 };
 
 #pragma pack(push, 1)  // Ensure structure is packed
@@ -70,12 +91,53 @@ typedef struct {
 #pragma pack(pop)  // End packed structure
 
 /* Allocate and initialize the memory and metadata for a new
- * <width>x<height> pixels. */
+ * <width>x<height> pixels. Returns NULL if memory ran out. */
 struct image * createImage(uint32_t width, uint32_t height);
 
-/* Deallocate all the memory for a given image. */
+/* Same as createImage(), but the pixels are left uninitialized. Meant
+ * for code that writes every pixel of the new image anyway. Pixel
+ * buffers are recycled through a pool, so this is also cheaper than
+ * a fresh allocation. */
+struct image * createImageUninit(uint32_t width, uint32_t height);
+
+/* Back the pixels of images taking at least <min_bytes> bytes with
+ * 2MB transparent huge pages, placed on the NUMA node of the thread
+ * that allocates them. Passing 0 (the default) turns this off. */
+void imgSetHugePages(uint64_t min_bytes);
+
+/* Keep at most <bytes> bytes of freed pixel buffers around for reuse,
+ * across all threads. The default is 256MB, and 0 turns reuse off. */
+void imgSetPoolLimit(uint64_t bytes);
+
+/* Same as createImage(), but the image uses the planar layout: three
+ * separate 8-bit planes for the R, G and B channels. All the image
+ * operations accept both layouts and return an image in the same
+ * layout as their input. */
+struct image * createPlanarImage(uint32_t width, uint32_t height);
+struct image * createPlanarImageUninit(uint32_t width, uint32_t height);
+
+/* Creates a copy of <img> in the planar layout, or in the packed
+ * layout for toPackedImage(). The content is copied as is if the
+ * image already uses the requested layout.
+ *
+ * If <err> is not NULL, the function sets 0 in the err parameter if
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
+*/
+struct image * toPlanarImage(const struct image * img, uint8_t * err);
+struct image * toPackedImage(const struct image * img, uint8_t * err);
+
+/* Deallocate all the memory for a given image. If the image is
+ * shared, this only drops one reference to it. */
 void deleteImage(struct image * img);
 
+/* Take an extra reference to <img> and return it. The image is freed
+ * only once deleteImage() has been called for every reference, so
+ * shared images must be treated as read-only. isImageShared() tells
+ * whether more than one reference is held. */
+struct image * shareImage(struct image * img);
+uint8_t isImageShared(const struct image * img);
+
 /* Set a specific pixel at position (<x>,<y>) in the image <img> to a
  * specific <value>. The function returns 0 if the operation is
  * successful and 1 in case of error. */
@@ -102,6 +164,48 @@ uint32_t getPixel(const struct image * img, uint32_t x, uint32_t y, uint8_t * er
 */
 struct image * cloneImage(const struct image * src, uint8_t * err);
 
+/* Number of bytes of pixel data held by <img> */
+uint64_t imageBytes(const struct image * img);
+
+/* Write the pixel data of <img>, imageBytes() bytes, at <offset> in
+ * the file <fd>. The function returns 0 if the operation is
+ * successful and 1 in case of error. */
+uint8_t storeImage(const struct image * img, int fd, uint64_t offset);
+
+/* Create a <width>x<height> image in <layout> whose pixel data is the
+ * content written by storeImage() at <offset> in <fd>, which must be
+ * a multiple of the page size. Nothing is read upfront: pages are
+ * faulted in from the file as they are accessed, or read ahead right
+ * away if <prefetch> is set. Writes to the image are not written
+ * back to the file. Returns NULL in case of error. */
+struct image * mapImage(int fd, uint64_t offset, uint32_t width, uint32_t height,
+			enum img_layout layout, uint8_t prefetch);
+
+/* Compressed copy of an image, see compressImage() */
+struct image_blob {
+	uint32_t width;
+	uint32_t height;
+	enum img_layout layout;
+	uint64_t bytes; /* Size of data */
+	uint8_t data[];
+};
+
+/* Compress the pixels of <img> losslessly into a new blob, to be
+ * released with free(). Each channel is predicted from its left, top
+ * and top-left neighbors, and the residuals are bit-packed in blocks
+ * of 16, so smooth areas and the unused alpha byte take little space.
+ * Returns NULL in case of error. */
+struct image_blob * compressImage(const struct image * img);
+
+/* Create a new image, in the layout it was compressed from, with the
+ * pixels held in <blob>. Returns NULL in case of error. */
+struct image * decompressImage(const struct image_blob * blob);
+
+/* Returns 1 if <a> and <b> have the same size and pixels, and 0
+ * otherwise. Packed and planar images are compared on their R, G
+ * and B channels. */
+uint8_t imagesEqual(const struct image * a, const struct image * b);
+
 /* Creates a new image by rotating the input image by 90 degreees
  * clockwise. NOTE: the original image must be manually deallocated if
  * not needed. If successful, the function returns a pointer to the
@@ -113,6 +217,33 @@ struct image * cloneImage(const struct image * src, uint8_t * err);
 */
 struct image * rotate90Clockwise(const struct image * img, uint8_t * err);
 
+/* Creates a view of <img> rotated by <turns> times 90 degrees
+ * clockwise, without touching the pixels. The view holds a reference
+ * to <img>, which must not change anymore, and has the width and
+ * height of the rotated image. Rotating a view only adds to its
+ * orientation, and full turns give back a new reference to the image
+ * it shows. Returns NULL in case of error.
+ *
+ * Views are read-only. getPixel() and sendImage() read them through
+ * their orientation, while the other operations first
+ * materialize their pixels, as resolveView() does. */
+struct image * rotateView(struct image * img, uint32_t turns);
+
+/* Creates a new image with the content of the view <img>, its pixels
+ * rotated in memory. Same as cloneImage() for other images.
+ *
+ * If <err> is not NULL, the function sets 0 in the err parameter if
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
+*/
+struct image * resolveView(const struct image * img, uint8_t * err);
+
+/* Rotates a square image by 90 degrees clockwise in place, without
+ * allocating a second image. The function returns 0 if the operation
+ * is successful and 1 in case of error, including when the image is
+ * not square, not in the packed layout, shared, or a view. */
+uint8_t rotate90ClockwiseInPlace(struct image * img);
+
 /**
  * @brief Blur an image using a 3x3 averaging kernel.
  *
@@ -132,6 +263,28 @@ struct image * rotate90Clockwise(const struct image * img, uint8_t * err);
  */
 struct image* blurImage(const struct image* img, uint8_t * err);
 
+/**
+ * @brief Blur an image using a (2*radius+1)x(2*radius+1) box kernel.
+ *
+ * This function averages each pixel with its neighbors in a square window using
+ * running row and column sums, so the cost per pixel does not depend on <radius>.
+ * Pixels closer than <radius> to the edge are not blurred to keep the implementation
+ * simple. A radius of 1 produces the same result as blurImage.
+ *
+ * @param img The original image to be blurred.
+ * @param radius The distance from the center to the edge of the window, at least 1.
+ * @return A new image structure containing the blurred image. The original image remains 
+ *         unchanged.
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function 
+ *       to avoid memory leaks.
+ */
+struct image* boxBlurImage(const struct image* img, uint32_t radius, uint8_t * err);
+
 /**
  * @brief Sharpen an image using a 3x3 sharpening kernel.
  *
@@ -190,6 +343,171 @@ struct image* detectVerticalEdges(const struct image* img, uint8_t * err);
  */
 struct image* detectHorizontalEdges(const struct image* img, uint8_t * err);
 
+/**
+ * @brief Blur an image using a 5x5 Gaussian kernel.
+ *
+ * This function applies the 5x5 binomial approximation of a Gaussian kernel to each
+ * pixel in the image. Pixels within 2 of the edge are not blurred to keep the
+ * implementation simple.
+ *
+ * @param img The original image to be blurred.
+ * @return A new image structure containing the blurred image. The original image remains 
+ *         unchanged.
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function 
+ *       to avoid memory leaks.
+ */
+struct image* gaussianBlur5Image(const struct image* img, uint8_t * err);
+
+/**
+ * @brief Blur an image using a 7x7 Gaussian kernel.
+ *
+ * This function applies the 7x7 binomial approximation of a Gaussian kernel to each
+ * pixel in the image. Pixels within 3 of the edge are not blurred to keep the
+ * implementation simple.
+ *
+ * @param img The original image to be blurred.
+ * @return A new image structure containing the blurred image. The original image remains 
+ *         unchanged.
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function 
+ *       to avoid memory leaks.
+ */
+struct image* gaussianBlur7Image(const struct image* img, uint8_t * err);
+
+/**
+ * @brief Detect edges in an image using the Laplacian operator.
+ *
+ * This function applies the 3x3 Laplacian operator to each pixel in the image to detect
+ * edges in all directions. Edge pixels are not processed to keep the implementation simple.
+ *
+ * @param img The original image.
+ * @return A new image structure containing the edge detected image. The original image remains 
+ *         unchanged.
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function 
+ *       to avoid memory leaks.
+ */
+struct image* detectLaplacianEdges(const struct image* img, uint8_t * err);
+
+/**
+ * @brief Detect edges in all directions as the Sobel gradient magnitude.
+ *
+ * Both Sobel operators are applied in a single pass. Each channel of
+ * the result is sqrt(gx^2 + gy^2), rounded down and clipped to 255,
+ * where gx and gy are the vertical and horizontal Sobel responses.
+ * Edge pixels are set to black.
+ *
+ * @param vert If not NULL, receives a new image with the same content
+ *        detectVerticalEdges() would produce.
+ * @param horiz If not NULL, receives a new image with the same content
+ *        detectHorizontalEdges() would produce.
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
+ */
+struct image* detectEdgeMagnitude(const struct image* img, struct image ** vert,
+				  struct image ** horiz, uint8_t * err);
+
+/* Operations that can be chained in a pipeline */
+enum img_stage {
+    IMG_STAGE_ROT90CLKW = 0,
+    IMG_STAGE_BLUR,
+    IMG_STAGE_SHARPEN,
+    IMG_STAGE_VERTEDGES,
+    IMG_STAGE_HORIZEDGES,
+    IMG_STAGE_BLUR5,
+    IMG_STAGE_BLUR9,
+    IMG_STAGE_BLUR15,
+    IMG_STAGE_GAUSS5,
+    IMG_STAGE_GAUSS7,
+    IMG_STAGE_LAPLACIAN,
+    IMG_STAGE_EDGEMAG,
+    IMG_STAGES
+};
+
+/* Maximum number of operations in a pipeline */
+#define IMG_PIPELINE_MAX 16
+
+/**
+ * @brief Apply a sequence of operations to an image in a single fused pass.
+ *
+ * The result is the same as applying each of the <count> operations
+ * in <stages> in turn, but the filters are streamed through small
+ * line buffers so that intermediate images are never materialized,
+ * except for the input of a rotation that follows other filters. At
+ * most IMG_PIPELINE_MAX operations are allowed.
+ *
+ * If @err is not NULL, the function sets 0 in the err parameter if
+ * the operation is successful, and 1 if an error has occurred. In
+ * case of error, NULL is returned by the function.
+ */
+struct image * pipelineImage(const struct image * img, const enum img_stage * stages,
+			     uint32_t count, uint8_t * err);
+
+/**
+ * @brief Apply a sequence of filters to a BMP file too large for memory.
+ *
+ * The 24-bit BMP file <in_path> goes through the <count> operations
+ * in <stages> the way pipelineImage() would, and the result is saved
+ * to <out_path> as saveBMP() would. The image is never loaded as a
+ * whole: rows are read in strips of about <strip_bytes> bytes of
+ * pixels, streamed through the filters, which keep only the rows
+ * their kernels span, and written out one strip at a time. Rotations
+ * need the whole image and are not allowed.
+ *
+ * @return 0 on success, 1 on error.
+ */
+uint8_t pipelineBMP(const char * in_path, const char * out_path,
+		    const enum img_stage * stages, uint32_t count, uint64_t strip_bytes);
+
+/**
+ * Row-band parallel versions of the image operations.
+ *
+ * Each of these functions produces exactly the same result as the
+ * function of the same name without the _par suffix, but splits the
+ * image into bands of rows processed by up to <nthreads> threads: the
+ * calling thread plus helpers from the pool started with imgPoolInit().
+ * With <nthreads> set to 1, or if no pool was started, all the work is
+ * done by the calling thread.
+ */
+struct image * rotate90Clockwise_par(const struct image * img, uint32_t nthreads, uint8_t * err);
+struct image * resolveView_par(const struct image * img, uint32_t nthreads, uint8_t * err);
+struct image* blurImage_par(const struct image* img, uint32_t nthreads, uint8_t * err);
+struct image* boxBlurImage_par(const struct image* img, uint32_t radius, uint32_t nthreads, uint8_t * err);
+struct image* sharpenImage_par(const struct image* img, uint32_t nthreads, uint8_t * err);
+struct image* detectVerticalEdges_par(const struct image* img, uint32_t nthreads, uint8_t * err);
+struct image* detectHorizontalEdges_par(const struct image* img, uint32_t nthreads, uint8_t * err);
+struct image* gaussianBlur5Image_par(const struct image* img, uint32_t nthreads, uint8_t * err);
+struct image* gaussianBlur7Image_par(const struct image* img, uint32_t nthreads, uint8_t * err);
+struct image* detectLaplacianEdges_par(const struct image* img, uint32_t nthreads, uint8_t * err);
+struct image* detectEdgeMagnitude_par(const struct image* img, struct image ** vert,
+				      struct image ** horiz, uint32_t nthreads, uint8_t * err);
+struct image * pipelineImage_par(const struct image * img, const enum img_stage * stages,
+				 uint32_t count, uint32_t nthreads, uint8_t * err);
+
+/* Start <helpers> threads that lend a hand to the *_par() functions.
+ * The function returns 0 if the operation is successful and 1 in case
+ * of error. */
+uint8_t imgPoolInit(uint32_t helpers);
+
+/* Stop and join all the helper threads started by imgPoolInit(). Must
+ * not be called while *_par() functions are running. */
+void imgPoolDestroy(void);
+
 /**
  * @brief Load a BMP image from a file.
  *
@@ -225,6 +543,11 @@ struct image* loadBMP(const char* filename);
  */
 uint8_t saveBMP(const char* filename, const struct image* img);
 
+/* Same as saveBMP(), but the file is sized upfront and mapped, and
+ * the pixels are converted directly into the mapping instead of going
+ * through write(). */
+uint8_t saveBMPMapped(const char* filename, const struct image* img);
+
 
 /**
  * sendImage - Serialize and send an image structure over a given socket.
@@ -257,5 +580,13 @@ uint8_t sendImage(struct image* img, int sockfd);
  */
 struct image * recvImage(int sockfd);
 
+/* Same as recvImage(). If <hash> is not NULL, it also receives a
+ * 64-bit hash of the image size and pixels, computed as the pixels
+ * arrive. Images with the same content always get the same hash. */
+struct image * recvImageHashed(int sockfd, uint64_t * hash);
+
+/* The hash recvImageHashed() would give for the packed image <img> */
+uint64_t imageHash(const struct image * img);
+
 /* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
 #endif
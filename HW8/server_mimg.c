@@ -10,13 +10,33 @@
 *     size.
 *
 * Usage:
-*     <build directory>/server -q <queue_size> -w <workers> -p <policy> <port_number>
+*     <build directory>/server -q <queue_size> -w <workers> -p <policy> [-l <layout>]
+*                              [-h <event>] [-H] [-d] [-c <cache MB>]
+*                              [-m <memory bytes>] [-z <idle seconds>]
+*                              [-s <snapshot file>] [-S <seconds>] [-j <log file>]
+*                              [-I <image directory>] <port_number>
 *
 * Parameters:
 *     port_number - The port number to bind the server to.
 *     queue_size  - The maximum number of queued requests.
 *     workers     - The number of parallel threads to process requests.
 *     policy      - The queue policy to use for request dispatching.
+*     layout      - How registered images are stored: packed (default) or planar.
+*     event       - Hardware event counted for each request: INSTR, L1MISS,
+*                   LLCMISS or DTLBMISS.
+*     -H          - Back large images with huge pages on the worker's NUMA node.
+*     -d          - Share a single copy of images registered with the same content.
+*     cache MB    - Memory for caching operation results, 0 (default) to disable.
+*     memory bytes - Memory for registered images; colder ones are spilled to
+*                   disk beyond that. 0 (default) for no limit.
+*     idle seconds - Compress images in memory once unused for that long.
+*     snapshot file - Images to restore at startup, and where to save them
+*                   when the client disconnects.
+*     seconds     - Also save a snapshot this often while serving.
+*     log file    - Log of the changes to the images, replayed at startup on
+*                   top of the snapshot to recover from a crash.
+*     image directory - BMP files registered at startup, before the client
+*                   connects, in the order of their names.
 *
 * Author:
 *     Renato Mancuso
@@ -51,17 +71,51 @@
 /* Needed for semaphores */
 #include <semaphore.h>
 
+/* Needed for snapshots */
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Needed for the operation log */
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* Needed to preload images */
+#include <dirent.h>
+#include <limits.h>
+
 /* Include struct definitions and other libraries that need to be
  * included by both client and server */
 #include "common.h"
 
+/* Hardware counters to measure the requests */
+#include "perflib.h"
+
 #define BACKLOG_COUNT 100
+#define LOG_BATCH_RECORDS 64
+#define LOG_FLUSH_DELAY_NS 1000000
 #define USAGE_STRING				\
 	"Missing parameter. Exiting.\n"		\
 	"Usage: %s -q <queue size> "		\
 	"-w <workers: 1> "			\
 	"-p <policy: FIFO> "			\
-	"<port_number>\n"
+	"[-l <layout: packed|planar>] "		\
+	"[-h <event: INSTR|L1MISS|LLCMISS|DTLBMISS>] " \
+	"[-H] "					\
+	"[-d] "					\
+	"[-c <cache MB: 0>] "			\
+	"[-m <memory bytes: 0>] "		\
+	"[-z <idle seconds>] "			\
+	"[-s <snapshot file>] "			\
+	"[-S <seconds>] "			\
+	"[-j <log file>] "			\
+	"[-I <image directory>] "		\
+	"[-R <register directory>] "		\
+	"<port_number>\n"			\
+	"   or: %s -F <op>[,<op>...] <input BMP> <output BMP>\n"
+
+/* Images of at least this many bytes go on huge pages with -H */
+#define HUGE_PAGE_MIN_BYTES (2 << 20)
 
 /* 4KB of stack for the worker thread */
 #define STACK_SIZE (4096)
@@ -88,8 +142,15 @@ sem_t * queue_notify;
 // Socket Semaphore
 sem_t socket_sem;
 
-// Global semaphore for protecting image_entries array
-sem_t images_array_sem;
+/* Location of an image written to the spill file or a snapshot */
+struct spill_slot {
+	int fd;
+	uint64_t offset;
+	uint64_t bytes;        // 0 if there is no copy on disk
+	uint32_t width, height;
+	enum img_layout layout;
+	uint32_t maps;         // Mappings of the copy handed out
+};
 
 // Wrapper struct for images
 struct image_entry {
@@ -99,15 +160,211 @@ struct image_entry {
     uint64_t next_op;      // Sequence number of the next operation
     pthread_mutex_t order_mutex;
     pthread_cond_t order_cond;
+    uint64_t version;      // Content version of img, see next_version()
+    uint64_t pending;      // Operations queued or running on the image
+    uint64_t lsn;          // Log record that made the current version, or 0
+    struct spill_slot spill;   // Copy of this version on disk, if any
+    struct image_blob * blob;  // Compressed image while img is NULL
+    uint64_t last_use;     // Time of the last request, see now_ns()
+    struct content_entry * content; // Index entry of its content, if held
+    uint32_t generation;   // Number of times the slot was freed
+    uint8_t referenced;    // Used since the CLOCK hand last went by
+    uint8_t live;          // Holds an image, as opposed to a free slot
+    uint8_t ready;         // Set once the entry is initialized
 };
 
-// Wrapper Array so that we can include semaphores in each image
-struct image_entry *image_entries = NULL;
+/* Registered images live in segments that never move once allocated:
+ * segment k holds IMAGE_SEGMENT_BASE << k entries, so the table grows
+ * without copying existing entries, and workers can look them up
+ * without taking any lock. */
+#define IMAGE_SEGMENT_BASE 1024
+#define IMAGE_SEGMENTS 40
+
+struct image_entry * image_segments[IMAGE_SEGMENTS];
 
+// Number of slots handed out so far
 uint64_t image_count = 0;
 
+/* An image ID holds the slot of its entry in the low IMAGE_SLOT_BITS
+ * bits, and the generation of the slot above them. Slots of deleted
+ * images are reused by new ones with the next generation, so that
+ * requests still using the ID of a deleted image are rejected. */
+#define IMAGE_SLOT_BITS 40
+#define IMAGE_GEN_MASK ((1ULL << (64 - IMAGE_SLOT_BITS)) - 1)
+#define IMAGE_ID(slot, gen) ((slot) | (((uint64_t)(gen) & IMAGE_GEN_MASK) << IMAGE_SLOT_BITS))
+#define IMAGE_ID_SLOT(id) ((id) & ((1ULL << IMAGE_SLOT_BITS) - 1))
+#define IMAGE_ID_GEN(id) ((id) >> IMAGE_SLOT_BITS)
+
+/* Slots of deleted images, reused first by new images */
+sem_t free_sem;
+uint64_t * free_slots = NULL;
+uint64_t free_count = 0;
+uint64_t free_size = 0;
+uint64_t delete_count = 0;
+
+// Last content version handed out
+uint64_t image_version = 0;
+
+/* Memory budget for the images held by the image table, set with -m.
+ * When they take more than that, a CLOCK hand sweeps the table and
+ * writes out images that were not used since it last went by to a
+ * spill file. Spilled images are mapped back from the file the next
+ * time a request needs them, and read ahead as soon as the request is
+ * queued. Images shared by several entries are charged to each.
+ * Freed pixel buffers kept around for reuse get 1/STORE_POOL_SHARE of
+ * the budget, and the image table the rest. */
+#define STORE_POOL_SHARE 8
+uint64_t store_budget = 0;      // In bytes, 0 if unlimited
+uint64_t store_bytes = 0;       // Bytes of the images held by entries
+uint64_t store_hand = 0;        // Next ID the CLOCK hand looks at
+sem_t store_sem;                // Serializes sweeps
+int spill_fd = -1;
+uint64_t spill_end = 0;         // First unused byte of the spill file
+uint64_t spill_page = 4096;
+uint64_t spill_count = 0;
+uint64_t fault_count = 0;
+
+/* Background compaction, enabled with -z: images nobody has used for
+ * compact_idle_ns are compressed in memory by the compactor thread,
+ * and decompressed by the next request that needs them. */
+uint64_t compact_idle_ns = 0;   // 0 if disabled
+volatile uint8_t compactor_done = 0;
+uint64_t compact_count = 0;     // Images compressed so far
+uint64_t expand_count = 0;      // Images decompressed so far
+uint64_t compact_raw = 0;       // Uncompressed size of the compressed images
+uint64_t compact_bytes = 0;     // Compressed size of the compressed images
+
+/* Snapshots of the image table, enabled with -s. A snapshot starts
+ * with a header and one record per image ID, followed by the pixel
+ * data of each image at a page-aligned offset, laid out as by
+ * storeImage(). At startup the images of a snapshot are not read in:
+ * each entry points into it like it would into the spill file, and
+ * is mapped in by the first request that needs it. */
+#define SNAPSHOT_MAGIC 0x33504e53474d49ULL  // "IMGSNP3"
+
+struct snapshot_header {
+	uint64_t magic;
+	uint64_t count;        // Number of records
+	uint64_t page;         // Alignment of the pixel data
+	uint64_t lsn;          // Last operation log record it includes
+};
+
+/* The slot of a record with SNAPSHOT_HOLE is free */
+#define SNAPSHOT_HOLE 1
+
+struct snapshot_record {
+	uint64_t offset;
+	uint64_t bytes;
+	uint32_t width, height;
+	uint32_t layout;
+	uint32_t flags;
+	uint32_t generation;
+	uint32_t reserved;
+};
+
+const char * snapshot_path = NULL;
+int snapshot_fd = -1;            // Snapshot the images were restored from
+uint64_t snapshot_period_ns = 0; // 0 if only saved at disconnect
+volatile uint8_t checkpointer_done = 0;
+uint64_t snapshot_count = 0;     // Snapshots saved so far
+uint64_t snapshot_lsn = 0;       // Last log record in the restored snapshot
+
+/* Operation log, enabled with -j. Registrations, with their pixels,
+ * and operations that produce new content are appended to it, and
+ * only acknowledged once they are on disk. A logging thread writes
+ * out all the records queued since its last write with a single
+ * fdatasync() (group commit) and then sends their responses, so that
+ * no thread waits for the disk. It is woken up once LOG_BATCH_RECORDS
+ * records are queued, or earlier by log_kick() when a thread is about
+ * to wait for something that may need them acknowledged, and never
+ * leaves a record waiting more than LOG_FLUSH_DELAY_NS. Images are
+ * only sent once the record of their version is on disk, see
+ * log_wait(). At startup, the records that are not in the snapshot
+ * yet are replayed on top of it.
+ *
+ * Records are numbered by a log sequence number (LSN). A snapshot
+ * holds the effect of every record up to the LSN in its header, and
+ * of none after it: changes are applied and logged while holding
+ * log_cut for reading, and snapshots pin the images while holding it
+ * for writing. Taking a snapshot also moves the log aside to
+ * <log file>.old, which is removed once the snapshot is saved. */
+struct log_record {
+	uint64_t lsn;
+	uint64_t check;        // Checksum of the rest of the record and its payload
+	uint64_t src_id;       // Image operated on, unused for IMG_REGISTER
+	uint64_t dst_id;       // Image that got the result
+	uint64_t bytes;        // Size of the payload following the record
+	uint8_t  opcode;
+	uint8_t  reserved[7];
+};
+
+/* Response to send once a record is on disk */
+struct log_ack {
+	int socket;
+	struct response resp;
+};
+
+/* Records queued for the next write */
+struct log_batch {
+	char * data;
+	uint64_t bytes, size;
+	struct log_ack * acks;
+	uint64_t count, slots;
+	uint64_t last_lsn;
+	uint64_t first_ns;          // When the first record was queued, see now_ns()
+};
+
+const char * log_path = NULL;
+int log_fd = -1;
+uint64_t log_end = 0;            // Size of the log file
+uint64_t log_lsn = 0;            // Last LSN handed out
+uint64_t log_durable = 0;        // Last LSN on disk
+pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;  // Records got on disk
+pthread_cond_t log_work;         // Records to write out, on CLOCK_MONOTONIC
+pthread_rwlock_t log_cut;
+struct log_batch log_batches[2]; // New records go to log_batches[log_active]
+uint32_t log_active = 0;
+uint8_t log_kicked = 0;          // Write out the next batch even if not full
+uint8_t logger_done = 0;
+uint64_t log_commits = 0;
+uint64_t log_replayed = 0;
+
+/* Current CLOCK_MONOTONIC time in nanoseconds */
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NANO_IN_SEC + ts.tv_nsec;
+}
+
+// Memory layout of registered images, selected with -l
+enum img_layout image_layout = IMG_PACKED;
+
+// Directory of images registered at startup, set with -I
+const char * preload_dir = NULL;
+
+// Resolved directory clients may name files in with
+// IMG_REGISTER_PATH, set with -R. Such requests are refused without it.
+char * register_dir = NULL;
+
+// Filters to run on a BMP file instead of serving, set with -F
+char * filter_ops = NULL;
+
+/* Rows of a BMP file filtered with -F are read in strips this large */
+#define FILTER_STRIP_BYTES (4 << 20)
+
+/* Images at least this large are split across idle workers' cores */
+#define PAR_MIN_PIXELS (1024 * 1024)
+
+// Number of workers currently processing a request
+uint32_t busy_workers = 0;
+
 struct request_meta {
 	struct request request;
+	struct pipeline pipeline;   // Only valid for IMG_PIPELINE requests
+	uint64_t ticket;            // Turn on its image, see next_op
 	struct timespec receipt_timestamp;
 	struct timespec start_timestamp;
 	struct timespec completion_timestamp;
@@ -131,6 +388,7 @@ struct connection_params {
 	size_t queue_size;
 	size_t workers;
 	enum queue_policy queue_policy;
+	char * event_name;
 };
 
 struct worker_params {
@@ -138,6 +396,8 @@ struct worker_params {
 	int worker_done;
 	struct queue * the_queue;
 	int worker_id;
+	size_t workers;
+	char * event_name;
 };
 
 enum worker_command {
@@ -186,97 +446,2118 @@ int add_to_queue(struct request_meta to_add, struct queue * the_queue)
 	return retval;
 }
 
-/* Add a new request <request> to the shared queue <the_queue> */
-struct request_meta get_from_queue(struct queue * the_queue)
+/* Add a new request <request> to the shared queue <the_queue> */
+struct request_meta get_from_queue(struct queue * the_queue)
+{
+	struct request_meta retval;
+	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
+	sem_wait(queue_notify);
+	sem_wait(queue_mutex);
+	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+
+	/* WRITE YOUR CODE HERE! */
+	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
+	retval = the_queue->requests[the_queue->rd_pos];
+	the_queue->rd_pos = (the_queue->rd_pos + 1) % the_queue->max_size;
+	the_queue->available++;
+
+	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
+	sem_post(queue_mutex);
+	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
+	return retval;
+}
+
+void dump_queue_status(struct queue * the_queue)
+{
+	size_t i, j;
+	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
+	sem_wait(queue_mutex);
+	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+
+	/* WRITE YOUR CODE HERE! */
+	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
+	sem_wait(printf_mutex);
+	printf("Q:[");
+
+	for (i = the_queue->rd_pos, j = 0; j < the_queue->max_size - the_queue->available;
+	     i = (i + 1) % the_queue->max_size, ++j)
+	{
+		printf("R%ld%s", the_queue->requests[i].request.req_id,
+		       ((j+1 != the_queue->max_size - the_queue->available)?",":""));
+	}
+
+	printf("]\n");
+	sem_post(printf_mutex);
+	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
+	sem_post(queue_mutex);
+	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
+}
+
+/* Content index used with -d: every distinct image registered so far,
+ * by the hash of its payload. The index holds a reference to each
+ * image, and new registrations with the same content share it. Each
+ * entry counts the images in the table holding its content, and is
+ * dropped along with its reference once there are none left. */
+struct content_entry {
+	uint64_t hash;
+	struct image * img;
+	uint64_t version;
+	uint64_t holders;           // Image entries holding the content
+	struct content_entry * next;
+};
+
+#define CONTENT_MIN_BUCKETS 1024
+
+uint8_t dedup_images = 0;
+sem_t content_sem;
+struct content_entry ** content_buckets = NULL;
+uint64_t content_nbuckets = 0;
+uint64_t content_count = 0;
+uint64_t content_hits = 0;
+
+/* Return the index entry of a registered image with the same content
+ * as <img>, whose payload hashes to <hash>, with the caller counted as
+ * one of its holders. Returns NULL if there is none. */
+struct content_entry * content_find(const struct image * img, uint64_t hash)
+{
+	struct content_entry * ce;
+
+	sem_wait(&content_sem);
+	for (ce = content_nbuckets ? content_buckets[hash & (content_nbuckets - 1)] : NULL;
+	     ce; ce = ce->next) {
+		if (ce->hash == hash && imagesEqual(ce->img, img)) {
+			ce->holders++;
+			content_hits++;
+			break;
+		}
+	}
+	sem_post(&content_sem);
+
+	return ce;
+}
+
+/* Add <img>, whose payload hashes to <hash>, to the content index, and
+ * return its entry with the caller counted as its holder. Returns NULL
+ * if it could not be added. */
+struct content_entry * content_add(struct image * img, uint64_t hash, uint64_t version)
+{
+	struct content_entry * ce = (struct content_entry *)malloc(sizeof(struct content_entry));
+
+	if (!ce) {
+		return NULL;
+	}
+	ce->hash = hash;
+	ce->img = shareImage(img);
+	ce->version = version;
+	ce->holders = 1;
+
+	sem_wait(&content_sem);
+
+	/* Keep at most one entry per bucket on average */
+	if (content_count >= content_nbuckets) {
+		uint64_t nbuckets = content_nbuckets ? 2 * content_nbuckets : CONTENT_MIN_BUCKETS;
+		struct content_entry ** buckets =
+			(struct content_entry **)calloc(nbuckets, sizeof(struct content_entry *));
+
+		if (buckets) {
+			for (uint64_t i = 0; i < content_nbuckets; i++) {
+				while (content_buckets[i]) {
+					struct content_entry * moved = content_buckets[i];
+					content_buckets[i] = moved->next;
+					moved->next = buckets[moved->hash & (nbuckets - 1)];
+					buckets[moved->hash & (nbuckets - 1)] = moved;
+				}
+			}
+			free(content_buckets);
+			content_buckets = buckets;
+			content_nbuckets = nbuckets;
+		}
+	}
+
+	if (content_nbuckets) {
+		ce->next = content_buckets[hash & (content_nbuckets - 1)];
+		content_buckets[hash & (content_nbuckets - 1)] = ce;
+		content_count++;
+		sem_post(&content_sem);
+		return ce;
+	}
+
+	sem_post(&content_sem);
+
+	deleteImage(ce->img);
+	free(ce);
+	return NULL;
+}
+
+/* Count one more holder of <ce>, e.g. a clone of an image holding it */
+void content_hold(struct content_entry * ce)
+{
+	sem_wait(&content_sem);
+	ce->holders++;
+	sem_post(&content_sem);
+}
+
+/* Stop counting the caller as a holder of <ce>, and drop it from the
+ * content index if it was the last one */
+void content_release(struct content_entry * ce)
+{
+	struct content_entry ** pce;
+
+	sem_wait(&content_sem);
+	if (--ce->holders) {
+		sem_post(&content_sem);
+		return;
+	}
+	for (pce = &content_buckets[ce->hash & (content_nbuckets - 1)]; *pce != ce;
+	     pce = &(*pce)->next) {
+	}
+	*pce = ce->next;
+	content_count--;
+	sem_post(&content_sem);
+
+	deleteImage(ce->img);
+	free(ce);
+}
+
+/* Result cache used with -c: the output of recent operations, by
+ * content version of their input and opcode. Versions are never
+ * reused, so overwriting an image is enough to stop its old results
+ * from being found, and they age out of the LRU list. The cache holds
+ * a reference to each result, which is shared with the images using
+ * it. */
+struct result_entry {
+	uint64_t version;                     /* Version of the input */
+	uint8_t opcode;
+	struct image * img;
+	uint64_t result_version;              /* Version of img */
+	uint64_t bytes;
+	struct result_entry * hnext;          /* Next in the hash bucket */
+	struct result_entry * prev, * next;   /* LRU list, most recent first */
+};
+
+#define RESULT_BUCKETS 4096
+
+uint64_t result_cache_limit = 0;          /* In bytes, 0 if disabled */
+sem_t result_sem;
+struct result_entry * result_buckets[RESULT_BUCKETS];
+struct result_entry * result_lru_head = NULL, * result_lru_tail = NULL;
+uint64_t result_bytes = 0;
+uint64_t result_count = 0;
+uint64_t result_hits = 0;
+uint64_t result_misses = 0;
+
+/* Return a new content version */
+static inline uint64_t next_version(void)
+{
+	return __atomic_add_fetch(&image_version, 1, __ATOMIC_RELAXED);
+}
+
+static inline struct result_entry ** result_bucket(uint64_t version, uint8_t opcode)
+{
+	uint64_t h = (version * 0x9E3779B97F4A7C15ULL) ^ opcode;
+	return &result_buckets[(h >> 32) & (RESULT_BUCKETS - 1)];
+}
+
+/* Unlink <re> from the hash bucket <bucket> and from the LRU list */
+static void result_unlink(struct result_entry ** bucket, struct result_entry * re)
+{
+	while (*bucket != re) {
+		bucket = &(*bucket)->hnext;
+	}
+	*bucket = re->hnext;
+
+	if (re->prev) {
+		re->prev->next = re->next;
+	} else {
+		result_lru_head = re->next;
+	}
+	if (re->next) {
+		re->next->prev = re->prev;
+	} else {
+		result_lru_tail = re->prev;
+	}
+}
+
+static void result_push_front(struct result_entry * re)
+{
+	re->prev = NULL;
+	re->next = result_lru_head;
+	if (result_lru_head) {
+		result_lru_head->prev = re;
+	} else {
+		result_lru_tail = re;
+	}
+	result_lru_head = re;
+}
+
+/* Return a new reference to the cached result of <opcode> applied to
+ * content version <version>, and its own version in <result_version>.
+ * Returns NULL on a miss, which is only counted if <count_miss>. */
+struct image * result_find(uint64_t version, uint8_t opcode, uint64_t * result_version,
+			   uint8_t count_miss)
+{
+	struct result_entry ** bucket = result_bucket(version, opcode);
+	struct image * found = NULL;
+	struct result_entry * re;
+
+	sem_wait(&result_sem);
+	for (re = *bucket; re; re = re->hnext) {
+		if (re->version == version && re->opcode == opcode) {
+			/* Move it to the front of the LRU list */
+			result_unlink(bucket, re);
+			re->hnext = *bucket;
+			*bucket = re;
+			result_push_front(re);
+
+			found = shareImage(re->img);
+			*result_version = re->result_version;
+			result_hits++;
+			break;
+		}
+	}
+	if (!found && count_miss) {
+		result_misses++;
+	}
+	sem_post(&result_sem);
+
+	return found;
+}
+
+/* Cache <img>, with version <result_version>, as the result of
+ * <opcode> applied to content version <version>, evicting the least
+ * recently used results to stay within the cache limit. */
+void result_add(uint64_t version, uint8_t opcode, struct image * img,
+		uint64_t result_version)
+{
+	struct result_entry ** bucket = result_bucket(version, opcode);
+	struct result_entry * re;
+	uint64_t bytes = imageBytes(img);
+
+	if (bytes > result_cache_limit) {
+		return;
+	}
+
+	re = (struct result_entry *)malloc(sizeof(struct result_entry));
+	if (!re) {
+		return;
+	}
+	re->version = version;
+	re->opcode = opcode;
+	re->img = shareImage(img);
+	re->result_version = result_version;
+	re->bytes = bytes;
+
+	sem_wait(&result_sem);
+
+	while (result_bytes + bytes > result_cache_limit) {
+		struct result_entry * victim = result_lru_tail;
+
+		result_unlink(result_bucket(victim->version, victim->opcode), victim);
+		result_bytes -= victim->bytes;
+		result_count--;
+		deleteImage(victim->img);
+		free(victim);
+	}
+
+	re->hnext = *bucket;
+	*bucket = re;
+	result_push_front(re);
+	result_bytes += bytes;
+	result_count++;
+
+	sem_post(&result_sem);
+}
+
+/* Find the segment and the offset in it of the entry in <slot> */
+static inline void image_slot(uint64_t slot, uint32_t * seg, uint64_t * off)
+{
+	uint64_t q = slot / IMAGE_SEGMENT_BASE + 1;
+
+	*seg = 63 - __builtin_clzll(q);
+	*off = slot - IMAGE_SEGMENT_BASE * ((1ULL << *seg) - 1);
+}
+
+/* Return the entry in <slot>, or NULL if it was never set up. Safe to
+ * call without holding any lock. */
+struct image_entry * image_entry_at(uint64_t slot)
+{
+	struct image_entry * segment;
+	uint32_t seg;
+	uint64_t off;
+
+	image_slot(slot, &seg, &off);
+	if (seg >= IMAGE_SEGMENTS) {
+		return NULL;
+	}
+
+	segment = __atomic_load_n(&image_segments[seg], __ATOMIC_ACQUIRE);
+	if (!segment || !__atomic_load_n(&segment[off].ready, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	return &segment[off];
+}
+
+/* Return the entry of image <id>, or NULL if no such image has been
+ * registered, or if it was deleted. Safe to call without holding any
+ * lock. */
+struct image_entry * image_entry_get(uint64_t id)
+{
+	struct image_entry * entry = image_entry_at(IMAGE_ID_SLOT(id));
+
+	if (!entry || !__atomic_load_n(&entry->live, __ATOMIC_ACQUIRE)
+	    || (entry->generation & IMAGE_GEN_MASK) != IMAGE_ID_GEN(id)) {
+		return NULL;
+	}
+
+	return entry;
+}
+
+/* Space taken in the spill file by an image of <bytes> bytes */
+static inline uint64_t spill_size(uint64_t bytes)
+{
+	return (bytes + spill_page - 1) & ~(spill_page - 1);
+}
+
+/* Forget the copy on disk of <old>, the previous version of <entry>.
+ * Its space is only given back if <old>, about to be dropped, is the
+ * only mapping of it that may still be read. Called with img_sem
+ * held. */
+static void spill_discard(struct image_entry * entry, struct image * old)
+{
+	uint8_t unmapped = !entry->spill.maps
+		|| (entry->spill.maps == 1 && old && old != entry->img && old->mapped
+		    && !isImageShared(old));
+
+	/* Snapshots are left alone */
+	if (entry->spill.bytes && entry->spill.fd == spill_fd && unmapped) {
+		fallocate(spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  entry->spill.offset, spill_size(entry->spill.bytes));
+	}
+	entry->spill.bytes = 0;
+}
+
+/* Write out the image of <entry>, unless this version is already on
+ * disk, and drop it from memory. Called with img_sem held. Returns
+ * the number of bytes released. */
+static uint64_t spill_entry(struct image_entry * entry)
+{
+	struct image * img = entry->img;
+	uint64_t bytes = imageBytes(img);
+
+	if (!entry->spill.bytes) {
+		uint64_t offset = __atomic_fetch_add(&spill_end, spill_size(bytes),
+						     __ATOMIC_RELAXED);
+
+		if (storeImage(img, spill_fd, offset)) {
+			ERROR_INFO();
+			perror("Unable to spill image");
+			return 0;
+		}
+		entry->spill.fd = spill_fd;
+		entry->spill.maps = 0;
+		entry->spill.offset = offset;
+		entry->spill.bytes = bytes;
+		entry->spill.width = img->width;
+		entry->spill.height = img->height;
+		entry->spill.layout = img->layout;
+	}
+
+	entry->img = NULL;
+	deleteImage(img);
+	spill_count++;
+
+	return bytes;
+}
+
+/* Map the spilled image of <entry> back, reading it ahead if
+ * <prefetch> is set. Called with img_sem held. */
+static void fault_entry(struct image_entry * entry, uint8_t prefetch)
+{
+	entry->spill.maps++;
+	entry->img = mapImage(entry->spill.fd, entry->spill.offset, entry->spill.width,
+			      entry->spill.height, entry->spill.layout, prefetch);
+	if (!entry->img) {
+		ERROR_INFO();
+		perror("Unable to map spilled image");
+		exit(EXIT_FAILURE);
+	}
+
+	__atomic_add_fetch(&store_bytes, entry->spill.bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&fault_count, 1, __ATOMIC_RELAXED);
+}
+
+/* Uncompressed size of the image in <blob> */
+static inline uint64_t blob_raw_bytes(const struct image_blob * blob)
+{
+	return (uint64_t)blob->width * blob->height
+		* (blob->layout == IMG_PLANAR ? IMG_PLANES : sizeof(uint32_t));
+}
+
+/* Free the compressed image of <entry>, if any, and return the number
+ * of bytes it took. Called with img_sem held. */
+static uint64_t image_entry_drop_blob(struct image_entry * entry)
+{
+	uint64_t bytes = 0;
+
+	if (entry->blob) {
+		bytes = entry->blob->bytes;
+		__atomic_sub_fetch(&compact_raw, blob_raw_bytes(entry->blob), __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&compact_bytes, bytes, __ATOMIC_RELAXED);
+		free(entry->blob);
+		entry->blob = NULL;
+	}
+
+	return bytes;
+}
+
+/* Bring the image of <entry> back in memory if it was compressed or
+ * spilled, reading spilled images ahead if <prefetch> is set. Called
+ * with img_sem held. */
+static void image_entry_restore(struct image_entry * entry, uint8_t prefetch)
+{
+	if (entry->img) {
+		return;
+	}
+
+	if (entry->blob) {
+		entry->img = decompressImage(entry->blob);
+		if (!entry->img) {
+			ERROR_INFO();
+			perror("Unable to decompress image");
+			exit(EXIT_FAILURE);
+		}
+		__atomic_add_fetch(&store_bytes, imageBytes(entry->img), __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&store_bytes, image_entry_drop_blob(entry), __ATOMIC_RELAXED);
+		__atomic_add_fetch(&expand_count, 1, __ATOMIC_RELAXED);
+	} else if (entry->spill.bytes) {
+		fault_entry(entry, prefetch);
+	}
+}
+
+/* Spill cold images until the image table fits in its budget. Images
+ * with requests queued or running are left alone, as are entries
+ * that are busy, rather than waiting for them. */
+void store_sweep(void)
+{
+	uint64_t scanned = 0, limit;
+
+	if (!store_budget || __atomic_load_n(&store_bytes, __ATOMIC_RELAXED) <= store_budget) {
+		return;
+	}
+
+	sem_wait(&store_sem);
+
+	/* Two full turns: one to clear the reference bits, and one to
+	 * spill the images that were not used in between */
+	limit = 2 * __atomic_load_n(&image_count, __ATOMIC_RELAXED);
+	while (__atomic_load_n(&store_bytes, __ATOMIC_RELAXED) > store_budget
+	       && scanned++ < limit) {
+		struct image_entry * entry;
+
+		if (store_hand >= __atomic_load_n(&image_count, __ATOMIC_RELAXED)) {
+			store_hand = 0;
+		}
+		entry = image_entry_at(store_hand++);
+		if (!entry || sem_trywait(&entry->img_sem) != 0) {
+			continue;
+		}
+
+		if (entry->img && !__atomic_load_n(&entry->pending, __ATOMIC_ACQUIRE)
+		    && imageBytes(entry->img)) {
+			if (entry->referenced) {
+				entry->referenced = 0;
+			} else {
+				__atomic_sub_fetch(&store_bytes, spill_entry(entry), __ATOMIC_RELAXED);
+			}
+		}
+
+		sem_post(&entry->img_sem);
+	}
+
+	sem_post(&store_sem);
+}
+
+/* Get the image of <entry>, which has a request queued, back in
+ * memory if needed, so that it is restored while the request waits */
+void store_prefetch(struct image_entry * entry)
+{
+	sem_wait(&entry->img_sem);
+	image_entry_restore(entry, 1);
+	sem_post(&entry->img_sem);
+
+	store_sweep();
+}
+
+/* Compress the images that have been idle for long enough. Images
+ * are compressed without holding their entry's lock, and only swapped
+ * in if nothing used the entry in the meantime. */
+void compact_sweep(void)
+{
+	uint64_t id, count = __atomic_load_n(&image_count, __ATOMIC_RELAXED);
+
+	for (id = 0; id < count && !compactor_done; id++) {
+		struct image_entry * entry = image_entry_at(id);
+		struct image_blob * blob;
+		struct image * img;
+		uint64_t last_use;
+
+		if (!entry || sem_trywait(&entry->img_sem) != 0) {
+			continue;
+		}
+
+		/* Shared images would stay in memory anyway */
+		img = entry->img;
+		last_use = entry->last_use;
+		if (!img || img->mapped || isImageShared(img)
+		    || __atomic_load_n(&entry->pending, __ATOMIC_ACQUIRE)
+		    || now_ns() - last_use < compact_idle_ns) {
+			sem_post(&entry->img_sem);
+			continue;
+		}
+
+		/* Hold on to it while it is being compressed */
+		img = shareImage(img);
+		sem_post(&entry->img_sem);
+
+		blob = compressImage(img);
+
+		sem_wait(&entry->img_sem);
+		if (blob && blob->bytes < imageBytes(img) && entry->img == img
+		    && entry->last_use == last_use
+		    && !__atomic_load_n(&entry->pending, __ATOMIC_ACQUIRE)) {
+			entry->img = NULL;
+			entry->blob = blob;
+			__atomic_sub_fetch(&store_bytes, imageBytes(img) - blob->bytes,
+					   __ATOMIC_RELAXED);
+			__atomic_add_fetch(&compact_raw, imageBytes(img), __ATOMIC_RELAXED);
+			__atomic_add_fetch(&compact_bytes, blob->bytes, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&compact_count, 1, __ATOMIC_RELAXED);
+			blob = NULL;
+
+			/* Drop the entry's reference */
+			deleteImage(img);
+		}
+		sem_post(&entry->img_sem);
+
+		free(blob);
+		deleteImage(img);
+	}
+}
+
+/* Main logic of the compactor thread */
+void * compactor_main(void * arg)
+{
+	(void)arg;
+
+	/* Check for idle images a few times per idle period */
+	uint64_t period = compact_idle_ns / 4;
+	if (period > NANO_IN_SEC) {
+		period = NANO_IN_SEC;
+	}
+
+	while (!compactor_done) {
+		struct timespec delay = { period / NANO_IN_SEC, period % NANO_IN_SEC };
+
+		nanosleep(&delay, NULL);
+		compact_sweep();
+	}
+
+	return NULL;
+}
+
+/* Stop counting <entry>, which no longer holds the content it was
+ * registered with, as a holder of that content in the index */
+static void image_entry_unindex(struct image_entry * entry)
+{
+	if (entry->content) {
+		content_release(entry->content);
+		entry->content = NULL;
+	}
+}
+
+/* Make <img>, with content version <version>, the current version of
+ * <entry>. The previous one is freed once its last reader drops it. */
+void image_entry_publish(struct image_entry * entry, struct image * img, uint64_t version)
+{
+	struct image * old;
+	uint64_t old_bytes;
+
+	sem_wait(&entry->img_sem);
+	old = entry->img;
+	old_bytes = old ? imageBytes(old) : image_entry_drop_blob(entry);
+	entry->img = img;
+	entry->version = version;
+	entry->referenced = 1;
+	entry->last_use = now_ns();
+	spill_discard(entry, old);
+	sem_post(&entry->img_sem);
+
+	__atomic_add_fetch(&store_bytes, imageBytes(img) - old_bytes, __ATOMIC_RELAXED);
+	image_entry_unindex(entry);
+	deleteImage(old);
+
+	store_sweep();
+}
+
+/* Drop the image of <entry>. Requests queued before the deletion are
+ * done by now, and later ones were rejected: the slot can go back to
+ * the free list with image_free_push() once this request completes.
+ * The pixels themselves are freed once the last reader of the image
+ * drops it. */
+void image_entry_delete(struct image_entry * entry)
+{
+	struct image * old;
+	uint64_t old_bytes;
+
+	sem_wait(&entry->img_sem);
+	old = entry->img;
+	old_bytes = old ? imageBytes(old) : image_entry_drop_blob(entry);
+	entry->img = NULL;
+	spill_discard(entry, old);
+	entry->live = 0;
+	entry->generation++;
+	sem_post(&entry->img_sem);
+
+	__atomic_sub_fetch(&store_bytes, old_bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&delete_count, 1, __ATOMIC_RELAXED);
+	image_entry_unindex(entry);
+	deleteImage(old);
+}
+
+/* Set up a new entry at the end of the image table, and store its
+ * slot in <slot> */
+static struct image_entry * image_entry_alloc(uint64_t * slot)
+{
+	uint64_t id = __atomic_fetch_add(&image_count, 1, __ATOMIC_RELAXED);
+	struct image_entry * segment, * entry;
+	uint32_t seg;
+	uint64_t off;
+
+	image_slot(id, &seg, &off);
+	if (seg >= IMAGE_SEGMENTS || id >> IMAGE_SLOT_BITS) {
+		ERROR_INFO();
+		fprintf(stderr, "Image table full\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The first ID that lands in a segment allocates it. If several
+	 * race to do so, the first to publish it wins. */
+	segment = __atomic_load_n(&image_segments[seg], __ATOMIC_ACQUIRE);
+	if (!segment) {
+		struct image_entry * expected = NULL;
+
+		segment = (struct image_entry *)calloc((uint64_t)IMAGE_SEGMENT_BASE << seg,
+						       sizeof(struct image_entry));
+		if (!segment) {
+			ERROR_INFO();
+			perror("Unable to allocate image table segment");
+			exit(EXIT_FAILURE);
+		}
+
+		if (!__atomic_compare_exchange_n(&image_segments[seg], &expected, segment, 0,
+						 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			free(segment);
+			segment = expected;
+		}
+	}
+
+	entry = &segment[off];
+	if (sem_init(&entry->img_sem, 0, 1) != 0) {
+		perror("Failed to initialize semaphore for new image");
+		exit(EXIT_FAILURE);
+	}
+	entry->op_counter = 0;
+	entry->next_op = 0;
+	entry->generation = 0;
+	pthread_mutex_init(&entry->order_mutex, NULL);
+	pthread_cond_init(&entry->order_cond, NULL);
+
+	__atomic_store_n(&entry->ready, 1, __ATOMIC_RELEASE);
+
+	*slot = id;
+	return entry;
+}
+
+/* Take the slot of a deleted image, if any, into <slot>. Returns 1 if
+ * there was one, 0 otherwise. */
+static int image_free_pop(uint64_t * slot)
+{
+	int found = 0;
+
+	sem_wait(&free_sem);
+	if (free_count) {
+		*slot = free_slots[--free_count];
+		found = 1;
+	}
+	sem_post(&free_sem);
+
+	return found;
+}
+
+/* Make <slot> available to new images */
+static void image_free_push(uint64_t slot)
+{
+	sem_wait(&free_sem);
+	if (free_count == free_size) {
+		free_size = free_size ? 2 * free_size : IMAGE_SEGMENT_BASE;
+		free_slots = (uint64_t *)realloc(free_slots, free_size * sizeof(uint64_t));
+		if (!free_slots) {
+			ERROR_INFO();
+			perror("Unable to grow the free slot list");
+			exit(EXIT_FAILURE);
+		}
+	}
+	free_slots[free_count++] = slot;
+	sem_post(&free_sem);
+}
+
+/* Make the free <entry> hold <img>, with content version <version> */
+static void image_entry_init(struct image_entry * entry, struct image * img, uint64_t version)
+{
+	sem_wait(&entry->img_sem);
+	entry->img = img;
+	entry->version = version;
+	entry->pending = 0;
+	entry->lsn = 0;
+	entry->spill.bytes = 0;
+	entry->spill.maps = 0;
+	entry->blob = NULL;
+	entry->last_use = now_ns();
+	entry->content = NULL;
+	entry->referenced = 1;
+	__atomic_store_n(&entry->live, 1, __ATOMIC_RELEASE);
+	sem_post(&entry->img_sem);
+
+	if (img) {
+		__atomic_add_fetch(&store_bytes, imageBytes(img), __ATOMIC_RELAXED);
+		store_sweep();
+	}
+}
+
+/* Store <img>, with content version <version>, in a new entry of the
+ * image table, and return its ID */
+uint64_t image_entry_new(struct image * img, uint64_t version)
+{
+	struct image_entry * entry;
+	uint64_t slot;
+
+	/* Reuse the slot of a deleted image if there is one */
+	entry = image_free_pop(&slot) ? image_entry_at(slot) : image_entry_alloc(&slot);
+	image_entry_init(entry, img, version);
+
+	return IMAGE_ID(slot, entry->generation);
+}
+
+/* Whether <entry> was never given an image. This only happens to IDs
+ * of registrations lost in a crash, which stay that way. */
+static inline int image_entry_missing(struct image_entry * entry)
+{
+	return !entry->img && !entry->blob && !entry->spill.bytes;
+}
+
+/* Get a reference to the current image of <entry> without bringing
+ * it back in memory if it was compressed or spilled. Called with
+ * img_sem held. */
+static struct image * image_entry_pin(struct image_entry * entry)
+{
+	if (entry->img) {
+		return shareImage(entry->img);
+	} else if (entry->blob) {
+		return decompressImage(entry->blob);
+	} else if (entry->spill.bytes) {
+		entry->spill.maps++;
+		return mapImage(entry->spill.fd, entry->spill.offset, entry->spill.width,
+				entry->spill.height, entry->spill.layout, 0);
+	}
+
+	return NULL;
+}
+
+/* Fold <bytes> bytes at <data> into the checksum <hash> */
+static uint64_t log_hash(uint64_t hash, const void * data, uint64_t bytes)
+{
+	const uint8_t * p = (const uint8_t *)data;
+	uint64_t word;
+
+	for (; bytes >= sizeof(word); bytes -= sizeof(word), p += sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		hash = ((hash ^ word) * 0x9e3779b97f4a7c15ULL);
+		hash ^= hash >> 29;
+	}
+	for (; bytes; bytes--, p++) {
+		hash = (hash ^ *p) * 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* Checksum of <rec>, but for its LSN, and of its payload in <iov> */
+static uint64_t log_checksum(const struct log_record * rec, const struct iovec * iov, int iovcnt)
+{
+	uint64_t hash = log_hash(0xcbf29ce484222325ULL, &rec->src_id,
+				 sizeof(*rec) - offsetof(struct log_record, src_id));
+
+	for (int i = 0; i < iovcnt; i++) {
+		hash = log_hash(hash, iov[i].iov_base, iov[i].iov_len);
+	}
+
+	return hash;
+}
+
+/* Make room for <bytes> more bytes and one more response in <batch> */
+static void log_batch_reserve(struct log_batch * batch, uint64_t bytes)
+{
+	if (batch->bytes + bytes > batch->size) {
+		batch->size = (batch->bytes + bytes) * 2;
+		batch->data = (char *)realloc(batch->data, batch->size);
+	}
+	if (batch->count == batch->slots) {
+		batch->slots = batch->slots ? 2 * batch->slots : 64;
+		batch->acks = (struct log_ack *)realloc(batch->acks,
+							batch->slots * sizeof(struct log_ack));
+	}
+	if (!batch->data || !batch->acks) {
+		ERROR_INFO();
+		perror("Unable to grow the operation log buffer");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Queue a record for <opcode> from image <src_id> to <dst_id>, with
+ * the payload in <iov>, and return its LSN. <resp> is sent on
+ * <socket> once the record is on disk, unless <socket> is -1. Called
+ * with log_cut held for reading. */
+uint64_t log_append(uint8_t opcode, uint64_t src_id, uint64_t dst_id,
+		const struct iovec * iov, int iovcnt, int socket, const struct response * resp)
+{
+	struct log_record rec;
+	struct log_batch * batch;
+	uint64_t bytes = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		bytes += iov[i].iov_len;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.src_id = src_id;
+	rec.dst_id = dst_id;
+	rec.bytes = bytes;
+	rec.opcode = opcode;
+	rec.check = log_checksum(&rec, iov, iovcnt);
+
+	pthread_mutex_lock(&log_mutex);
+	batch = &log_batches[log_active];
+	log_batch_reserve(batch, sizeof(rec) + bytes);
+
+	rec.lsn = ++log_lsn;
+	if (!batch->count) {
+		batch->first_ns = now_ns();
+	}
+	memcpy(batch->data + batch->bytes, &rec, sizeof(rec));
+	batch->bytes += sizeof(rec);
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(batch->data + batch->bytes, iov[i].iov_base, iov[i].iov_len);
+		batch->bytes += iov[i].iov_len;
+	}
+	batch->acks[batch->count].socket = socket;
+	batch->acks[batch->count].resp = *resp;
+	batch->count++;
+	batch->last_lsn = rec.lsn;
+
+	if (batch->count >= LOG_BATCH_RECORDS) {
+		pthread_cond_signal(&log_work);
+	}
+	pthread_mutex_unlock(&log_mutex);
+
+	return rec.lsn;
+}
+
+/* Have the records queued so far written out without waiting for a
+ * full batch. Called with log_mutex held. */
+static void log_kick_locked(void)
+{
+	if (log_batches[log_active].bytes && !log_kicked) {
+		log_kicked = 1;
+		pthread_cond_signal(&log_work);
+	}
+}
+
+/* Same as log_kick_locked(), for callers not holding log_mutex */
+void log_kick(void)
+{
+	pthread_mutex_lock(&log_mutex);
+	log_kick_locked();
+	pthread_mutex_unlock(&log_mutex);
+}
+
+/* Log the operation in <req>, whose result went to image <dst_id>,
+ * and return the LSN of the record */
+uint64_t log_operation(struct request_meta * req, uint64_t dst_id, int socket,
+		       const struct response * resp)
+{
+	struct iovec iov = { &req->pipeline, sizeof(req->pipeline) };
+
+	return log_append(req->request.img_op, req->request.img_id, dst_id, &iov,
+		   req->request.img_op == IMG_PIPELINE, socket, resp);
+}
+
+/* Main logic of the logging thread */
+void * logger_main(void * arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&log_mutex);
+	for (;;) {
+		struct log_batch * batch = &log_batches[log_active];
+		const char * bufptr = batch->data;
+		uint64_t to_write = batch->bytes;
+		int fd = log_fd;
+
+		if (!batch->bytes && logger_done) {
+			break;
+		}
+		if (!batch->bytes) {
+			pthread_cond_wait(&log_work, &log_mutex);
+			continue;
+		}
+
+		/* A partial batch waits for more records, but only
+		 * for so long */
+		if (batch->count < LOG_BATCH_RECORDS && !log_kicked && !logger_done
+		    && now_ns() < batch->first_ns + LOG_FLUSH_DELAY_NS) {
+			uint64_t deadline = batch->first_ns + LOG_FLUSH_DELAY_NS;
+			struct timespec ts = { deadline / NANO_IN_SEC, deadline % NANO_IN_SEC };
+
+			pthread_cond_timedwait(&log_work, &log_mutex, &ts);
+			continue;
+		}
+
+		/* New records go to the other batch while this one
+		 * is written out */
+		log_kicked = 0;
+		log_active ^= 1;
+		pthread_mutex_unlock(&log_mutex);
+
+		while (to_write) {
+			ssize_t cur = pwrite(fd, bufptr, to_write, log_end);
+			if (cur <= 0) {
+				ERROR_INFO();
+				perror("Unable to write operation log");
+				exit(EXIT_FAILURE);
+			}
+			bufptr += cur;
+			log_end += cur;
+			to_write -= cur;
+		}
+		if (fdatasync(fd) != 0) {
+			ERROR_INFO();
+			perror("Unable to sync operation log");
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_mutex_lock(&log_mutex);
+		log_durable = batch->last_lsn;
+		log_commits++;
+		pthread_cond_broadcast(&log_cond);
+		pthread_mutex_unlock(&log_mutex);
+
+		/* The records are safe: acknowledge them */
+		sem_wait(&socket_sem);
+		for (uint64_t i = 0; i < batch->count; i++) {
+			if (batch->acks[i].socket != -1) {
+				send(batch->acks[i].socket, &batch->acks[i].resp,
+				     sizeof(struct response), 0);
+			}
+		}
+		sem_post(&socket_sem);
+
+		batch->bytes = 0;
+		batch->count = 0;
+		pthread_mutex_lock(&log_mutex);
+	}
+	pthread_mutex_unlock(&log_mutex);
+
+	return NULL;
+}
+
+/* Wait until the record <lsn> and all those before it are on disk */
+void log_wait(uint64_t lsn)
+{
+	pthread_mutex_lock(&log_mutex);
+	if (log_durable < lsn) {
+		log_kick_locked();
+	}
+	while (log_durable < lsn) {
+		pthread_cond_wait(&log_cond, &log_mutex);
+	}
+	pthread_mutex_unlock(&log_mutex);
+}
+
+/* Wait until every record queued so far is on disk, and return the
+ * LSN of the last one */
+uint64_t log_flush(void)
+{
+	uint64_t lsn;
+
+	pthread_mutex_lock(&log_mutex);
+	lsn = log_lsn;
+	pthread_mutex_unlock(&log_mutex);
+	log_wait(lsn);
+
+	return lsn;
+}
+
+/* Path of the log moved aside by the last snapshot. The caller frees
+ * it. */
+static char * log_old_path(void)
+{
+	char * path;
+
+	if (asprintf(&path, "%s.old", log_path) < 0) {
+		ERROR_INFO();
+		perror("Unable to allocate log path");
+		exit(EXIT_FAILURE);
+	}
+
+	return path;
+}
+
+/* Move the log aside and start a new one. If the log moved aside by
+ * an earlier snapshot is still there, that snapshot was not saved,
+ * and the records of both logs stay in this one instead. Called with
+ * log_cut held for writing and the log flushed. */
+void log_rotate(void)
+{
+	char * old_path = log_old_path();
+	int fd;
+
+	if (access(old_path, F_OK) == 0 || rename(log_path, old_path) != 0) {
+		free(old_path);
+		return;
+	}
+	free(old_path);
+
+	fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		ERROR_INFO();
+		perror("Unable to create operation log");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_lock(&log_mutex);
+	close(log_fd);
+	log_fd = fd;
+	log_end = 0;
+	pthread_mutex_unlock(&log_mutex);
+}
+
+/* Remove the log moved aside by the last snapshot, once that is saved */
+void log_drop_old(void)
+{
+	char * old_path = log_old_path();
+
+	unlink(old_path);
+	free(old_path);
+}
+
+/* Image of an entry as captured by snapshot_save() */
+struct snapshot_pin {
+	struct image * img;
+	struct image_blob * blob;   // Copy of the blob of a compressed image
+	uint32_t generation;
+};
+
+/* Same as image_entry_pin(), except that a compressed image is not
+ * decompressed: <pin> gets a copy of its blob instead, which is much
+ * cheaper. Returns 0 on success and 1 if memory ran out. Called with
+ * img_sem held. */
+static int image_entry_capture(struct image_entry * entry, struct snapshot_pin * pin)
+{
+	pin->generation = entry->generation;
+	if (!entry->img && entry->blob) {
+		uint64_t bytes = sizeof(*entry->blob) + entry->blob->bytes;
+
+		pin->blob = (struct image_blob *)malloc(bytes);
+		if (!pin->blob) {
+			return 1;
+		}
+		memcpy(pin->blob, entry->blob, bytes);
+		return 0;
+	}
+
+	pin->img = image_entry_pin(entry);
+	return 0;
+}
+
+/* Save all the registered images to <snapshot_path>. The snapshot is
+ * written next to it and renamed over it once complete, so that the
+ * previous one stays valid until then, and images still mapped from
+ * it are not affected. Returns 0 on success and 1 on error. */
+int snapshot_save(void)
+{
+	struct snapshot_header header = { SNAPSHOT_MAGIC, 0, spill_page, 0 };
+	struct snapshot_record * records = NULL;
+	struct snapshot_pin * pins;
+	uint64_t id, count, index_bytes, offset;
+	char * tmp_path;
+	int fd, res = 1, failed = 0;
+
+	if (asprintf(&tmp_path, "%s.tmp", snapshot_path) < 0) {
+		return 1;
+	}
+
+	/* Pin the current version of every image. Nothing can be
+	 * logged meanwhile, so this is exactly the state after the
+	 * last record. Only references are taken here, and compressed
+	 * images are expanded later, so that logged operations are not
+	 * held up for long. */
+	if (log_path) {
+		pthread_rwlock_wrlock(&log_cut);
+		header.lsn = log_flush();
+		log_rotate();
+	}
+
+	count = __atomic_load_n(&image_count, __ATOMIC_RELAXED);
+	pins = (struct snapshot_pin *)calloc(count ? count : 1, sizeof(*pins));
+	for (id = 0; pins && !failed && id < count; id++) {
+		struct image_entry * entry;
+
+		/* Slots are handed out just before their entry is set up */
+		while (!(entry = image_entry_at(id))) {
+			sched_yield();
+		}
+
+		sem_wait(&entry->img_sem);
+		/* Images with a deletion queued are kept, as the
+		 * deletion is logged after the cut */
+		failed = image_entry_capture(entry, &pins[id]);
+		sem_post(&entry->img_sem);
+	}
+
+	if (log_path) {
+		pthread_rwlock_unlock(&log_cut);
+	}
+
+	header.count = count;
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	records = (struct snapshot_record *)calloc(count ? count : 1, sizeof(*records));
+	if (fd == -1 || !records || !pins || failed) {
+		ERROR_INFO();
+		perror("Unable to create snapshot");
+		goto out;
+	}
+
+	index_bytes = sizeof(header) + count * sizeof(*records);
+	offset = spill_size(index_bytes);
+
+	for (id = 0; id < count; id++) {
+		struct image * img = pins[id].img;
+
+		/* Compressed images are expanded one at a time */
+		if (!img && pins[id].blob) {
+			img = pins[id].img = decompressImage(pins[id].blob);
+			free(pins[id].blob);
+			pins[id].blob = NULL;
+			if (!img) {
+				ERROR_INFO();
+				fprintf(stderr, "Unable to expand image %lu for snapshot\n", id);
+				goto out;
+			}
+		}
+
+		records[id].generation = pins[id].generation;
+		if (!img) {
+			records[id].flags = SNAPSHOT_HOLE;
+			continue;
+		}
+
+		records[id].offset = offset;
+		records[id].bytes = imageBytes(img);
+		records[id].width = img->width;
+		records[id].height = img->height;
+		records[id].layout = img->layout;
+
+		if (records[id].bytes && storeImage(img, fd, offset)) {
+			ERROR_INFO();
+			perror("Unable to write snapshot");
+			goto out;
+		}
+		offset += spill_size(records[id].bytes);
+		deleteImage(img);
+		pins[id].img = NULL;
+	}
+
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)
+	    || pwrite(fd, records, count * sizeof(*records), sizeof(header))
+	       != (ssize_t)(count * sizeof(*records))
+	    || fdatasync(fd) != 0
+	    || rename(tmp_path, snapshot_path) != 0) {
+		ERROR_INFO();
+		perror("Unable to write snapshot");
+		goto out;
+	}
+
+	/* The log moved aside is all in the snapshot now */
+	if (log_path) {
+		log_drop_old();
+	}
+
+	snapshot_count++;
+	res = 0;
+
+out:
+	if (fd != -1) {
+		close(fd);
+		if (res) {
+			unlink(tmp_path);
+		}
+	}
+	for (id = 0; pins && id < count; id++) {
+		deleteImage(pins[id].img);
+		free(pins[id].blob);
+	}
+	free(pins);
+	free(records);
+	free(tmp_path);
+
+	return res;
+}
+
+/* Register the images saved in <snapshot_path>, if it exists, under
+ * the IDs they had. Only the index is read: the pixel data is mapped
+ * in on demand. Returns 0 on success and 1 on error. */
+int snapshot_restore(void)
+{
+	struct snapshot_header header;
+	struct snapshot_record * records;
+	struct stat st;
+	uint64_t i, slot, index_bytes;
+
+	snapshot_fd = open(snapshot_path, O_RDONLY);
+	if (snapshot_fd == -1) {
+		if (errno == ENOENT) {
+			printf("INFO: no snapshot at %s, starting empty\n", snapshot_path);
+			return 0;
+		}
+		ERROR_INFO();
+		perror("Unable to open snapshot");
+		return 1;
+	}
+
+	if (fstat(snapshot_fd, &st) != 0
+	    || (uint64_t)st.st_size < sizeof(header)
+	    || pread(snapshot_fd, &header, sizeof(header), 0) != sizeof(header)
+	    || header.magic != SNAPSHOT_MAGIC
+	    || header.page != spill_page
+	    || header.count > ((uint64_t)st.st_size - sizeof(header)) / sizeof(*records)) {
+		ERROR_INFO();
+		fprintf(stderr, "Invalid snapshot %s\n", snapshot_path);
+		return 1;
+	}
+
+	index_bytes = sizeof(header) + header.count * sizeof(*records);
+	records = (struct snapshot_record *)mmap(NULL, index_bytes, PROT_READ, MAP_PRIVATE,
+						 snapshot_fd, 0);
+	if (records == MAP_FAILED) {
+		ERROR_INFO();
+		perror("Unable to map snapshot");
+		return 1;
+	}
+	records = (struct snapshot_record *)((char *)records + sizeof(header));
+
+	for (i = 0; i < header.count; i++) {
+		struct snapshot_record * rec = &records[i];
+		struct image_entry * entry;
+
+		if (rec->offset % spill_page || rec->offset + rec->bytes > (uint64_t)st.st_size) {
+			ERROR_INFO();
+			fprintf(stderr, "Invalid record %lu in snapshot %s\n", i, snapshot_path);
+			return 1;
+		}
+
+		/* Every record gets the slot it had */
+		entry = image_entry_alloc(&slot);
+		entry->generation = rec->generation;
+
+		if (rec->flags & SNAPSHOT_HOLE) {
+			image_free_push(slot);
+			continue;
+		}
+
+		/* Empty images have nothing to map */
+		if (!rec->bytes) {
+			image_entry_init(entry, rec->layout == IMG_PLANAR
+					 ? createPlanarImageUninit(rec->width, rec->height)
+					 : createImageUninit(rec->width, rec->height),
+					 next_version());
+			continue;
+		}
+
+		image_entry_init(entry, NULL, next_version());
+		entry->spill.fd = snapshot_fd;
+		entry->spill.maps = 0;
+		entry->spill.offset = rec->offset;
+		entry->spill.bytes = rec->bytes;
+		entry->spill.width = rec->width;
+		entry->spill.height = rec->height;
+		entry->spill.layout = rec->layout;
+		entry->referenced = 0;
+	}
+
+	munmap((char *)records - sizeof(header), index_bytes);
+	snapshot_lsn = header.lsn;
+	printf("INFO: restored %lu images from %s\n", header.count, snapshot_path);
+
+	return 0;
+}
+
+/* Main logic of the checkpointer thread */
+void * checkpointer_main(void * arg)
+{
+	uint64_t last = now_ns();
+
+	(void)arg;
+
+	while (!checkpointer_done) {
+		struct timespec delay = { 0, 100 * 1000 * 1000 };
+
+		nanosleep(&delay, NULL);
+		if (now_ns() - last >= snapshot_period_ns) {
+			snapshot_save();
+			last = now_ns();
+		}
+	}
+
+	return NULL;
+}
+
+/* Register the packed image <received>, whose content hashes to
+ * <hash> if images are deduplicated, and return its ID. <resp> gets
+ * the ID and is sent on <conn_socket> once the image is safe, unless
+ * <conn_socket> is -1. */
+static uint64_t register_image(struct image * received, uint64_t hash, int conn_socket,
+			       struct response * resp)
+{
+	uint64_t img_id, version = 0;
+	struct image * new_img = NULL;
+	struct content_entry * content = NULL;
+
+	/* Share the copy of the same content registered earlier, if any */
+	if (received && dedup_images) {
+		content = content_find(received, hash);
+	}
+
+	if (content) {
+		new_img = shareImage(content->img);
+		version = content->version;
+	} else {
+		/* Images always arrive packed on the wire */
+		if (received) {
+			new_img = (image_layout == IMG_PLANAR) ? toPlanarImage(received, NULL)
+				: shareImage(received);
+		}
+		version = next_version();
+
+		if (new_img && dedup_images) {
+			content = content_add(new_img, hash, version);
+		}
+	}
+
+	/* Store it in the image table */
+	if (log_path) {
+		pthread_rwlock_rdlock(&log_cut);
+	}
+	img_id = image_entry_new(new_img, version);
+	resp->img_id = img_id;
+
+	/* Let the index drop the image once no entry holds it */
+	if (content) {
+		image_entry_get(img_id)->content = content;
+	}
+
+	/* The response is sent once the pixels are on disk */
+	if (log_path && received) {
+		uint32_t dims[2] = { received->width, received->height };
+		struct iovec iov[2] = { { dims, sizeof(dims) },
+					{ received->pixels, imageBytes(received) } };
+
+		image_entry_get(img_id)->lsn = log_append(IMG_REGISTER, 0, img_id, iov, 2,
+							  conn_socket, resp);
+		if (conn_socket != -1) {
+			log_kick();
+		}
+	} else if (conn_socket != -1) {
+		// Protect socket operations
+		sem_wait(&socket_sem);
+		send(conn_socket, resp, sizeof(struct response), 0);
+		sem_post(&socket_sem);
+	}
+	if (log_path) {
+		pthread_rwlock_unlock(&log_cut);
+	}
+
+	return img_id;
+}
+
+/* Read a new image from the socket, register it and return its ID */
+uint64_t register_new_image(int conn_socket, struct request * req)
+{
+	uint64_t img_id, hash = 0;
+
+	/* Read in the new image from socket */
+	struct image * received = recvImageHashed(conn_socket, dedup_images ? &hash : NULL);
+
+	/* Immediately provide a response to the client */
+	struct response resp;
+	resp.req_id = req->req_id;
+	resp.ack = RESP_COMPLETED;
+
+	img_id = register_image(received, hash, conn_socket, &resp);
+	deleteImage(received);
+
+	return img_id;
+}
+
+/* Whether the client on <conn_socket> runs on this host */
+static int peer_is_local(int conn_socket)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+
+	if (getpeername(conn_socket, (struct sockaddr *)&addr, &len) == -1) {
+		return 0;
+	}
+
+	switch (addr.ss_family) {
+	case AF_INET:
+		return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24) == 127;
+	case AF_INET6:
+	{
+		const struct in6_addr * in6 = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+		return IN6_IS_ADDR_LOOPBACK(in6)
+			|| (IN6_IS_ADDR_V4MAPPED(in6) && in6->s6_addr[12] == 127);
+	}
+	}
+
+	return 0;
+}
+
+/* Read and throw away <bytes> bytes from <conn_socket>. Returns 0 on
+ * success and 1 if the connection ended first. */
+static int recv_discard(int conn_socket, uint64_t bytes)
+{
+	char buf[4096];
+
+	while (bytes) {
+		ssize_t cur = recv(conn_socket, buf, (bytes < sizeof(buf)) ? bytes : sizeof(buf), 0);
+		if (cur <= 0) {
+			return 1;
+		}
+		bytes -= cur;
+	}
+
+	return 0;
+}
+
+/* Whether <path> names an existing file inside <register_dir>, once
+ * symbolic links and dot components are resolved. The resolved path
+ * is stored in <resolved>, of PATH_MAX bytes. */
+static int path_registrable(const char * path, char * resolved)
+{
+	size_t len;
+
+	if (!register_dir || !realpath(path, resolved)) {
+		return 0;
+	}
+
+	len = strlen(register_dir);
+	return !strncmp(resolved, register_dir, len)
+		&& (resolved[len] == '/' || register_dir[len - 1] == '/');
+}
+
+/* Read the path that follows an IMG_REGISTER_PATH request, load the
+ * BMP file there and register it. Returns 0 and the new ID in
+ * <img_id> on success. Returns 1 if the path was invalid, the client
+ * is not on this host, the file is outside <register_dir> or could
+ * not be loaded, in which case
+ * nothing was sent to the client yet. A path that can't be read in
+ * full leaves the rest of the stream unusable, so the socket is shut
+ * down for reading then. */
+int register_path_image(int conn_socket, struct request * req, uint64_t * img_id)
+{
+	struct image_path header;
+	struct response resp;
+	struct image * loaded;
+	char path[IMG_PATH_MAX + 1];
+	char resolved[PATH_MAX];
+	uint64_t hash = 0;
+
+	if (recv(conn_socket, &header, sizeof(header), MSG_WAITALL) != sizeof(header)) {
+		shutdown(conn_socket, SHUT_RD);
+		return 1;
+	}
+
+	/* Skip paths too long to open, to stay in step with the
+	 * requests that follow */
+	if (header.length == 0 || header.length > IMG_PATH_MAX) {
+		if (recv_discard(conn_socket, header.length)) {
+			shutdown(conn_socket, SHUT_RD);
+		}
+		return 1;
+	}
+
+	if (recv(conn_socket, path, header.length, MSG_WAITALL) != header.length) {
+		shutdown(conn_socket, SHUT_RD);
+		return 1;
+	}
+	path[header.length] = '\0';
+
+	/* The server opens the file with its own rights, so clients only
+	 * get to name files in the directory set aside for them */
+	if (!peer_is_local(conn_socket) || !path_registrable(path, resolved)) {
+		return 1;
+	}
+
+	/* The file is mapped and decoded in one pass, in place of the
+	 * pixels crossing the socket */
+	loaded = loadBMP(resolved);
+	if (!loaded) {
+		return 1;
+	}
+	if (dedup_images) {
+		hash = imageHash(loaded);
+	}
+
+	resp.req_id = req->req_id;
+	resp.ack = RESP_COMPLETED;
+
+	*img_id = register_image(loaded, hash, conn_socket, &resp);
+	deleteImage(loaded);
+
+	return 0;
+}
+
+/* BMP files loaded by the threads of preload_images(). Each thread
+ * takes the next file not claimed yet. */
+struct preload_job {
+	const char * dir;
+	struct dirent ** files;
+	struct image ** images;
+	uint64_t * hashes;
+	uint32_t count;
+	uint32_t next;
+};
+
+static int preload_filter(const struct dirent * file)
+{
+	size_t len = strlen(file->d_name);
+
+	return len > 4 && !strcasecmp(file->d_name + len - 4, ".bmp");
+}
+
+void * preload_main(void * arg)
+{
+	struct preload_job * job = (struct preload_job *)arg;
+	uint32_t i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/%s", job->dir, job->files[i]->d_name);
+		job->images[i] = loadBMP(path);
+		if (job->images[i] && dedup_images) {
+			job->hashes[i] = imageHash(job->images[i]);
+		}
+	}
+
+	return NULL;
+}
+
+/* Register every BMP file in <dir>, loaded by <nthreads> threads. IDs
+ * follow the order of the file names, so that the same directory
+ * always gets the same IDs. Returns 0 on success and 1 on error. */
+int preload_images(const char * dir, size_t nthreads)
+{
+	struct preload_job job;
+	struct response resp;
+	pthread_t * threads;
+	uint64_t start = now_ns(), loaded = 0;
+	size_t i, started = 0;
+	int count;
+
+	memset(&job, 0, sizeof(job));
+	count = scandir(dir, &job.files, preload_filter, alphasort);
+	if (count < 0) {
+		ERROR_INFO();
+		perror("Unable to read image directory");
+		return 1;
+	}
+
+	job.dir = dir;
+	job.count = count;
+	job.images = (struct image **)calloc(count + 1, sizeof(struct image *));
+	job.hashes = (uint64_t *)calloc(count + 1, sizeof(uint64_t));
+	if (nthreads > (size_t)count) {
+		nthreads = count ? count : 1;
+	}
+	threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+	if (!job.images || !job.hashes || !threads) {
+		ERROR_INFO();
+		perror("Unable to allocate memory to preload images");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The calling thread loads its share too */
+	for (i = 1; i < nthreads; i++, started++) {
+		if (pthread_create(&threads[i], NULL, preload_main, &job) != 0) {
+			break;
+		}
+	}
+	preload_main(&job);
+	for (i = 1; i <= started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	memset(&resp, 0, sizeof(resp));
+	resp.ack = RESP_COMPLETED;
+	for (i = 0; i < job.count; i++) {
+		if (!job.images[i]) {
+			printf("WARNING: unable to load image %s/%s\n", dir, job.files[i]->d_name);
+		} else {
+			uint64_t img_id = register_image(job.images[i], job.hashes[i], -1, &resp);
+
+			printf("INFO: preloaded %s as image %lu\n", job.files[i]->d_name, img_id);
+			deleteImage(job.images[i]);
+			loaded++;
+		}
+		free(job.files[i]);
+	}
+	printf("INFO: preloaded %lu images from %s in %.3f s\n", loaded, dir,
+	       (double)(now_ns() - start) / NANO_IN_SEC);
+
+	free(job.files);
+	free(job.images);
+	free(job.hashes);
+	free(threads);
+
+	return 0;
+}
+
+/* Map an image operation opcode to the equivalent pipeline stage.
+ * Returns IMG_STAGES if the operation cannot be part of a pipeline. */
+enum img_stage opcode_to_stage(uint8_t opcode)
+{
+	switch (opcode) {
+	case IMG_ROT90CLKW:  return IMG_STAGE_ROT90CLKW;
+	case IMG_BLUR:       return IMG_STAGE_BLUR;
+	case IMG_SHARPEN:    return IMG_STAGE_SHARPEN;
+	case IMG_VERTEDGES:  return IMG_STAGE_VERTEDGES;
+	case IMG_HORIZEDGES: return IMG_STAGE_HORIZEDGES;
+	case IMG_BLUR5:      return IMG_STAGE_BLUR5;
+	case IMG_BLUR9:      return IMG_STAGE_BLUR9;
+	case IMG_BLUR15:     return IMG_STAGE_BLUR15;
+	case IMG_GAUSS5:     return IMG_STAGE_GAUSS5;
+	case IMG_GAUSS7:     return IMG_STAGE_GAUSS7;
+	case IMG_LAPLACIAN:  return IMG_STAGE_LAPLACIAN;
+	case IMG_EDGEMAG:    return IMG_STAGE_EDGEMAG;
+	default:             return IMG_STAGES;
+	}
+}
+
+/* Whether results of <opcode> can be kept in the result cache: any
+ * single operation that builds a new image from its input alone.
+ * Rotations are cheaper to redo than to look up. */
+static inline int result_cacheable(uint8_t opcode)
+{
+	return opcode_to_stage(opcode) != IMG_STAGES && opcode != IMG_ROT90CLKW;
+}
+
+/* Read the list of operations that follows an IMG_PIPELINE request
+ * into <pipeline>. Returns 0 if the list is valid, 1 otherwise. */
+int recv_pipeline(int conn_socket, struct pipeline * pipeline)
+{
+	ssize_t in_bytes = recv(conn_socket, pipeline, sizeof(struct pipeline), MSG_WAITALL);
+
+	if (in_bytes != sizeof(struct pipeline) || pipeline->length == 0
+	    || pipeline->length > IMG_PIPELINE_MAX) {
+		return 1;
+	}
+
+	for (int i = 0; i < pipeline->length; ++i) {
+		if (opcode_to_stage(pipeline->ops[i]) == IMG_STAGES) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Stream the BMP file <in_path> through the comma-separated list of
+ * operations <ops>, named as in OPCODE_TO_STRING() without their
+ * IMG_ prefix, into <out_path>. The file is never loaded as a whole,
+ * see pipelineBMP(). Returns 0 on success, 1 on error. */
+int filter_bmp(char * ops, const char * in_path, const char * out_path)
+{
+	enum img_stage stages[IMG_PIPELINE_MAX];
+	uint32_t count = 0;
+	char * saveptr;
+	char * name;
+
+	for (name = strtok_r(ops, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+		uint8_t opcode;
+
+		for (opcode = 0; opcode <= IMG_REGISTER_PATH; opcode++) {
+			if (!strcmp(OPCODE_TO_STRING(opcode) + strlen("IMG_"), name)) {
+				break;
+			}
+		}
+
+		if (opcode > IMG_REGISTER_PATH || opcode_to_stage(opcode) == IMG_STAGES
+		    || opcode == IMG_ROT90CLKW) {
+			fprintf(stderr, "Operation %s cannot be streamed.\n", name);
+			return 1;
+		}
+
+		if (count == IMG_PIPELINE_MAX) {
+			fprintf(stderr, "At most %d operations can be streamed.\n", IMG_PIPELINE_MAX);
+			return 1;
+		}
+		stages[count++] = opcode_to_stage(opcode);
+	}
+
+	if (!count) {
+		fprintf(stderr, "No operation to stream.\n");
+		return 1;
+	}
+
+	if (pipelineBMP(in_path, out_path, stages, count, FILTER_STRIP_BYTES)) {
+		fprintf(stderr, "Unable to filter %s into %s.\n", in_path, out_path);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Decide how many threads should work on <img>. Large images are
+ * split into row bands across the cores of idle workers, but only
+ * while the queue is shallow enough that those workers would have
+ * nothing else to pick up. */
+uint32_t parallel_degree(struct image * img, struct queue * the_queue, size_t workers)
+{
+	size_t queued, idle;
+
+	if ((uint64_t)img->width * img->height < PAR_MIN_PIXELS) {
+		return 1;
+	}
+
+	sem_wait(queue_mutex);
+	queued = the_queue->max_size - the_queue->available;
+	sem_post(queue_mutex);
+
+	idle = workers - __atomic_load_n(&busy_workers, __ATOMIC_RELAXED);
+	if (idle <= queued) {
+		return 1;
+	}
+
+	return 1 + idle - queued;
+}
+
+/* Open a counter for the hardware event <event_name> on the calling
+ * thread. Returns -1 if the event is not known. */
+int setup_event_counter(const char * event_name)
+{
+	uint64_t type, config;
+
+	if (strcmp(event_name, "INSTR") == 0) {
+		type = PERF_TYPE_HARDWARE;
+		config = PERF_COUNT_HW_INSTRUCTIONS;
+	} else if (strcmp(event_name, "L1MISS") == 0) {
+		type = PERF_TYPE_HW_CACHE;
+		config = (PERF_COUNT_HW_CACHE_L1D) |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	} else if (strcmp(event_name, "LLCMISS") == 0) {
+		type = PERF_TYPE_HW_CACHE;
+		config = (PERF_COUNT_HW_CACHE_LL) |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	} else if (strcmp(event_name, "DTLBMISS") == 0) {
+		type = PERF_TYPE_HW_CACHE;
+		config = (PERF_COUNT_HW_CACHE_DTLB) |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	} else {
+		return -1;
+	}
+
+	return setup_perf_counter(type, config);
+}
+
+/* Apply the operation in <req> to <img>, the current version of
+ * the image in <entry>, and return the result. Most operations build
+ * a new image, but the result may also be a new reference to <img>,
+ * or a view of it. */
+struct image * apply_operation(struct request_meta * req, struct image_entry * entry,
+			       struct image * img, uint32_t nthreads)
+{
+	switch (req->request.img_op) {
+	case IMG_ROT90CLKW:
+		/* Only the orientation the pixels are read through
+		 * changes, they are moved once something needs them
+		 * in their canonical layout */
+		img = rotateView(img, 1);
+		break;
+	case IMG_BLUR:
+	    img = blurImage_par(img, nthreads, NULL);
+		break;
+	case IMG_SHARPEN:
+	    img = sharpenImage_par(img, nthreads, NULL);
+		break;
+	case IMG_VERTEDGES:
+	    img = detectVerticalEdges_par(img, nthreads, NULL);
+		break;
+	case IMG_HORIZEDGES:
+	    img = detectHorizontalEdges_par(img, nthreads, NULL);
+		break;
+	case IMG_BLUR5:
+	    img = boxBlurImage_par(img, 2, nthreads, NULL);
+		break;
+	case IMG_BLUR9:
+	    img = boxBlurImage_par(img, 4, nthreads, NULL);
+		break;
+	case IMG_BLUR15:
+	    img = boxBlurImage_par(img, 7, nthreads, NULL);
+		break;
+	case IMG_GAUSS5:
+	    img = gaussianBlur5Image_par(img, nthreads, NULL);
+		break;
+	case IMG_GAUSS7:
+	    img = gaussianBlur7Image_par(img, nthreads, NULL);
+		break;
+	case IMG_LAPLACIAN:
+	    img = detectLaplacianEdges_par(img, nthreads, NULL);
+		break;
+	case IMG_EDGEMAG:
+	    img = detectEdgeMagnitude_par(img, NULL, NULL, nthreads, NULL);
+		break;
+	case IMG_PIPELINE:
+	{
+		enum img_stage stages[IMG_PIPELINE_MAX];
+		for (int i = 0; i < req->pipeline.length; ++i) {
+			stages[i] = opcode_to_stage(req->pipeline.ops[i]);
+		}
+	    img = pipelineImage_par(img, stages, req->pipeline.length, nthreads, NULL);
+		break;
+	}
+	case IMG_RETRIEVE:
+		/* Pin this version until it has been sent */
+		img = shareImage(img);
+		break;
+	case IMG_CLONE:
+		/* The clone shares the pixels until either copy
+		 * is overwritten with a new version */
+		img = shareImage(img);
+		break;
+	case IMG_DELETE:
+		image_entry_delete(entry);
+		img = NULL;
+		break;
+	}
+
+	return img;
+}
+
+/* Take the free slot of image <id> for its generation, to replay the
+ * creation of that image. Slots handed out meanwhile to requests that
+ * were lost in a crash are left free. Returns NULL if the slot is not
+ * free. */
+static struct image_entry * image_entry_claim(uint64_t id)
+{
+	struct image_entry * entry;
+	uint64_t slot = IMAGE_ID_SLOT(id), i;
+
+	while (__atomic_load_n(&image_count, __ATOMIC_RELAXED) <= slot) {
+		uint64_t added;
+
+		image_entry_alloc(&added);
+		image_free_push(added);
+	}
+
+	for (i = 0; i < free_count && free_slots[i] != slot; i++);
+	if (i == free_count) {
+		return NULL;
+	}
+	free_slots[i] = free_slots[--free_count];
+
+	entry = image_entry_at(slot);
+	entry->generation = IMAGE_ID_GEN(id);
+
+	return entry;
+}
+
+/* Apply the record <rec>, with its payload at <payload>, to the
+ * image table. Returns 0 on success and 1 if the record is invalid. */
+static int log_replay_record(const struct log_record * rec, const uint8_t * payload)
 {
-	struct request_meta retval;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_notify);
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+	struct image_entry * src, * dst;
+	struct image * img;
 
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-	retval = the_queue->requests[the_queue->rd_pos];
-	the_queue->rd_pos = (the_queue->rd_pos + 1) % the_queue->max_size;
-	the_queue->available++;
+	if (rec->opcode == IMG_DELETE) {
+		src = image_entry_get(rec->src_id);
+		if (!src) {
+			return 1;
+		}
+		image_entry_delete(src);
+		image_free_push(IMAGE_ID_SLOT(rec->src_id));
+		return 0;
+	}
 
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-	return retval;
-}
+	if (rec->opcode == IMG_REGISTER) {
+		uint32_t dims[2];
 
-void dump_queue_status(struct queue * the_queue)
-{
-	size_t i, j;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+		if (rec->bytes < sizeof(dims)) {
+			return 1;
+		}
+		memcpy(dims, payload, sizeof(dims));
+		if (rec->bytes != sizeof(dims) + (uint64_t)dims[0] * dims[1] * sizeof(uint32_t)) {
+			return 1;
+		}
 
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-	sem_wait(printf_mutex);
-	printf("Q:[");
+		img = createImageUninit(dims[0], dims[1]);
+		memcpy(img->pixels, payload + sizeof(dims), rec->bytes - sizeof(dims));
+		if (image_layout == IMG_PLANAR) {
+			struct image * planar = toPlanarImage(img, NULL);
+			deleteImage(img);
+			img = planar;
+		}
+	} else {
+		struct request_meta req;
 
-	for (i = the_queue->rd_pos, j = 0; j < the_queue->max_size - the_queue->available;
-	     i = (i + 1) % the_queue->max_size, ++j)
-	{
-		printf("R%ld%s", the_queue->requests[i].request.req_id,
-		       ((j+1 != the_queue->max_size - the_queue->available)?",":""));
+		src = image_entry_get(rec->src_id);
+		if (!src || rec->opcode == IMG_UNUSED || rec->opcode > IMG_DELETE
+		    || rec->opcode == IMG_RETRIEVE) {
+			return 1;
+		}
+
+		sem_wait(&src->img_sem);
+		image_entry_restore(src, 0);
+		img = src->img;
+		sem_post(&src->img_sem);
+		if (!img) {
+			return 1;
+		}
+
+		memset(&req, 0, sizeof(req));
+		req.request.img_op = rec->opcode;
+		req.request.overwrite = rec->src_id == rec->dst_id && rec->opcode != IMG_CLONE;
+		req.request.img_id = rec->src_id;
+		if (rec->opcode == IMG_PIPELINE) {
+			if (rec->bytes != sizeof(req.pipeline)) {
+				return 1;
+			}
+			memcpy(&req.pipeline, payload, sizeof(req.pipeline));
+		}
+
+		img = apply_operation(&req, src, img, 1);
 	}
 
-	printf("]\n");
-	sem_post(printf_mutex);
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
+	if (!img) {
+		return 1;
+	}
+
+	/* The result either replaces an image or gets the ID it had */
+	dst = image_entry_get(rec->dst_id);
+	if (dst) {
+		image_entry_publish(dst, img, next_version());
+	} else if ((dst = image_entry_claim(rec->dst_id))) {
+		image_entry_init(dst, img, next_version());
+	} else {
+		deleteImage(img);
+		return 1;
+	}
+
+	return 0;
 }
 
-void register_new_image(int conn_socket, struct request * req)
+/* Replay the records of the log at <path> that come after <*lsn>,
+ * and update <*lsn> to the last one. A torn record at the end, left
+ * by a crash in the middle of a write, ends the log. Returns the size
+ * of the valid part of the log, or -1 if it can't be read. */
+static off_t log_replay(const char * path, uint64_t * lsn)
 {
-	// Protect access to image_entries and image_count
-    sem_wait(&images_array_sem);
+	struct log_record rec;
+	uint8_t * payload = NULL;
+	off_t offset = 0;
+	int fd = open(path, O_RDONLY);
 
-	/* Increase the count of registered images */
-	image_count++;
-
-	/* Reallocate array of image pointers */
-	// Reallocate the array of image entries
-	image_entries = realloc(image_entries, image_count * sizeof(struct image_entry));
+	if (fd == -1) {
+		return -1;
+	}
 
-	/* Read in the new image from socket */
-	struct image * new_img = recvImage(conn_socket);
+	while (pread(fd, &rec, sizeof(rec), offset) == sizeof(rec)) {
+		struct iovec iov;
 
-	/* Store its pointer at the end of the global array */
-	image_entries[image_count - 1].img = new_img;
-	if (sem_init(&image_entries[image_count - 1].img_sem, 0, 1) != 0) {
-		perror("Failed to initialize semaphore for new image");
-		exit(EXIT_FAILURE);
-    }
+		payload = (uint8_t *)realloc(payload, rec.bytes ? rec.bytes : 1);
+		if (!payload || (rec.bytes && pread(fd, payload, rec.bytes, offset + sizeof(rec))
+				 != (ssize_t)rec.bytes)) {
+			break;
+		}
 
-	// After allocating a new image_entry
-	image_entries[image_count - 1].op_counter = 0;
-	image_entries[image_count - 1].next_op = 0;
-	pthread_mutex_init(&image_entries[image_count - 1].order_mutex, NULL);
-	pthread_cond_init(&image_entries[image_count - 1].order_cond, NULL);
+		iov.iov_base = payload;
+		iov.iov_len = rec.bytes;
+		if (rec.check != log_checksum(&rec, &iov, 1)) {
+			break;
+		}
 
+		/* Records already in the snapshot are skipped */
+		if (rec.lsn > *lsn) {
+			if (log_replay_record(&rec, payload)) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid record %lu in operation log %s\n", rec.lsn, path);
+				break;
+			}
+			*lsn = rec.lsn;
+			log_replayed++;
+		}
+		offset += sizeof(rec) + rec.bytes;
+	}
 
-	// Free access to image registeration
-	sem_post(&images_array_sem);
+	free(payload);
+	close(fd);
 
-	// Protect socket operations
-    sem_wait(&socket_sem);
+	return offset;
+}
 
-	/* Immediately provide a response to the client */
-	struct response resp;
-	resp.req_id = req->req_id;
-	resp.img_id = image_count - 1;
-	resp.ack = RESP_COMPLETED;
+/* Bring the image table up to date with the operation log moved aside
+ * by the last snapshot, if any, and the current one, and open the
+ * latter for appending. Returns 0 on success and 1 on error. */
+int log_recover(void)
+{
+	char * old_path = log_old_path();
+	uint64_t lsn = snapshot_lsn;
+	off_t end;
+
+	log_replay(old_path, &lsn);
+	free(old_path);
+
+	/* Anything after the last valid record is dropped, so that new
+	 * records directly follow it */
+	end = log_replay(log_path, &lsn);
+	log_fd = open(log_path, O_WRONLY | O_CREAT, 0644);
+	if (log_fd == -1 || ftruncate(log_fd, end > 0 ? end : 0) != 0) {
+		ERROR_INFO();
+		perror("Unable to open operation log");
+		return 1;
+	}
+	log_end = end > 0 ? end : 0;
+	log_lsn = log_durable = lsn;
 
-	send(conn_socket, &resp, sizeof(struct response), 0);
+	if (log_replayed) {
+		printf("INFO: replayed %lu operations from %s\n", log_replayed, log_path);
+	}
 
-	sem_post(&socket_sem);
+	return 0;
 }
 
 /* Main logic of the worker thread */
@@ -285,6 +2566,20 @@ void * worker_main (void * arg)
 
 	struct timespec now;
 	struct worker_params * params = (struct worker_params *)arg;
+	int evt_fd = -1;
+
+	/* Counters only see the thread that opens them */
+	if (params->event_name != NULL) {
+		evt_fd = setup_event_counter(params->event_name);
+		if (evt_fd == -1) {
+			/* main() checked that it opens: keep serving */
+			ERROR_INFO();
+			fprintf(stderr, "Unable to count event %s, continuing without it\n",
+				params->event_name);
+		} else {
+			ioctl(evt_fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
 
 	/* Print the first alive message. */
 	clock_gettime(CLOCK_MONOTONIC, &now);
@@ -295,132 +2590,238 @@ void * worker_main (void * arg)
 
 		struct request_meta req;
 		struct response resp;
-		struct image * img = NULL;
-		uint64_t img_id;
+		struct image * img = NULL, * result;
+		struct image_entry * entry;
+		struct content_entry * content;
+		uint64_t img_id, version, new_version, lsn;
+		uint32_t nthreads;
+		uint8_t logged, cut_held = 0;
+
+		/* Nothing left to do for now: the records logged so far
+		 * may be what the client is waiting for */
+		if (log_path && __atomic_load_n(&params->the_queue->available, __ATOMIC_RELAXED)
+		    == params->the_queue->max_size) {
+			log_kick();
+		}
 		req = get_from_queue(params->the_queue);
 
 		/* Detect wakeup after termination asserted */
 		if (params->worker_done)
 			break;
 
+		__atomic_add_fetch(&busy_workers, 1, __ATOMIC_RELAXED);
+
 		clock_gettime(CLOCK_MONOTONIC, &req.start_timestamp);
 
 		img_id = req.request.img_id;
-		/* Find the image to work on */
-
-		// Protect access to the image entry's next_op
-		pthread_mutex_lock(&image_entries[img_id].order_mutex);
-		uint64_t my_seq_num = image_entries[img_id].next_op++;
-		pthread_mutex_unlock(&image_entries[img_id].order_mutex);
-
-		// Before starting the operation
-		pthread_mutex_lock(&image_entries[img_id].order_mutex);
-		while (image_entries[img_id].op_counter < my_seq_num) {
-			pthread_cond_wait(&image_entries[img_id].order_cond, &image_entries[img_id].order_mutex);
+		/* Find the image to work on. Requests for unknown IDs
+		 * are rejected before they are queued, but the image
+		 * may be marked for deletion since. */
+		entry = image_entry_at(IMAGE_ID_SLOT(img_id));
+		assert(entry != NULL);
+
+		// Wait for the requests queued earlier on the image
+		pthread_mutex_lock(&entry->order_mutex);
+		while (entry->op_counter < req.ticket) {
+			pthread_cond_wait(&entry->order_cond, &entry->order_mutex);
+		}
+		pthread_mutex_unlock(&entry->order_mutex);
+
+		/* A deletion queued before this request would have
+		 * been seen at enqueue time, so the slot can't have
+		 * been reused since. Still, don't work on whatever
+		 * image holds it now if it was. */
+		if ((entry->generation & IMAGE_GEN_MASK) != IMAGE_ID_GEN(img_id)) {
+			resp.req_id = req.request.req_id;
+			resp.ack = RESP_REJECTED;
+
+			pthread_mutex_lock(&entry->order_mutex);
+			entry->op_counter++;
+			pthread_cond_broadcast(&entry->order_cond);
+			pthread_mutex_unlock(&entry->order_mutex);
+			__atomic_sub_fetch(&busy_workers, 1, __ATOMIC_RELAXED);
+
+			sem_wait(&socket_sem);
+			send(params->conn_socket, &resp, sizeof(struct response), 0);
+			sem_post(&socket_sem);
+			continue;
 		}
-		pthread_mutex_unlock(&image_entries[img_id].order_mutex);
 
-		// Acquire the semaphore for the specific image
-        sem_wait(&image_entries[img_id].img_sem);
+		/* Image payloads are immutable once published: the
+		 * operations below build a new version, and pinned
+		 * readers keep the old one alive. img_sem only guards
+		 * swapping versions. Operations on this entry run one
+		 * at a time, so its version can't change under us. */
+		sem_wait(&entry->img_sem);
+		if (req.request.img_op != IMG_DELETE) {
+			image_entry_restore(entry, 0);
+		}
+		img = entry->img;
+		version = entry->version;
+		lsn = entry->lsn;
+		content = entry->content;
+		entry->referenced = 1;
+		entry->last_use = now_ns();
+		sem_post(&entry->img_sem);
+		store_sweep();
+
+		assert(img != NULL || req.request.img_op == IMG_DELETE);
+
+		nthreads = img ? parallel_degree(img, params->the_queue, params->workers) : 1;
+
+		/* Anything but a retrieve changes the image table, and
+		 * has to be logged along with the change. Deletions
+		 * change it as they run. */
+		logged = log_path && req.request.img_op != IMG_RETRIEVE;
+		if (logged && req.request.img_op == IMG_DELETE) {
+			pthread_rwlock_rdlock(&log_cut);
+			cut_held = 1;
+		}
 
-		img = image_entries[img_id].img;
+		// Reset the counter before the image operation
+		if (evt_fd != -1) {
+			ioctl(evt_fd, PERF_EVENT_IOC_RESET, 0);
+		}
 
-		assert(img != NULL);
+		/* Reuse the result of the same operation on this
+		 * version, if it is still cached */
+		result = NULL;
+		new_version = version;
+		if (result_cache_limit && result_cacheable(req.request.img_op)) {
+			result = result_find(version, req.request.img_op, &new_version, 1);
+		}
 
-		switch (req.request.img_op) {
-		case IMG_ROT90CLKW:
-			img = rotate90Clockwise(img, NULL);
-			break;
-		case IMG_BLUR:
-		    img = blurImage(img, NULL);
-			break;
-		case IMG_SHARPEN:
-		    img = sharpenImage(img, NULL);
-			break;
-		case IMG_VERTEDGES:
-		    img = detectVerticalEdges(img, NULL);
-			break;
-		case IMG_HORIZEDGES:
-		    img = detectHorizontalEdges(img, NULL);
-			break;
+		if (result) {
+			img = result;
+		} else {
+			img = apply_operation(&req, entry, img, nthreads);
+
+			/* Anything but a retrieve, a clone or a deletion is
+			 * new content */
+			if (req.request.img_op != IMG_RETRIEVE && req.request.img_op != IMG_CLONE
+			    && req.request.img_op != IMG_DELETE) {
+				new_version = next_version();
+				if (result_cache_limit && result_cacheable(req.request.img_op)) {
+					result_add(version, req.request.img_op, img, new_version);
+				}
+			}
 		}
 
-		if (req.request.img_op != IMG_RETRIEVE) {
-			if (req.request.overwrite) {
-				/* Deallocate the previous image */
-				deleteImage(image_entries[img_id].img);
-				// Store the new image
-            	image_entries[img_id].img = img;
-			} else {
-				// Register the new image
-				sem_wait(&images_array_sem);
+		if (logged && !cut_held) {
+			pthread_rwlock_rdlock(&log_cut);
+			cut_held = 1;
+		}
 
-				// Increase image count
-				image_count++;
+		if (req.request.img_op == IMG_RETRIEVE || req.request.img_op == IMG_DELETE) {
+			/* Nothing to store */
+		} else if (req.request.img_op == IMG_CLONE || !req.request.overwrite) {
+			// Register the new image, and reply with its ID
+			img_id = image_entry_new(img, new_version);
 
-				// Reallocate the array
-				image_entries = realloc(image_entries, image_count * sizeof(struct image_entry));
+			/* A clone holds the same content as its source */
+			if (req.request.img_op == IMG_CLONE && content) {
+				content_hold(content);
+				image_entry_get(img_id)->content = content;
+			}
+		} else {
+			image_entry_publish(entry, img, new_version);
+		}
 
-				// Store the new image and initialize its semaphore
-				image_entries[image_count - 1].img = img;
-				if (sem_init(&image_entries[image_count - 1].img_sem, 0, 1) != 0) {
-					perror("Failed to initialize semaphore for new image");
-					exit(EXIT_FAILURE);
-				}
+		/* Now provide a response! */
+		resp.req_id = req.request.req_id;
+		resp.ack = RESP_COMPLETED;
+		resp.img_id = img_id;
 
-				// Update img_id
-				img_id = image_count - 1;
+		/* Logged operations are acknowledged by the logging
+		 * thread once they are on disk */
+		if (logged) {
+			uint64_t lsn = log_operation(&req, img_id, params->conn_socket, &resp);
 
-				sem_post(&images_array_sem);
+			if (req.request.img_op != IMG_DELETE) {
+				image_entry_at(IMAGE_ID_SLOT(img_id))->lsn = lsn;
 			}
+			pthread_rwlock_unlock(&log_cut);
 		}
 
-		// Release the semaphore for the image
-        sem_post(&image_entries[img_id].img_sem);
+		// Read the counter after the image operation
+		uint64_t event_count = 0;
+		if (evt_fd != -1) {
+			event_count = read_perf_counter(evt_fd);
+		}
 
 		// After completing the operation
-		pthread_mutex_lock(&image_entries[img_id].order_mutex);
-		image_entries[img_id].op_counter++;
-		pthread_cond_broadcast(&image_entries[img_id].order_cond);
-		pthread_mutex_unlock(&image_entries[img_id].order_mutex);
+		pthread_mutex_lock(&entry->order_mutex);
+		entry->op_counter++;
+		pthread_cond_broadcast(&entry->order_cond);
+		pthread_mutex_unlock(&entry->order_mutex);
+		__atomic_sub_fetch(&entry->pending, 1, __ATOMIC_RELEASE);
+
+		/* Nothing refers to the slot of a deleted image anymore */
+		if (req.request.img_op == IMG_DELETE) {
+			image_free_push(IMAGE_ID_SLOT(req.request.img_id));
+		}
 
 		clock_gettime(CLOCK_MONOTONIC, &req.completion_timestamp);
+		__atomic_sub_fetch(&busy_workers, 1, __ATOMIC_RELAXED);
 
-		/* Now provide a response! */
-		resp.req_id = req.request.req_id;
-		resp.ack = RESP_COMPLETED;
-		resp.img_id = img_id;
+		/* Don't show a version that a crash could still undo */
+		if (log_path && req.request.img_op == IMG_RETRIEVE) {
+			log_wait(lsn);
+		}
 
 		// Before sending the response
-		sem_wait(&socket_sem);
+		if (!logged) {
+			sem_wait(&socket_sem);
 
-		send(params->conn_socket, &resp, sizeof(struct response), 0);
+			send(params->conn_socket, &resp, sizeof(struct response), 0);
 
-		/* In case of IMG_RETRIEVE, we need to send out the
-		 * actual image payload! */
-		if (req.request.img_op == IMG_RETRIEVE) {
-			uint8_t err = sendImage(img, params->conn_socket);
+			/* In case of IMG_RETRIEVE, we need to send out the
+			 * actual image payload! */
+			if (req.request.img_op == IMG_RETRIEVE) {
+				uint8_t err = sendImage(img, params->conn_socket);
 
-			if(err) {
-				ERROR_INFO();
-				perror("Unable to send image payload to client.");
+				if(err) {
+					ERROR_INFO();
+					perror("Unable to send image payload to client.");
+				}
 			}
+
+			sem_post(&socket_sem);
 		}
 
-		sem_post(&socket_sem);
+		/* Unpin the version that was sent */
+		if (req.request.img_op == IMG_RETRIEVE) {
+			deleteImage(img);
+		}
 
-		printf("T%d R%ld:%lf,%s,%d,%ld,%ld,%lf,%lf,%lf\n",
-		       params->worker_id, req.request.req_id,
-		       TSPEC_TO_DOUBLE(req.request.req_timestamp),
-		       OPCODE_TO_STRING(req.request.img_op),
-		       req.request.overwrite, req.request.img_id, img_id,
-		       TSPEC_TO_DOUBLE(req.receipt_timestamp),
-		       TSPEC_TO_DOUBLE(req.start_timestamp),
-		       TSPEC_TO_DOUBLE(req.completion_timestamp));
+		if (evt_fd == -1) {
+			printf("T%d R%ld:%lf,%s,%d,%ld,%ld,%lf,%lf,%lf\n",
+			       params->worker_id, req.request.req_id,
+			       TSPEC_TO_DOUBLE(req.request.req_timestamp),
+			       OPCODE_TO_STRING(req.request.img_op),
+			       req.request.overwrite, req.request.img_id, img_id,
+			       TSPEC_TO_DOUBLE(req.receipt_timestamp),
+			       TSPEC_TO_DOUBLE(req.start_timestamp),
+			       TSPEC_TO_DOUBLE(req.completion_timestamp));
+		} else {
+			printf("T%d R%ld:%lf,%s,%d,%ld,%ld,%lf,%lf,%lf,%s,%lu\n",
+			       params->worker_id, req.request.req_id,
+			       TSPEC_TO_DOUBLE(req.request.req_timestamp),
+			       OPCODE_TO_STRING(req.request.img_op),
+			       req.request.overwrite, req.request.img_id, img_id,
+			       TSPEC_TO_DOUBLE(req.receipt_timestamp),
+			       TSPEC_TO_DOUBLE(req.start_timestamp),
+			       TSPEC_TO_DOUBLE(req.completion_timestamp),
+			       params->event_name, event_count);
+		}
 
 		dump_queue_status(params->the_queue);
 	}
 
+	if (evt_fd != -1) {
+		close(evt_fd);
+	}
+
 	return NULL;
 }
 
@@ -474,6 +2875,8 @@ int control_workers(enum worker_command cmd, size_t worker_count,
 			worker_params[i]->the_queue = common_params->the_queue;
 			worker_params[i]->worker_done = 0;
 			worker_params[i]->worker_id = i;
+			worker_params[i]->workers = worker_count;
+			worker_params[i]->event_name = common_params->event_name;
 		}
 
 
@@ -564,18 +2967,70 @@ int control_workers(enum worker_command cmd, size_t worker_count,
 	return EXIT_SUCCESS;
 }
 
+/* Answer <req> right away from the result cache, provided that no
+ * other operation on its image is queued or running. On a hit, the
+ * response is sent, the ID of the image holding the result is stored
+ * in <img_id> and 1 is returned. Otherwise, 0 is returned. */
+int serve_cached_result(int conn_socket, struct request * req, uint64_t * img_id)
+{
+	struct image_entry * entry = image_entry_get(req->img_id);
+	struct image * img;
+	struct response resp;
+	uint64_t version;
+
+	if (!entry || !result_cacheable(req->img_op)
+	    || __atomic_load_n(&entry->pending, __ATOMIC_ACQUIRE) != 0) {
+		return 0;
+	}
+
+	img = result_find(entry->version, req->img_op, &version, 0);
+	if (!img) {
+		return 0;
+	}
+
+	if (log_path) {
+		pthread_rwlock_rdlock(&log_cut);
+	}
+
+	if (req->overwrite) {
+		image_entry_publish(entry, img, version);
+		*img_id = req->img_id;
+	} else {
+		*img_id = image_entry_new(img, version);
+	}
+
+	resp.req_id = req->req_id;
+	resp.img_id = *img_id;
+	resp.ack = RESP_COMPLETED;
+
+	if (log_path) {
+		image_entry_get(*img_id)->lsn = log_append(req->img_op, req->img_id, *img_id,
+							   NULL, 0, conn_socket, &resp);
+		pthread_rwlock_unlock(&log_cut);
+		log_kick();
+	} else {
+		sem_wait(&socket_sem);
+		send(conn_socket, &resp, sizeof(struct response), 0);
+		sem_post(&socket_sem);
+	}
+
+	return 1;
+}
+
 /* Main function to handle connection with the client. This function
  * takes in input conn_socket and returns only when the connection
  * with the client is interrupted. */
 void handle_connection(int conn_socket, struct connection_params conn_params)
 {
 	struct request_meta * req;
+	struct image_entry * entry;
 	struct queue * the_queue;
 	size_t in_bytes;
 
 	/* The connection with the client is alive here. Let's start
 	 * the worker thread. */
 	struct worker_params common_worker_params;
+	pthread_t compactor, checkpointer, logger;
 	int res;
 
 	/* Now handle queue allocation and initialization */
@@ -584,8 +3039,44 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
 
 	common_worker_params.conn_socket = conn_socket;
 	common_worker_params.the_queue = the_queue;
+	common_worker_params.event_name = conn_params.event_name;
+
+	/* Helper threads that let a worker spread a large image over
+	 * the cores of the other, idle workers */
+	if (imgPoolInit(conn_params.workers - 1)) {
+		ERROR_INFO();
+		perror("Unable to start image helper threads");
+	}
+
 	res = control_workers(WORKERS_START, conn_params.workers, &common_worker_params);
 
+	if (log_path) {
+		logger_done = 0;
+		if (pthread_create(&logger, NULL, logger_main, NULL) != 0) {
+			ERROR_INFO();
+			perror("Unable to start the logging thread");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (snapshot_path && snapshot_period_ns) {
+		checkpointer_done = 0;
+		if (pthread_create(&checkpointer, NULL, checkpointer_main, NULL) != 0) {
+			ERROR_INFO();
+			perror("Unable to start the checkpointer thread");
+			snapshot_period_ns = 0;
+		}
+	}
+
+	if (compact_idle_ns) {
+		compactor_done = 0;
+		if (pthread_create(&compactor, NULL, compactor_main, NULL) != 0) {
+			ERROR_INFO();
+			perror("Unable to start the compactor thread");
+			compact_idle_ns = 0;
+		}
+	}
+
 	/* Do not continue if there has been a problem while starting
 	 * the workers. */
 	if (res != EXIT_SUCCESS) {
@@ -593,6 +3084,7 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
 
 		/* Stop any worker that was successfully started */
 		control_workers(WORKERS_STOP, conn_params.workers, NULL);
+		imgPoolDestroy();
 		return;
 	}
 
@@ -611,31 +3103,110 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
 		 * and resp varaibles, and shutdown the socket. */
 		if (in_bytes > 0) {
 
-			/* Handle image registration right away! */
-			if(req->request.img_op == IMG_REGISTER) {
+			/* Handle image registration right away! Files that
+			 * can't be loaded are rejected. */
+			res = 0;
+			if (req->request.img_op == IMG_REGISTER
+			    || req->request.img_op == IMG_REGISTER_PATH) {
+				uint64_t img_id = 0;
+
 				clock_gettime(CLOCK_MONOTONIC, &req->start_timestamp);
 
-				register_new_image(conn_socket, &req->request);
+				if (req->request.img_op == IMG_REGISTER) {
+					img_id = register_new_image(conn_socket, &req->request);
+				} else {
+					res = register_path_image(conn_socket, &req->request, &img_id);
+				}
 
 				clock_gettime(CLOCK_MONOTONIC, &req->completion_timestamp);
 
-				sync_printf("T%ld R%ld:%lf,%s,%d,%ld,%ld,%lf,%lf,%lf\n",
-				       conn_params.workers, req->request.req_id,
-				       TSPEC_TO_DOUBLE(req->request.req_timestamp),
-				       OPCODE_TO_STRING(req->request.img_op),
-				       req->request.overwrite, req->request.img_id,
-				       image_count - 1, /* Registered ID on server side */
-				       TSPEC_TO_DOUBLE(req->receipt_timestamp),
-				       TSPEC_TO_DOUBLE(req->start_timestamp),
-				       TSPEC_TO_DOUBLE(req->completion_timestamp));
-
-				dump_queue_status(the_queue);
-				continue;
+				if (!res) {
+					sync_printf("T%ld R%ld:%lf,%s,%d,%ld,%ld,%lf,%lf,%lf\n",
+					       conn_params.workers, req->request.req_id,
+					       TSPEC_TO_DOUBLE(req->request.req_timestamp),
+					       OPCODE_TO_STRING(req->request.img_op),
+					       req->request.overwrite, req->request.img_id,
+					       img_id, /* Registered ID on server side */
+					       TSPEC_TO_DOUBLE(req->receipt_timestamp),
+					       TSPEC_TO_DOUBLE(req->start_timestamp),
+					       TSPEC_TO_DOUBLE(req->completion_timestamp));
+
+					dump_queue_status(the_queue);
+					continue;
+				}
+			}
+
+			/* The list of operations of a pipeline follows the
+			 * request on the socket */
+			if (req->request.img_op == IMG_PIPELINE
+			    && recv_pipeline(conn_socket, &req->pipeline)) {
+				res = 1;
+			}
+
+			/* Reject operations on images that were never
+			 * registered, or lost in a crash */
+			entry = image_entry_get(req->request.img_id);
+			if (!entry || image_entry_missing(entry)) {
+				res = 1;
+			}
+
+			/* Results already computed for this version of the
+			 * image don't need to go through the queue */
+			if (!res && result_cache_limit) {
+				uint64_t img_id;
+
+				clock_gettime(CLOCK_MONOTONIC, &req->start_timestamp);
+				if (serve_cached_result(conn_socket, &req->request, &img_id)) {
+					clock_gettime(CLOCK_MONOTONIC, &req->completion_timestamp);
+
+					sync_printf("T%ld R%ld:%lf,%s,%d,%ld,%ld,%lf,%lf,%lf\n",
+					       conn_params.workers, req->request.req_id,
+					       TSPEC_TO_DOUBLE(req->request.req_timestamp),
+					       OPCODE_TO_STRING(req->request.img_op),
+					       req->request.overwrite, req->request.img_id, img_id,
+					       TSPEC_TO_DOUBLE(req->receipt_timestamp),
+					       TSPEC_TO_DOUBLE(req->start_timestamp),
+					       TSPEC_TO_DOUBLE(req->completion_timestamp));
+
+					dump_queue_status(the_queue);
+					continue;
+				}
 			}
 
-			res = add_to_queue(*req, the_queue);
+			if (!res) {
+				/* Requests that follow a deletion are rejected,
+				 * those before it still go through */
+				uint8_t deleting = req->request.img_op == IMG_DELETE;
+
+				if (deleting) {
+					__atomic_store_n(&entry->live, 0, __ATOMIC_RELEASE);
+				}
+				__atomic_add_fetch(&entry->pending, 1, __ATOMIC_RELAXED);
+
+				/* Operations on an image run in the order
+				 * they were queued in */
+				pthread_mutex_lock(&entry->order_mutex);
+				req->ticket = entry->next_op++;
+				res = add_to_queue(*req, the_queue);
+				if (res) {
+					entry->next_op--;
+				}
+				pthread_mutex_unlock(&entry->order_mutex);
+
+				if (res) {
+					__atomic_sub_fetch(&entry->pending, 1, __ATOMIC_RELAXED);
+					if (deleting) {
+						__atomic_store_n(&entry->live, 1, __ATOMIC_RELEASE);
+					}
+				} else if (!deleting && (store_budget || compact_idle_ns
+							 || snapshot_fd != -1)) {
+					store_prefetch(entry);
+				}
+			}
 
-			/* The queue is full if the return value is 1 */
+			/* The queue is full, the pipeline or image ID was
+			 * invalid, or the file to register could not be
+			 * loaded, if the return value is 1 */
 			if (res) {
 				struct response resp;
 				/* Now provide a response! */
@@ -657,12 +3228,69 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
 
 
 	/* Stop all the worker threads. */
+	if (compact_idle_ns) {
+		compactor_done = 1;
+		pthread_join(compactor, NULL);
+	}
+	if (snapshot_path && snapshot_period_ns) {
+		checkpointer_done = 1;
+		pthread_join(checkpointer, NULL);
+	}
 	control_workers(WORKERS_STOP, conn_params.workers, NULL);
 
+	/* Acknowledge the last records before the socket goes away */
+	if (log_path) {
+		pthread_mutex_lock(&log_mutex);
+		logger_done = 1;
+		pthread_cond_signal(&log_work);
+		pthread_mutex_unlock(&log_mutex);
+		pthread_join(logger, NULL);
+	}
+
+	/* The workers are done with the images: save them all */
+	if (snapshot_path) {
+		snapshot_save();
+	}
+	imgPoolDestroy();
+
 	free(req);
 	shutdown(conn_socket, SHUT_RDWR);
 	close(conn_socket);
 	printf("INFO: Client disconnected.\n");
+	if (delete_count) {
+		printf("INFO: %lu images deleted, %lu of %lu slots free\n",
+		       delete_count, free_count, image_count);
+	}
+	if (dedup_images) {
+		printf("INFO: %lu registrations shared one of %lu distinct images\n",
+		       content_hits, content_count);
+	}
+	if (store_budget) {
+		printf("INFO: image store: %lu of %lu bytes in memory, "
+		       "%lu images spilled, %lu mapped back\n",
+		       store_bytes, store_budget, spill_count, fault_count);
+	}
+	if (compact_idle_ns) {
+		printf("INFO: compactor: %lu images compressed, %lu decompressed, "
+		       "%lu bytes held in %lu\n",
+		       compact_count, expand_count, compact_raw, compact_bytes);
+	}
+	if (snapshot_path) {
+		printf("INFO: saved %lu snapshots of %lu images to %s\n",
+		       snapshot_count, image_count, snapshot_path);
+	}
+	if (log_path) {
+		printf("INFO: operation log: %lu records in %lu commits\n",
+		       log_lsn - snapshot_lsn - log_replayed, log_commits);
+	}
+	if (result_cache_limit) {
+		printf("INFO: result cache: %lu hits, %lu misses (%.1f%% hit rate), "
+		       "%lu results in %lu of %lu bytes\n",
+		       result_hits, result_misses,
+		       (result_hits + result_misses) ?
+		       100.0 * result_hits / (result_hits + result_misses) : 0.0,
+		       result_count, result_bytes, result_cache_limit);
+	}
 }
 
 
@@ -679,11 +3307,26 @@ int main (int argc, char ** argv) {
 	conn_params.queue_size = 0;
 	conn_params.queue_policy = QUEUE_FIFO;
 	conn_params.workers = 1;
+	conn_params.event_name = NULL;
+
+
+	if (sem_init(&store_sem, 0, 1) != 0) {
+		perror("Failed to initialize image store semaphore");
+		exit(EXIT_FAILURE);
+	}
+
+	if (sem_init(&result_sem, 0, 1) != 0) {
+		perror("Failed to initialize result cache semaphore");
+		exit(EXIT_FAILURE);
+	}
 
+	if (sem_init(&free_sem, 0, 1) != 0) {
+		perror("Failed to initialize free slot semaphore");
+		exit(EXIT_FAILURE);
+	}
 
-	// initialize the images_array_sem semaphore
-	if (sem_init(&images_array_sem, 0, 1) != 0) {
-		perror("Failed to initialize images array semaphore");
+	if (sem_init(&content_sem, 0, 1) != 0) {
+		perror("Failed to initialize content index semaphore");
 		exit(EXIT_FAILURE);
 	}
 
@@ -694,7 +3337,7 @@ int main (int argc, char ** argv) {
 
 
 	/* Parse all the command line arguments */
-	while((opt = getopt(argc, argv, "q:w:p:")) != -1) {
+	while((opt = getopt(argc, argv, "q:w:p:l:h:Hdc:m:z:s:S:j:I:R:F:")) != -1) {
 		switch (opt) {
 		case 'q':
 			conn_params.queue_size = strtol(optarg, NULL, 10);
@@ -715,19 +3358,174 @@ int main (int argc, char ** argv) {
 				conn_params.queue_policy = QUEUE_FIFO;
 			} else {
 				ERROR_INFO();
-				fprintf(stderr, "Invalid queue policy.\n" USAGE_STRING, argv[0]);
+				fprintf(stderr, "Invalid queue policy.\n" USAGE_STRING, argv[0], argv[0]);
 				return EXIT_FAILURE;
 			}
 			printf("INFO: setting queue policy = %s\n", optarg);
 			break;
+		case 'l':
+			if (!strcmp(optarg, "packed")) {
+				image_layout = IMG_PACKED;
+			} else if (!strcmp(optarg, "planar")) {
+				image_layout = IMG_PLANAR;
+			} else {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid image layout.\n" USAGE_STRING, argv[0], argv[0]);
+				return EXIT_FAILURE;
+			}
+			printf("INFO: setting image layout = %s\n", optarg);
+			break;
+		case 'h':
+			conn_params.event_name = optarg;
+			if (strcmp(optarg, "INSTR") != 0 &&
+			    strcmp(optarg, "L1MISS") != 0 &&
+			    strcmp(optarg, "LLCMISS") != 0 &&
+			    strcmp(optarg, "DTLBMISS") != 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid event name.\n" USAGE_STRING, argv[0], argv[0]);
+				return EXIT_FAILURE;
+			}
+			printf("INFO: setting event name = %s\n", optarg);
+			break;
+		case 'H':
+			imgSetHugePages(HUGE_PAGE_MIN_BYTES);
+			printf("INFO: using huge pages for images of %d bytes or more\n",
+			       HUGE_PAGE_MIN_BYTES);
+			break;
+		case 'c':
+			result_cache_limit = strtoull(optarg, NULL, 10) << 20;
+			printf("INFO: setting result cache size = %s MB\n", optarg);
+			break;
+		case 'm':
+			store_budget = strtoull(optarg, NULL, 10);
+			printf("INFO: setting image memory budget = %lu bytes\n", store_budget);
+			break;
+		case 'z':
+			compact_idle_ns = strtod(optarg, NULL) * NANO_IN_SEC;
+			printf("INFO: compressing images idle for %s s\n", optarg);
+			break;
+		case 's':
+			snapshot_path = optarg;
+			printf("INFO: setting snapshot file = %s\n", optarg);
+			break;
+		case 'S':
+			snapshot_period_ns = strtod(optarg, NULL) * NANO_IN_SEC;
+			printf("INFO: saving a snapshot every %s s\n", optarg);
+			break;
+		case 'j':
+			log_path = optarg;
+			printf("INFO: setting operation log = %s\n", optarg);
+			break;
+		case 'd':
+			dedup_images = 1;
+			printf("INFO: sharing images registered with the same content\n");
+			break;
+		case 'I':
+			preload_dir = optarg;
+			printf("INFO: setting image directory = %s\n", optarg);
+			break;
+		case 'R':
+			register_dir = realpath(optarg, NULL);
+			if (!register_dir) {
+				ERROR_INFO();
+				perror("Unable to resolve register directory");
+				return EXIT_FAILURE;
+			}
+			printf("INFO: registering files named by clients from %s\n", register_dir);
+			break;
+		case 'F':
+			filter_ops = optarg;
+			break;
 		default: /* '?' */
-			fprintf(stderr, USAGE_STRING, argv[0]);
+			fprintf(stderr, USAGE_STRING, argv[0], argv[0]);
+		}
+	}
+
+	/* Filter a single file and leave, no server involved */
+	if (filter_ops) {
+		if (argc - optind != 2) {
+			ERROR_INFO();
+			fprintf(stderr, USAGE_STRING, argv[0], argv[0]);
+			return EXIT_FAILURE;
 		}
+		return filter_bmp(filter_ops, argv[optind], argv[optind + 1])
+			? EXIT_FAILURE : EXIT_SUCCESS;
 	}
 
 	if (!conn_params.queue_size) {
 		ERROR_INFO();
-		fprintf(stderr, USAGE_STRING, argv[0]);
+		fprintf(stderr, USAGE_STRING, argv[0], argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Each worker opens its own counter: make sure the event can be
+	 * counted before accepting requests that nobody would process */
+	if (conn_params.event_name) {
+		int evt_fd = setup_event_counter(conn_params.event_name);
+
+		if (evt_fd == -1) {
+			ERROR_INFO();
+			fprintf(stderr, "Unable to count event %s\n", conn_params.event_name);
+			return EXIT_FAILURE;
+		}
+		close(evt_fd);
+	}
+
+	spill_page = sysconf(_SC_PAGESIZE);
+
+	/* Images over the memory budget go to an anonymous spill file */
+	if (store_budget) {
+		char spill_path[] = "/tmp/imgspill-XXXXXX";
+		uint64_t pool_bytes = store_budget / STORE_POOL_SHARE;
+
+		imgSetPoolLimit(pool_bytes);
+		store_budget -= pool_bytes;
+		printf("INFO: keeping up to %lu bytes of freed pixel buffers for reuse\n",
+		       pool_bytes);
+
+		spill_fd = mkstemp(spill_path);
+		if (spill_fd == -1) {
+			ERROR_INFO();
+			perror("Unable to create spill file");
+			return EXIT_FAILURE;
+		}
+		unlink(spill_path);
+	}
+
+	/* Images restored from a snapshot are mapped in as needed */
+	if (snapshot_path && snapshot_restore()) {
+		return EXIT_FAILURE;
+	}
+
+	/* Then replay what happened since that snapshot */
+	if (log_path) {
+		pthread_rwlockattr_t attr;
+		pthread_condattr_t cond_attr;
+
+		/* Snapshots must not wait for a break in the stream of
+		 * operations */
+		pthread_rwlockattr_init(&attr);
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+		pthread_rwlock_init(&log_cut, &attr);
+		pthread_rwlockattr_destroy(&attr);
+
+		/* Partial batches are written out after a delay measured
+		 * with now_ns() */
+		pthread_condattr_init(&cond_attr);
+		pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&log_work, &cond_attr);
+		pthread_condattr_destroy(&cond_attr);
+
+		if (log_recover()) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* A restored image table already holds what an earlier run
+	 * preloaded, under the same IDs */
+	if (preload_dir && image_count) {
+		printf("INFO: images restored, not preloading %s\n", preload_dir);
+	} else if (preload_dir && preload_images(preload_dir, conn_params.workers)) {
 		return EXIT_FAILURE;
 	}
 
@@ -736,7 +3534,7 @@ int main (int argc, char ** argv) {
 		printf("INFO: setting server port as: %d\n", socket_port);
 	} else {
 		ERROR_INFO();
-		fprintf(stderr, USAGE_STRING, argv[0]);
+		fprintf(stderr, USAGE_STRING, argv[0], argv[0]);
 		return EXIT_FAILURE;
 	}
 